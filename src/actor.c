@@ -0,0 +1,215 @@
+
+/*
+ *  actor.c
+ *  Part of Amuleta, a traditional roguelike - https://deveah.github.io/amuleta
+ *  (c) Vlad Dumitru, <dalv.urtimud@gmail.com>
+ *  Licensed under the terms and conditions of the MIT License. Please consult
+ *  the LICENSE file included with this project.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "amuleta.h"
+
+/*
+ *  allocates an empty actor pool
+ *
+ *  struct actor_pool *return -- the actor pool
+ */
+struct actor_pool *create_actor_pool(void)
+{
+  struct actor_pool *p = (struct actor_pool*)malloc(sizeof(struct actor_pool));
+  assert(p != NULL);
+  DEBUG("Allocated actor pool @0x%p\n", p);
+
+  p->slab       = NULL;
+  p->slabs      = 0;
+  p->max_slabs  = 0;
+  p->used       = 0;
+  p->count      = 0;
+  p->free_slot  = -1;
+
+  return p;
+}
+
+/*
+ *  frees an actor pool, together with every actor it holds; this costs one
+ *  free(3) per slab, however many actors have lived in it
+ *
+ *  struct actor_pool *p -- the actor pool
+ *  void return
+ */
+void destroy_actor_pool(struct actor_pool *p)
+{
+  int i;
+
+  DEBUG("Deallocating actor pool @0x%p (%i slabs)\n", p, p->slabs);
+
+  for (i = 0; i < p->slabs; i++) {
+    free(p->slab[i]);
+  }
+
+  free(p->slab);
+  free(p);
+}
+
+/*
+ *  takes a slot out of the pool, growing the pool by a whole slab if there
+ *  are no free slots left
+ *
+ *  struct actor_pool *p -- the actor pool
+ *  int return           -- the slot index
+ */
+static int acquire_slot(struct actor_pool *p)
+{
+  int slot;
+
+  /*  reuse the most recently released slot, if any */
+  if (p->free_slot >= 0) {
+    slot = p->free_slot;
+    p->free_slot = ACTOR_SLOT_FIELD(p, slot, next_free);
+    return slot;
+  }
+
+  /*  hand out a never-used slot, adding a slab if the current ones are full */
+  slot = p->used;
+  assert(slot <= ACTOR_INDEX_MASK);
+
+  if (slot == p->slabs * ACTOR_SLAB_SIZE) {
+    if (p->slabs == p->max_slabs) {
+      p->max_slabs = (p->max_slabs == 0) ? 4 : p->max_slabs * 2;
+      p->slab = (struct actor_slab**)realloc(p->slab,
+        sizeof(struct actor_slab*) * p->max_slabs);
+      assert(p->slab != NULL);
+    }
+
+    p->slab[p->slabs] = (struct actor_slab*)malloc(sizeof(struct actor_slab));
+    assert(p->slab[p->slabs] != NULL);
+    DEBUG("Allocated actor slab @0x%p (%i)\n", p->slab[p->slabs], p->slabs);
+
+    /*  generation 0 is reserved, so that no live handle equals ACTOR_NONE */
+    memset(p->slab[p->slabs]->generation, 0,
+      sizeof(p->slab[p->slabs]->generation));
+    p->slabs++;
+  }
+
+  ACTOR_SLOT_FIELD(p, slot, generation) = 0;
+  p->used++;
+  return slot;
+}
+
+/*
+ *  makes an empty pool hand out a given number of slots, so that a saved
+ *  pool can be filled back in, slot by slot, generations and free list
+ *  included (see load_game()); the slots are left for the caller to fill in
+ *
+ *  struct actor_pool *p  -- the actor pool, which must be empty
+ *  int used              -- the number of slots
+ *  void return
+ */
+void restore_actor_slots(struct actor_pool *p, int used)
+{
+  assert(p->used == 0);
+
+  while (p->used < used) {
+    acquire_slot(p);
+  }
+}
+
+/*
+ *  spawns a new actor in the pool, with all of its fields cleared; this is
+ *  O(1), and never moves existing actors in memory
+ *
+ *  struct actor_pool *p  -- the actor pool
+ *  actor_handle return   -- handle to the new actor
+ */
+actor_handle spawn_actor(struct actor_pool *p)
+{
+  int slot = acquire_slot(p);
+  unsigned int generation;
+
+  /*  bump the generation, so that stale handles to the previous occupant of
+   *  this slot are rejected */
+  generation = (ACTOR_SLOT_FIELD(p, slot, generation) + 1) &
+    ACTOR_GENERATION_MASK;
+  if (generation == 0) {
+    generation = 1;
+  }
+  ACTOR_SLOT_FIELD(p, slot, generation) = generation;
+
+  ACTOR_SLOT_FIELD(p, slot, x)      = 0;
+  ACTOR_SLOT_FIELD(p, slot, y)      = 0;
+  ACTOR_SLOT_FIELD(p, slot, z)      = 0;
+  ACTOR_SLOT_FIELD(p, slot, hp)     = 0;
+  ACTOR_SLOT_FIELD(p, slot, flags)  = ACTOR_FLAG_ALIVE;
+  ACTOR_SLOT_FIELD(p, slot, max_hp) = 0;
+  ACTOR_SLOT_FIELD(p, slot, name)   = NULL;
+  ACTOR_SLOT_FIELD(p, slot, cell)   = NULL;
+
+  ACTOR_SLOT_FIELD(p, slot, speed)      = ACTOR_SPEED_NORMAL;
+  ACTOR_SLOT_FIELD(p, slot, heap_index) = -1;
+
+  p->count++;
+  return ((actor_handle)generation << ACTOR_INDEX_BITS) | (actor_handle)slot;
+}
+
+/*
+ *  removes an actor from the pool in O(1), returning its slot to the free
+ *  list; the handle (and every copy of it) becomes stale; the actor must no
+ *  longer be scheduled
+ *
+ *  struct actor_pool *p  -- the actor pool
+ *  actor_handle a        -- the actor in question
+ *  void return
+ */
+void despawn_actor(struct actor_pool *p, actor_handle a)
+{
+  int slot = ACTOR_HANDLE_SLOT(a);
+
+  assert(actor_alive(p, a));
+  assert(ACTOR_SLOT_FIELD(p, slot, heap_index) < 0);
+
+  ACTOR_SLOT_FIELD(p, slot, flags)     = 0;
+  ACTOR_SLOT_FIELD(p, slot, next_free) = p->free_slot;
+  p->free_slot = slot;
+  p->count--;
+}
+
+/*
+ *  checks whether a handle refers to a live actor
+ *
+ *  struct actor_pool *p  -- the actor pool
+ *  actor_handle a        -- the handle in question
+ *  int return            -- non-zero if the actor is alive
+ */
+int actor_alive(struct actor_pool *p, actor_handle a)
+{
+  int slot = ACTOR_HANDLE_SLOT(a);
+
+  if ((a == ACTOR_NONE) || (slot >= p->used)) {
+    return 0;
+  }
+
+  return (ACTOR_SLOT_FIELD(p, slot, generation) == ACTOR_HANDLE_GENERATION(a)) &&
+         (ACTOR_SLOT_FIELD(p, slot, flags) & ACTOR_FLAG_ALIVE);
+}
+
+/*
+ *  returns a handle to the actor living in a given slot, which allows walking
+ *  the pool in memory order
+ *
+ *  struct actor_pool *p  -- the actor pool
+ *  int slot              -- the slot index, in range 0 .. p->used-1
+ *  actor_handle return   -- the actor, or ACTOR_NONE if the slot is free
+ */
+actor_handle actor_at_slot(struct actor_pool *p, int slot)
+{
+  if (!(ACTOR_SLOT_FIELD(p, slot, flags) & ACTOR_FLAG_ALIVE)) {
+    return ACTOR_NONE;
+  }
+
+  return ((actor_handle)ACTOR_SLOT_FIELD(p, slot, generation) <<
+    ACTOR_INDEX_BITS) | (actor_handle)slot;
+}
+
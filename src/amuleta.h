@@ -9,6 +9,7 @@
 
 #pragma once
 
+#include <pthread.h>
 #include <stdio.h>
 #include <time.h>
 #include <termbox.h>
@@ -30,114 +31,901 @@ struct tile {
   int flags;
 };
 
+/*
+ *  a random number generator (xoshiro128**); every game owns its generators,
+ *  so that games are reproducible and independent of each other
+ */
+struct rng {
+  unsigned int s[4];
+};
+
+/*  stream identifiers, used to derive independent generators from a seed */
+#define RNG_STREAM_GAME       0
+#define RNG_STREAM_AUTOPLAYER 1
+#define RNG_STREAM_LEVEL(z)   (0x100 + (z))
+
 /*  basic tiles defined in tile.c */
 extern struct tile
   void_tile,
   floor_tile,
-  wall_tile;
+  wall_tile,
+  stairs_down_tile;
+
+/*  tile identifiers, used as indices into `tile_palette' */
+#define TILE_VOID         0
+#define TILE_FLOOR        1
+#define TILE_WALL         2
+#define TILE_STAIRS_DOWN  3
+#define TILE_COUNT        4
+
+extern struct tile *tile_palette[TILE_COUNT];
+
+/*  the appearance of the player (see game.c), and of rats (see dungeon.c) */
+extern struct tb_cell
+  player_cell,
+  rat_cell;
+
+/*
+ *  an actor is a living entity which can be either controlled by the user, or
+ *  by the computer; actors live inside an actor pool, and are referred to by
+ *  handles, which pack the actor's slot in the pool together with the slot's
+ *  generation, so that a handle to a dead actor is never mistaken for
+ *  whoever reuses its slot
+ */
+typedef unsigned int actor_handle;
+
+#define ACTOR_NONE              0
+#define ACTOR_INDEX_BITS        20
+#define ACTOR_INDEX_MASK        ((1 << ACTOR_INDEX_BITS) - 1)
+#define ACTOR_GENERATION_MASK   ((1 << (32 - ACTOR_INDEX_BITS)) - 1)
+#define ACTOR_HANDLE_SLOT(a)        ((int)((a) & ACTOR_INDEX_MASK))
+#define ACTOR_HANDLE_GENERATION(a)  ((unsigned int)((a) >> ACTOR_INDEX_BITS))
+
+/*
+ *  a slab holds a fixed number of actors, with each field stored as its own
+ *  array, so that per-turn loops over the hot fields stream through memory
+ */
+struct actor_slab {
+  #define ACTOR_SLAB_BITS 8
+  #define ACTOR_SLAB_SIZE (1 << ACTOR_SLAB_BITS)
+
+  /*  hot fields: position in the dungeon, hit points and flags */
+  int x[ACTOR_SLAB_SIZE];
+  int y[ACTOR_SLAB_SIZE];
+  int z[ACTOR_SLAB_SIZE];
+  int hp[ACTOR_SLAB_SIZE];
+
+  #define ACTOR_FLAG_PLAYER (1<<0)
+  #define ACTOR_FLAG_ALIVE  (1<<1)
+  int flags[ACTOR_SLAB_SIZE];
+
+  /*  cold fields: maximum hit points, name and appearance */
+  int max_hp[ACTOR_SLAB_SIZE];
+  char *name[ACTOR_SLAB_SIZE];
+  struct tb_cell *cell[ACTOR_SLAB_SIZE];
+
+  /*  scheduling: how fast the actor acts (at ACTOR_SPEED_NORMAL, once per
+   *  turn), and its position in the scheduler's heap, or -1 if it is not
+   *  scheduled */
+  #define ACTOR_SPEED_NORMAL 100
+  int speed[ACTOR_SLAB_SIZE];
+  int heap_index[ACTOR_SLAB_SIZE];
+
+  /*  bookkeeping: the slot's generation, and the next slot in the free list */
+  unsigned int generation[ACTOR_SLAB_SIZE];
+  int next_free[ACTOR_SLAB_SIZE];
+};
+
+/*
+ *  the actor pool owns every actor in a game; slabs are never moved once
+ *  allocated, and released slots are kept in a free list for reuse
+ */
+struct actor_pool {
+  /*  the slabs, and how many of them are allocated and fit in `slab' */
+  struct actor_slab **slab;
+  int slabs, max_slabs;
+
+  /*  number of slots ever handed out, and number of live actors */
+  int used, count;
+
+  /*  head of the free slot list, or -1 if there are no free slots */
+  int free_slot;
+};
+
+/*  access a field of the actor in a given slot, or of a given actor */
+#define ACTOR_SLOT_FIELD(p, slot, field) \
+  ((p)->slab[(slot) >> ACTOR_SLAB_BITS]->field[(slot) & (ACTOR_SLAB_SIZE - 1)])
+#define ACTOR(p, a, field) ACTOR_SLOT_FIELD(p, ACTOR_HANDLE_SLOT(a), field)
+
+/*
+ *  the scheduler decides who acts next; every actor on an active level is
+ *  due to act at some point in time, and the actors are kept in a binary
+ *  min-heap keyed by that time, so that the next one is found in O(1), and
+ *  any actor is added or removed in O(log n)
+ */
+struct scheduler_entry {
+  /*  when the actor acts next; ties are broken by the order in which actors
+   *  were scheduled */
+  unsigned long time;
+  unsigned long order;
+
+  actor_handle actor;
+};
+
+struct scheduler {
+  /*  the heap, and how many entries it holds and fits */
+  struct scheduler_entry *heap;
+  int size, capacity;
+
+  /*  the current time, in ticks; an actor of normal speed acts once every
+   *  SCHEDULER_TURN ticks */
+  #define SCHEDULER_TURN 100
+  unsigned long now;
+
+  /*  number of times an actor has been scheduled */
+  unsigned long order;
+};
+
+/*
+ *  an arena hands out memory for things which go away together, such as the
+ *  parts of a level: it is carved, one piece after the other, out of a few
+ *  large blocks, each twice as large as the one before, and freed all at
+ *  once (see arena.c); the arena itself lives at the start of its first block
+ */
+struct arena_block {
+  struct arena_block *next;
+  size_t size, used;
+};
+
+struct arena {
+  /*  the blocks, the one pieces are carved out of being the first one */
+  struct arena_block *block;
+  int blocks;
+
+  /*  the size of the next block to be added, and the number of bytes taken
+   *  by all of the blocks */
+  #define ARENA_MAX_BLOCK (4 << 20)
+  size_t next_size, size;
+};
+
+/*
+ *  a level is as large as its generator makes it, up to MAP_MAX_SIZE cells a
+ *  side; its cells are stored in square chunks of CHUNK_SIZE cells a side,
+ *  and a chunk is only allocated once something is written to it, so that
+ *  the memory a level takes grows with the area in use rather than with its
+ *  size (see `struct map')
+ */
+#define MAP_MAX_SIZE  4096
+#define CHUNK_BITS    5
+#define CHUNK_SIZE    (1 << CHUNK_BITS)
+#define CHUNK_MASK    (CHUNK_SIZE - 1)
+
+/*  the layers of a chunk holding one bit per cell (see `struct map_chunk') */
+#define LAYER_PASSABLE    0
+#define LAYER_OPAQUE      1
+#define LAYER_OCCUPIED    2
+#define LAYER_REMEMBERED  3
+#define LAYER_DIRTY       4
+#define LAYER_COUNT       5
+
+/*
+ *  a chunk holds the cells of a square part of a level; bit x of
+ *  bits[layer][y] stands for the cell at (x, y) within the chunk
+ */
+struct map_chunk {
+  /*  the level layout (terrain), as one tile identifier per cell; it lies
+   *  apart from the chunk, in the map's arena, or in a saved level mapped in
+   *  memory, which is used as it is (see load_game()) */
+  unsigned char (*tile)[CHUNK_SIZE];
+
+  /*  occupancy index, holding the actor standing on each cell (or
+   *  ACTOR_NONE) */
+  actor_handle occupant[CHUNK_SIZE][CHUNK_SIZE];
+
+  /*  the position of each free cell in the map's list of free cells, or -1
+   *  if the cell is not free */
+  int free_slot[CHUNK_SIZE][CHUNK_SIZE];
+
+  /*  the cells which are not solid, those which are opaque, those an actor
+   *  stands on, those the player has seen, and those listed as dirty */
+  unsigned int bits[LAYER_COUNT][CHUNK_SIZE];
+
+  /*  the terrain as it appears on screen, ready to be copied to the screen,
+   *  or NULL; only the chunks which have been on screen have it, as it is
+   *  composed on demand by compose_terrain(), and then kept up to date by
+   *  set_tile() */
+  struct tb_cell (*terrain)[CHUNK_SIZE];
+};
+
+/*  the chunk holding a cell of a map, and a field of that cell; the cell must
+ *  lie within the map */
+#define MAP_CHUNK(m, x, y) \
+  ((m)->chunk[((y) >> CHUNK_BITS) * (m)->chunks_wide + ((x) >> CHUNK_BITS)])
+#define MAP_CELL(m, field, x, y) \
+  (MAP_CHUNK(m, x, y)->field[(y) & CHUNK_MASK][(x) & CHUNK_MASK])
+#define MAP_CELL_TEST(m, layer, x, y) \
+  ((MAP_CHUNK(m, x, y)->bits[layer][(y) & CHUNK_MASK] >> ((x) & CHUNK_MASK)) \
+   & 1)
+
+/*
+ *  a map bitset holds one bit per cell of a window: a part of a level
+ *  WINDOW_WIDTH cells wide and WINDOW_HEIGHT cells high, which the searches
+ *  working on whole rows at once are run on; each row is packed into machine
+ *  words (bit x % MAP_WORD_BITS of word x / MAP_WORD_BITS), and bits past the
+ *  end of a row are always clear; where the window lies on the level is up to
+ *  whoever fills it in (see load_window())
+ */
+#define WINDOW_WIDTH  128
+#define WINDOW_HEIGHT 64
+#define MAP_WORD_BITS ((int)(8 * sizeof(unsigned long)))
+#define MAP_ROW_WORDS ((WINDOW_WIDTH + MAP_WORD_BITS - 1) / MAP_WORD_BITS)
+
+struct map_bitset {
+  unsigned long row[WINDOW_HEIGHT][MAP_ROW_WORDS];
+};
+
+#define MAP_BIT_TEST(b, x, y) \
+  (((b)->row[y][(x) / MAP_WORD_BITS] >> ((x) % MAP_WORD_BITS)) & 1)
+#define MAP_BIT_SET(b, x, y) \
+  ((b)->row[y][(x) / MAP_WORD_BITS] |= 1ul << ((x) % MAP_WORD_BITS))
+#define MAP_BIT_CLEAR(b, x, y) \
+  ((b)->row[y][(x) / MAP_WORD_BITS] &= ~(1ul << ((x) % MAP_WORD_BITS)))
+
+/*  the bit standing for the cell at offset (dx, dy) from the one in the
+ *  middle, in a neighbourhood mask (see cell_neighbourhood()) */
+#define NEIGHBOUR_BIT(dx, dy) (1 << (((dy) + 1) * 3 + (dx) + 1))
+
+/*
+ *  a field of view: the cells seen from a given position, within a given
+ *  radius (see update_fov()), held in a window centred on the position,
+ *  whose top left cell lies at (x0, y0) on the level
+ */
+struct fov_view {
+  int x, y, radius;
+  int x0, y0;
+  struct map_bitset visible;
+};
 
 /*
  *  a map represents a level
  */
 struct map {
-  /*  the level layout (terrain) */
-  #define MAP_WIDTH  80
-  #define MAP_HEIGHT 20
-  struct tile *tile[MAP_WIDTH][MAP_HEIGHT];
+  /*  the arena holding the map itself, and everything else which belongs to
+   *  the level and goes away with it */
+  struct arena *arena;
+
+  /*  the dimensions of the level, chosen when it is generated */
+  int width, height;
+
+  /*  the chunks covering the level, row after row; a chunk nothing has been
+   *  written to is not allocated, but points to a chunk of solid rock shared
+   *  by every map, which reads as such and is never written to; use the
+   *  functions and macros below instead of indexing this directly */
+  int chunks_wide, chunks_high;
+  struct map_chunk **chunk;
+  int chunk_count;
+
+  /*  the free cells (neither solid nor occupied), kept in sync by set_tile()
+   *  and set_occupant(), so that one can be picked at random in constant
+   *  time: `free_cell' lists them (as y * width + x) in no particular order,
+   *  and the chunks hold the position of each cell in that list */
+  int *free_cell;
+  int free_count, free_capacity;
+
+  /*  where actors arriving on this level are placed */
+  int entry_x, entry_y;
+
+  /*  positions of the actors yet to be spawned on this level; filled in by
+   *  plan_population(), and consumed by populate_map() */
+  #define MAP_MAX_SPAWNS 32
+  int spawn_x[MAP_MAX_SPAWNS], spawn_y[MAP_MAX_SPAWNS];
+  int spawns;
+
+  /*  cells whose appearance changed since the map was last drawn, as a list
+   *  of cell indices (y * width + x), kept free of duplicates by the chunks'
+   *  LAYER_DIRTY bits; if more cells change than the list can hold, the
+   *  whole map is flagged for redrawing instead (see mark_dirty()) */
+  #define MAP_MAX_DIRTY 256
+  int dirty_cell[MAP_MAX_DIRTY];
+  int dirty_count;
+  int redraw;
+
+  /*  flow field: the number of steps from every cell to a goal (the player),
+   *  shared by every monster on the level; only cells within MAP_FLOW_RADIUS
+   *  steps are reached, and a cell's distance is only meaningful if its bit
+   *  is set in `flow_reached' (see update_flow()); both are held in a window
+   *  centred on the goal, whose top left cell lies at (flow_x0, flow_y0) */
+  #define MAP_FLOW_RADIUS       16
+  #define MAP_FLOW_UNREACHABLE  0xffff
+  unsigned short flow_distance[WINDOW_HEIGHT][WINDOW_WIDTH];
+  struct map_bitset flow_reached;
+  int flow_x0, flow_y0;
+
+  /*  the goal the flow field leads to, and whether or not the field is still
+   *  valid; set_tile() invalidates it, as walls may have moved */
+  int flow_x, flow_y;
+  int flow_valid;
+
+  /*  field of view: what the player sees from where they stand; `view' is
+   *  only meaningful if `view_valid' is set (see update_fov()); every cell
+   *  seen so far is remembered in the chunks' LAYER_REMEMBERED bits */
+  #define MAP_SIGHT_RADIUS 10
+  struct fov_view view;
+  int view_valid;
+
+  /*  the fields of view computed lately, most recently used first, so that
+   *  standing still or stepping back costs no casting; set_tile() empties
+   *  the cache when a tile becomes opaque or stops being so */
+  #define MAP_FOV_CACHE 8
+  struct fov_view fov_cache[MAP_FOV_CACHE];
+  int fov_cached;
+
+  /*  what identifies the map among all maps ever generated, and how many
+   *  times its tiles and its occupants have changed, so that paths found on
+   *  it can be told apart from stale ones (see `struct pathfinder') */
+  unsigned long serial;
+  unsigned long tile_version, occupant_version;
+
+  /*  whether the level has changed since it was last saved, and if not, the
+   *  save which wrote it; the saved level the map was loaded from, if any,
+   *  stays mapped in memory for as long as the map lives (see save.c) */
+  int unsaved;
+  unsigned long save_serial;
+  void *save_data;
+  size_t save_size;
+};
+
+/*
+ *  a path between two cells of a level, moving in the four cardinal
+ *  directions, as the cells it turns at: each point lies on the same row or
+ *  column as the one before it, and the path runs straight between them; the
+ *  first point is the start, and the last one is the goal, unless the path
+ *  turns too often to be held whole, in which case it is cut short
+ */
+struct path {
+  /*  the number of steps from the start to the goal */
+  int length;
+
+  #define PATH_MAX_POINTS 64
+  short x[PATH_MAX_POINTS], y[PATH_MAX_POINTS];
+  int points;
+};
+
+/*
+ *  a node of a path search, for a cell of the window searched; nodes are
+ *  only meaningful if they were touched by the current search (see
+ *  `struct pathfinder')
+ */
+struct path_node {
+  unsigned int search;
+  unsigned short cost;
+  short parent;
+  short heap_index;
+  unsigned char closed;
+};
+
+/*
+ *  a path found lately, and the state of the map it was found on
+ */
+struct path_cache_entry {
+  unsigned long serial, tile_version, occupant_version;
+  int goal_x, goal_y;
+  struct path path;
+};
+
+/*
+ *  the pathfinder searches paths with A*, skipping over the straight runs of
+ *  open cells by jump point search (see path.c); all of its memory is
+ *  allocated up front, and searches run within a window of the level, so that
+ *  no search allocates memory, and none costs more than the window
+ */
+struct pathfinder {
+  /*  the window searched, as the cells which may be stepped on, and the
+   *  coordinates of its top left cell on the level */
+  struct map_bitset open;
+  int x0, y0;
+
+  /*  the cells a move to the right and to the left stops at, and those from
+   *  which either move finds a jump point, all worked out at once for every
+   *  row before a search (see path.c) */
+  struct map_bitset stop[2], lead;
+
+  /*  one node per cell of the window, and the current search; a node whose
+   *  `search' differs is untouched, so nodes need no clearing between
+   *  searches */
+  struct path_node node[WINDOW_HEIGHT * WINDOW_WIDTH];
+  unsigned int search;
+
+  /*  the open list: a binary min-heap of nodes, keyed by their estimated
+   *  total cost, and the keys themselves */
+  short heap[WINDOW_HEIGHT * WINDOW_WIDTH];
+  unsigned long key[WINDOW_HEIGHT * WINDOW_WIDTH];
+  int heap_size;
+
+  /*  the paths found lately, most recently used first; a path is dropped
+   *  once a tile of its map changes, and checked again once an occupant
+   *  does */
+  #define PATH_CACHE_SIZE 16
+  struct path_cache_entry cache[PATH_CACHE_SIZE];
+  int cached;
+
+  /*  profiling counters: paths asked for, those found in the cache, nodes
+   *  expanded in all, and nodes expanded by the last search */
+  unsigned long queries, cache_hits, nodes_expanded, last_expanded;
 };
 
 /*
- *  nothing to explain here
+ *  the dungeon holds one map per depth; maps are only generated once they are
+ *  first needed (see ensure_level()), so a map pointer may be NULL
  */
 struct dungeon {
   #define DUNGEON_DEPTH 10
   struct map *map[DUNGEON_DEPTH];
+
+  /*  the level being built in the background (or -1), the thread building it,
+   *  its random number generator, and the finished map, which is only valid
+   *  once the thread has been joined */
+  int prefetch_z;
+  pthread_t prefetch_thread;
+  struct rng prefetch_rng;
+  struct map *prefetch_map;
 };
 
 /*
- *  an actor is a living entity which can be either controlled by the user, or
- *  by the computer
+ *  a level generator lays out the terrain of a blank map, and picks the
+ *  level's entry point (see generator.c)
  */
-struct actor {
-  /*  name of the actor */
+struct generator {
   char *name;
+  void (*generate)(struct map *m, struct rng *r);
+};
 
-  /*  apperance of the actor */
-  struct tb_cell *cell;
+/*
+ *  how a level is made: its generator, and its dimensions
+ */
+struct level_plan {
+  struct generator *generator;
+  int width, height;
+};
+
+/*  level generators defined in generator.c, the list of all of them (ending
+ *  with NULL), and the plan of each level */
+extern struct generator
+  open_generator,
+  bsp_generator,
+  cave_generator;
+extern struct generator *generators[];
+extern struct level_plan level_plan[DUNGEON_DEPTH];
 
-  /*  position in the dungeon */
-  int x, y, z;
+/*
+ *  the user interface state of a game played in the terminal
+ */
+struct ui {
+  /*  the character maps used to display strings */
+  struct tb_cell *default_character_map;
+  struct tb_cell *highlighted_character_map;
 
-  /*  hit points and maximum hit points */
-  int hp, max_hp;
+  /*  the level currently on screen (or -1), and the status lines currently on
+   *  screen, so that only what changed needs to be drawn */
+  int drawn_z;
+  #define UI_STATUS_LINES 2
+  char status[UI_STATUS_LINES][MINIMUM_TERMINAL_WIDTH + 1];
 
-  /*  link to the next actor in a linked list */
-  struct actor *next;
+  /*  the screen being drawn to, and its dimensions; this is termbox's back
+   *  buffer, unless the interface is off-screen (see create_offscreen_ui),
+   *  in which case it is a buffer of its own and termbox is never touched */
+  int offscreen;
+  struct tb_cell *screen;
+  int screen_width, screen_height;
 
-  #define ACTOR_FLAG_PLAYER (1<<0)
-  int flags;
+  /*  the part of the level on screen: the camera's top left cell on the
+   *  level, and the dimensions of the view, which fits on the screen above
+   *  the status lines (see draw_map()) */
+  int camera_x, camera_y;
+  int view_width, view_height;
 };
 
 /*
- *  a game structure holds all the state regarding a play session
+ *  a game structure holds all the state regarding a play session; games share
+ *  no mutable state with each other, so several of them may run at once, on
+ *  different threads
  */
 struct game {
-  /*  whether or not the game is running */
+  /*  whether or not the game is running, and the number of turns the player
+   *  has taken so far */
   int running;
+  unsigned long turns;
+
+  /*  source of the player's commands; when NULL, commands are read from the
+   *  terminal through termbox, otherwise the callback fills in a key event
+   *  (and returns 0 to end the game), which allows running without a
+   *  terminal */
+  int (*input)(struct game *g, struct tb_event *ev, void *data);
+  void *input_data;
 
   /*  the random seed used to generate the game */
   unsigned int random_seed;
 
+  /*  random number generator for gameplay; levels are generated from their own
+   *  streams (see RNG_STREAM_LEVEL) */
+  struct rng rng;
+
   /*  the dungeon layout */
   struct dungeon *dungeon;
 
   /*  the player actor -- note that this is here for convenience, as all actors
-   *  live inside the `actors' list */
-  struct actor *player;
+   *  live inside the `actors' pool */
+  actor_handle player;
 
-  /*  linked list containing all the actors currently in the game */
-  struct actor *actors;
+  /*  pool containing all the actors currently in the game */
+  struct actor_pool *actors;
+
+  /*  the order in which the actors on the player's level act */
+  struct scheduler *scheduler;
+
+  /*  searches paths between cells of the levels, or NULL until a path is
+   *  first searched (see game_pathfinder()) */
+  struct pathfinder *pathfinder;
+
+  /*  the user interface, or NULL if the game is not played in the terminal */
+  struct ui *ui;
+
+  /*  statistics: actors killed by the player, and deepest level reached */
+  unsigned long kills;
+  int max_depth;
+
+  /*  where the game is saved, or NULL if it is not, and how many times it
+   *  has been saved so far (see save.c) */
+  char *save_path;
+  unsigned long saves;
+};
+
+/*
+ *  a saved game is a set of files: one holding the game and its actors, at
+ *  the save path, and one per level reached, at the save path followed by
+ *  the level index and the save which wrote it; only the levels which
+ *  changed are written again on each save, to files of their own, and the
+ *  game file, naming the level files to be read, is written last, and
+ *  renamed over the previous one, which is when the save takes place
+ *
+ *  every file starts with a header, followed by fixed-size records laid out
+ *  as they are in memory, so that loading a level maps its file in memory,
+ *  and uses its tiles there, as they are
+ */
+#define SAVE_PATH    "amuleta.sav"
+#define SAVE_MAGIC   "AMULETA"
+#define SAVE_VERSION 1
+
+/*  the game is saved every so many turns, besides when it is quit */
+#define SAVE_INTERVAL 100
+
+struct save_header {
+  char magic[8];
+  unsigned int version;
+
+  /*  what the file holds, and a known value, which reads differently on a
+   *  machine of another byte order */
+  #define SAVE_KIND_GAME  1
+  #define SAVE_KIND_LEVEL 2
+  #define SAVE_BYTE_ORDER 0x01020304u
+  unsigned int kind;
+  unsigned int byte_order;
+
+  /*  the game the file belongs to, the save which wrote it, and the size of
+   *  the file */
+  unsigned int random_seed;
+  unsigned long serial;
+  unsigned long size;
+};
+
+/*
+ *  the game file: the game's own state, followed by one actor record per
+ *  slot of the actor pool
+ */
+struct save_game {
+  struct save_header header;
+
+  struct rng rng;
+  unsigned long turns, kills;
+  int max_depth;
+  actor_handle player;
+
+  /*  the scheduler's clock */
+  unsigned long now, order;
+
+  /*  the actor pool's slots (see `struct actor_pool') */
+  int used, count, free_slot;
+
+  /*  the save which wrote each level, or 0 if the level was not reached */
+  unsigned long level_serial[DUNGEON_DEPTH];
+};
+
+struct save_actor {
+  int x, y, z, hp, flags, max_hp, speed;
+
+  /*  what the actor is, as an index into the kinds save.c knows of */
+  int kind;
+
+  /*  the slot's generation, and the next slot in the free list */
+  unsigned int generation;
+  int next_free;
+
+  /*  when the actor acts next, if it is scheduled */
+  int scheduled;
+  unsigned long time, order;
+};
+
+/*
+ *  a level file: the level's own state, followed by the chunk index (one int
+ *  per chunk of the map: the chunk's record, or -1 if nothing was ever
+ *  written to it), the chunk records, and the list of free cells
+ */
+struct save_level {
+  struct save_header header;
+
+  int z, width, height, entry_x, entry_y;
+  int chunk_count, free_count;
+
+  /*  where the index, the chunk records, and the list of free cells start
+   *  in the file */
+  unsigned long index_offset, chunk_offset, free_offset;
+};
+
+/*  a chunk's tiles, and its layers, but for the occupied and dirty cells,
+ *  which are not saved */
+struct save_chunk {
+  unsigned char tile[CHUNK_SIZE][CHUNK_SIZE];
+  unsigned int bits[LAYER_COUNT][CHUNK_SIZE];
+};
+
+/*
+ *  a script is a list of player commands, one key per character, used to
+ *  play a game without a terminal
+ */
+struct script {
+  /*  the commands, and how many of them there are */
+  char *commands;
+  long length;
+
+  /*  the next command to be issued */
+  long position;
+
+  /*  if non-zero, the script is replayed from the start until the player has
+   *  taken this many turns; if zero, it is played only once */
+  unsigned long max_turns;
 };
 
 /*  log.c */
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO  1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_NONE  4
+
+/*  messages below this level are compiled out, arguments and all; set it at
+ *  build time with `make LOG_LEVEL=...' */
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+/*  if non-zero, the log is written in a compact binary format, which
+ *  amuleta-logdecode turns back into text; set it at build time with
+ *  `make LOG_BINARY=1' */
+#ifndef LOG_BINARY
+#define LOG_BINARY 0
+#endif
+
+#if LOG_BINARY
+#define LOG_FILE_PATH "log.bin"
+#else
 #define LOG_FILE_PATH "log.txt"
+#endif
+
+/*  the binary log starts with a magic string, followed by records, each of
+ *  which starts with its type */
+#define LOG_BINARY_MAGIC "AMLOG1"
+#define LOG_RECORD_SITE  'S'
+#define LOG_RECORD_ENTRY 'E'
+
+/*
+ *  a log site is a place in the source code which appends to the log; all of
+ *  its constant parts are stored once, in a static structure, rather than in
+ *  every entry
+ */
+#define LOG_MAX_ARGUMENTS 12
+
+struct log_site {
+  int level;
+  char *file;
+  char *function;
+  int line;
+  char *format;
+
+  /*  identifier of the site within the binary log, and the log file it was
+   *  assigned for; only ever touched by the log thread */
+  unsigned long id;
+  unsigned int epoch;
+
+  /*  the kinds of the arguments taken by the format (see log_conversions()),
+   *  found the first time the site appends an entry; `scanned' is 0 until
+   *  then, 1 while they are being found, and 2 once they are known */
+  int scanned;
+  int argc;
+  char kind[LOG_MAX_ARGUMENTS];
+};
+
+/*  a raw argument of a log entry, as found by scanning the format string */
+union log_argument {
+  long l;
+  double d;
+  void *p;
+};
 
-extern FILE *log_file;
 void initialize_log(void);
 void terminate_log(void);
-void append_log(char *format, ...);
+void append_log(struct log_site *site, ...);
+int log_conversions(char *format, char *kind);
+void write_log_line(FILE *f, struct log_site *site, long timestamp,
+  union log_argument *argv, int argc);
+
+#define LOG_AT(level, format, ...) do { \
+    static struct log_site log_site = { level, __FILE__, \
+      (char*)__FUNCTION__, __LINE__, format, 0, 0, 0, 0, { 0 } }; \
+    append_log(&log_site, ##__VA_ARGS__); \
+  } while (0)
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define DEBUG(format, ...) LOG_AT(LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+#else
+#define DEBUG(format, ...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define INFO(format, ...) LOG_AT(LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#else
+#define INFO(format, ...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define WARN(format, ...) LOG_AT(LOG_LEVEL_WARN, format, ##__VA_ARGS__)
+#else
+#define WARN(format, ...) ((void)0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_ERROR
+#define ERROR(format, ...) LOG_AT(LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+#else
+#define ERROR(format, ...) ((void)0)
+#endif
+
+/*  arena.c */
+struct arena *create_arena(size_t size);
+void destroy_arena(struct arena *a);
+void *arena_alloc(struct arena *a, size_t size);
 
-#define DEBUG(format, ...) append_log("[%i -- %s:%s:%i] [DBG] " format, time(NULL), __FILE__, __FUNCTION__, __LINE__, ##__VA_ARGS__) 
-#define INFO(format, ...) append_log("[%i -- %s:%s:%i] [INF] " format, time(NULL), __FILE__, __FUNCTION__, __LINE__, ##__VA_ARGS__) 
-#define WARN(format, ...) append_log("[%i -- %s:%s:%i] [WRN] " format, time(NULL), __FILE__, __FUNCTION__, __LINE__, ##__VA_ARGS__) 
-#define ERROR(format, ...) append_log("[%i -- %s:%s:%i] [ERR] " format, time(NULL), __FILE__, __FUNCTION__, __LINE__, ##__VA_ARGS__) 
+/*  bitset.c */
+int count_word_bits(unsigned long w);
+int lowest_word_bit(unsigned long w);
+int highest_word_bit(unsigned long w);
+int count_bitset(struct map_bitset *b);
 
 /*  dungeon.c */
 struct dungeon *generate_dungeon(void);
-struct map *generate_map(void);
-void find_random_free_tile(struct map *m, int *x, int *y);
+struct map *generate_map(int width, int height);
+void free_map(struct map *m);
+int chunk_written(struct map *m, int i);
+void restore_chunk(struct map *m, int i, unsigned char (*tile)[CHUNK_SIZE],
+  unsigned int (*bits)[CHUNK_SIZE]);
+int restore_free_cells(struct map *m, int *cell, int count);
+struct tile *get_tile(struct map *m, int x, int y);
+int get_tile_flags(struct map *m, int x, int y);
+void set_tile(struct map *m, int x, int y, int id);
+void set_terrain(struct map *m, int x0, int y0, struct map_bitset *cells,
+  int id);
+void load_window(struct map *m, int layer, int x0, int y0,
+  struct map_bitset *b);
+void merge_window(struct map *m, int layer, int x0, int y0,
+  struct map_bitset *b);
+int cell_neighbourhood(struct map *m, int layer, int x, int y);
+actor_handle get_occupant(struct map *m, int x, int y);
+void set_occupant(struct map *m, int x, int y, actor_handle a);
+void mark_dirty(struct map *m, int x, int y);
+void clear_dirty(struct map *m);
+void compose_terrain(struct map *m, int x, int y, int width, int height);
+void find_random_free_tile(struct map *m, struct rng *r, int *x, int *y);
+int plan_population(struct map *m, struct rng *r, int count);
 void populate_map(struct game *g, int z);
+struct map *build_level(int z, struct rng *r);
+void prefetch_level(struct game *g, int z);
+struct map *ensure_level(struct game *g, int z);
 void free_dungeon(struct dungeon *d);
-struct map *generate_map(void);
+
+/*  flow.c */
+int flood_fill(struct map_bitset *passable, int x, int y,
+  struct map_bitset *reached);
+void distance_field(struct map_bitset *passable, int x, int y, int radius,
+  unsigned short distance[WINDOW_HEIGHT][WINDOW_WIDTH],
+  struct map_bitset *reached);
+void distance_field_scalar(struct map_bitset *passable, int x, int y,
+  int radius, unsigned short distance[WINDOW_HEIGHT][WINDOW_WIDTH],
+  struct map_bitset *reached);
+void update_flow(struct map *m, int x, int y);
+int get_flow_distance(struct map *m, int x, int y);
+
+/*  fov.c */
+void cast_fov(struct map_bitset *opaque, int x, int y, int radius,
+  struct map_bitset *visible);
+int view_contains(struct fov_view *v, int x, int y);
+unsigned int view_run(struct fov_view *v, int x, int y, int n);
+void update_fov(struct map *m, int x, int y, int radius);
+
+/*  path.c */
+struct pathfinder *create_pathfinder(void);
+void destroy_pathfinder(struct pathfinder *pf);
+int find_path(struct pathfinder *pf, struct map *m, int sx, int sy, int gx,
+  int gy, struct path *path);
+int next_path_step(struct path *path, int *dx, int *dy);
+
+/*  generator.c */
+void carve_cave(struct rng *r, struct map_bitset *floor, int width,
+  int height, int *x, int *y);
+
+/*  rng.c */
+void rng_seed(struct rng *r, unsigned int seed, unsigned int stream);
+unsigned int rng_next(struct rng *r);
+unsigned int rng_range(struct rng *r, unsigned int bound);
+
+/*  actor.c */
+struct actor_pool *create_actor_pool(void);
+void destroy_actor_pool(struct actor_pool *p);
+actor_handle spawn_actor(struct actor_pool *p);
+void despawn_actor(struct actor_pool *p, actor_handle a);
+int actor_alive(struct actor_pool *p, actor_handle a);
+actor_handle actor_at_slot(struct actor_pool *p, int slot);
+void restore_actor_slots(struct actor_pool *p, int used);
+
+/*  scheduler.c */
+struct scheduler *create_scheduler(void);
+void destroy_scheduler(struct scheduler *s);
+void schedule_actor(struct scheduler *s, struct actor_pool *p, actor_handle a,
+  unsigned long delay);
+void schedule_actor_at(struct scheduler *s, struct actor_pool *p,
+  actor_handle a, unsigned long time, unsigned long order);
+void unschedule_actor(struct scheduler *s, struct actor_pool *p,
+  actor_handle a);
+actor_handle next_actor(struct scheduler *s, struct actor_pool *p);
 
 /*  game.c */
+struct game *create_game(unsigned int random_seed);
 struct game *initialize_game(unsigned int random_seed);
 void destroy_game(struct game *g);
-struct actor *create_player(void);
+struct pathfinder *game_pathfinder(struct game *g);
+actor_handle create_player(struct actor_pool *p);
 void run_game(struct game *g);
 void handle_key(struct game *g, struct tb_event *ev);
-void do_act(struct game *g, struct actor *a);
-struct actor *find_actor_by_position(struct game *g, int x, int y, int z);
-void move_actor(struct game *g, struct actor *a, int relx, int rely);
+void do_act(struct game *g, actor_handle a);
+actor_handle find_actor_by_position(struct game *g, int x, int y, int z);
+void move_actor(struct game *g, actor_handle a, int relx, int rely);
+void change_level(struct game *g, actor_handle a, int z);
 
-void melee_attack(struct game *g, struct actor *attacker, struct actor *defender);
-void actor_death(struct game *g, struct actor *a);
+void melee_attack(struct game *g, actor_handle attacker, actor_handle defender);
+void actor_death(struct game *g, actor_handle a);
 
-/*  ui.c */
-extern struct tb_cell
-  *default_character_map,
-  *highlighted_character_map;
+/*  save.c */
+int save_game(struct game *g);
+struct game *load_game(char *path, int *found);
+void remove_save(char *path);
+void unmap_level(struct map *m);
 
+/*  headless.c */
+struct script *load_script(char *path, unsigned long max_turns);
+void free_script(struct script *s);
+int script_input(struct game *g, struct tb_event *ev, void *data);
+
+/*  ui.c */
+struct ui *create_ui(void);
+struct ui *create_offscreen_ui(int width, int height);
+void destroy_ui(struct ui *ui);
 void draw_map(struct game *g, int z);
 void draw_title_screen(void);
 struct tb_cell *generate_character_map(int fg, int bg);
@@ -0,0 +1,126 @@
+
+/*
+ *  arena.c
+ *  Part of Amuleta, a traditional roguelike - https://deveah.github.io/amuleta
+ *  (c) Vlad Dumitru, <dalv.urtimud@gmail.com>
+ *  Licensed under the terms and conditions of the MIT License. Please consult
+ *  the LICENSE file included with this project.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <termbox.h>
+#include "amuleta.h"
+
+/*  every piece handed out is aligned to this many bytes, which suits any
+ *  type the game allocates */
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+/*
+ *  allocates a block, and adds it in front of an arena's blocks, so that
+ *  pieces are carved out of it from now on
+ *
+ *  struct arena *a   -- the arena, or NULL for the first block of a new one
+ *  size_t size       -- the number of bytes the block holds
+ *  struct arena_block *return -- the block
+ */
+static struct arena_block *add_block(struct arena *a, size_t size)
+{
+  struct arena_block *b =
+    (struct arena_block*)malloc(ARENA_ROUND(sizeof(struct arena_block)) + size);
+  assert(b != NULL);
+  DEBUG("Allocated arena block @0x%p (%lu bytes)\n", b, (unsigned long)size);
+
+  b->next = (a != NULL) ? a->block : NULL;
+  b->size = size;
+  b->used = 0;
+
+  if (a != NULL) {
+    a->block = b;
+    a->blocks++;
+    a->size += size;
+  }
+
+  return b;
+}
+
+/*
+ *  creates an arena, whose first block holds at least a given number of
+ *  bytes; sizing it for all that is usually allocated keeps the arena down to
+ *  a single block
+ *
+ *  size_t size           -- the number of bytes
+ *  struct arena *return  -- the arena
+ */
+struct arena *create_arena(size_t size)
+{
+  struct arena_block *b;
+  struct arena *a;
+
+  size = ARENA_ROUND(sizeof(struct arena)) + ARENA_ROUND(size);
+  b = add_block(NULL, size);
+
+  a = (struct arena*)((char*)b + ARENA_ROUND(sizeof(struct arena_block)));
+  b->used = ARENA_ROUND(sizeof(struct arena));
+
+  a->block     = b;
+  a->blocks    = 1;
+  a->size      = size;
+  a->next_size = (2 * size < ARENA_MAX_BLOCK) ? 2 * size : ARENA_MAX_BLOCK;
+
+  return a;
+}
+
+/*
+ *  frees an arena, together with everything allocated from it; this costs
+ *  one free(3) per block, however many pieces were handed out
+ *
+ *  struct arena *a -- the arena
+ *  void return
+ */
+void destroy_arena(struct arena *a)
+{
+  struct arena_block *b = a->block;
+
+  DEBUG("Deallocating arena @0x%p (%i blocks, %lu bytes)\n", a, a->blocks,
+    (unsigned long)a->size);
+
+  /*  the arena itself lives in the last block, which goes last */
+  while (b != NULL) {
+    struct arena_block *next = b->next;
+
+    free(b);
+    b = next;
+  }
+}
+
+/*
+ *  carves a piece out of an arena; it lasts as long as the arena does, and
+ *  is never freed on its own
+ *
+ *  struct arena *a -- the arena
+ *  size_t size     -- the number of bytes
+ *  void *return    -- the piece, which is not cleared
+ */
+void *arena_alloc(struct arena *a, size_t size)
+{
+  struct arena_block *b = a->block;
+  void *piece;
+
+  size = ARENA_ROUND(size);
+
+  /*  whatever is left at the end of the current block is given up; a piece
+   *  larger than the next block gets a block of its own size */
+  if (b->size - b->used < size) {
+    b = add_block(a, (size > a->next_size) ? size : a->next_size);
+
+    a->next_size = (2 * a->next_size < ARENA_MAX_BLOCK) ?
+                   2 * a->next_size : ARENA_MAX_BLOCK;
+  }
+
+  piece = (char*)b + ARENA_ROUND(sizeof(struct arena_block)) + b->used;
+  b->used += size;
+
+  return piece;
+}
@@ -0,0 +1,402 @@
+
+/*
+ *  batch.c
+ *  Part of Amuleta, a traditional roguelike - https://deveah.github.io/amuleta
+ *  (c) Vlad Dumitru, <dalv.urtimud@gmail.com>
+ *  Licensed under the terms and conditions of the MIT License. Please consult
+ *  the LICENSE file included with this project.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <termbox.h>
+#include "amuleta.h"
+
+/*
+ *  a worker owns a range of seeds still to be played; it takes seeds from the
+ *  bottom of its own range, while idle workers steal the top half of it
+ */
+struct worker {
+  pthread_t thread;
+  pthread_mutex_t lock;
+
+  /*  the seeds still to be played, in range lo .. hi-1 */
+  unsigned int lo, hi;
+
+  /*  the whole batch, used for stealing from other workers */
+  struct batch *batch;
+
+  /*  statistics of the games played by this worker */
+  unsigned long games, steals;
+  unsigned long turns, kills, deaths;
+  unsigned long depth[DUNGEON_DEPTH];
+  double seconds;
+};
+
+/*
+ *  a batch of games, one per seed, played across several threads
+ */
+struct batch {
+  struct worker *workers;
+  int threads;
+
+  /*  number of turns after which a game is abandoned */
+  unsigned long max_turns;
+};
+
+/*
+ *  state of the computer player driving a single game
+ */
+struct autoplayer {
+  /*  the autoplayer's own random number generator */
+  struct rng rng;
+
+  /*  the level whose staircase location is known, and that location */
+  int z, stairs_x, stairs_y;
+
+  /*  number of turns after which to give up */
+  unsigned long max_turns;
+};
+
+/*
+ *  input callback which plays the game by wandering towards the down
+ *  staircase of every level, and quits upon reaching the bottom of the
+ *  dungeon (see `struct game')
+ *
+ *  struct game *g      -- the game structure
+ *  struct tb_event *ev -- the event to fill in
+ *  void *data          -- the autoplayer state
+ *  int return          -- 0 to end the game, non-zero otherwise
+ */
+static int autoplayer_input(struct game *g, struct tb_event *ev, void *data)
+{
+  struct autoplayer *ap = (struct autoplayer*)data;
+  struct actor_pool *p = g->actors;
+  int x = ACTOR(p, g->player, x),
+      y = ACTOR(p, g->player, y),
+      z = ACTOR(p, g->player, z);
+  struct map *m = g->dungeon->map[z];
+  int i, j;
+
+  if ((g->turns >= ap->max_turns) || (z == DUNGEON_DEPTH - 1)) {
+    return 0;
+  }
+
+  memset(ev, 0, sizeof(struct tb_event));
+  ev->type = TB_EVENT_KEY;
+
+  /*  locate the staircase once per level */
+  if (ap->z != z) {
+    ap->z = z;
+    for (j = 0; j < m->height; j++) {
+      for (i = 0; i < m->width; i++) {
+        if (get_tile(m, i, j) == &stairs_down_tile) {
+          ap->stairs_x = i;
+          ap->stairs_y = j;
+        }
+      }
+    }
+  }
+
+  if ((x == ap->stairs_x) && (y == ap->stairs_y)) {
+    ev->ch = '>';
+    return 1;
+  }
+
+  /*  half of the time, step towards the staircase; otherwise, step in a
+   *  random direction */
+  if (rng_range(&ap->rng, 2) == 0) {
+    if (x != ap->stairs_x) {
+      ev->ch = (x < ap->stairs_x) ? 'l' : 'h';
+    } else {
+      ev->ch = (y < ap->stairs_y) ? 'j' : 'k';
+    }
+  } else {
+    ev->ch = "hjkl"[rng_range(&ap->rng, 4)];
+  }
+
+  return 1;
+}
+
+/*
+ *  plays a complete game, and adds its statistics to the worker's
+ *
+ *  struct worker *w  -- the worker playing the game
+ *  unsigned int seed -- the game's random seed
+ *  void return
+ */
+static void play_game(struct worker *w, unsigned int seed)
+{
+  struct autoplayer ap;
+  struct timespec start, end;
+
+  struct game *g = initialize_game(seed);
+
+  rng_seed(&ap.rng, seed, RNG_STREAM_AUTOPLAYER);
+  ap.z         = -1;
+  ap.max_turns = w->batch->max_turns;
+
+  g->input      = autoplayer_input;
+  g->input_data = &ap;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  run_game(g);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  w->games++;
+  w->turns   += g->turns;
+  w->kills   += g->kills;
+  w->deaths  += !actor_alive(g->actors, g->player);
+  w->depth[g->max_depth]++;
+  w->seconds += (end.tv_sec - start.tv_sec) +
+    (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  destroy_game(g);
+}
+
+/*
+ *  takes a seed from the bottom of a worker's own range
+ *
+ *  struct worker *w    -- the worker
+ *  unsigned int *seed  -- pointer to where to store the seed
+ *  int return          -- 0 if the range is empty, non-zero otherwise
+ */
+static int take_seed(struct worker *w, unsigned int *seed)
+{
+  int taken = 0;
+
+  pthread_mutex_lock(&w->lock);
+  if (w->lo < w->hi) {
+    *seed = w->lo++;
+    taken = 1;
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  return taken;
+}
+
+/*
+ *  refills an idle worker's range with the top half of the largest range
+ *  held by another worker
+ *
+ *  struct worker *w  -- the idle worker
+ *  int return        -- non-zero if anything was stolen
+ */
+static int steal_seeds(struct worker *w)
+{
+  struct batch *b = w->batch;
+  unsigned int lo = 0, hi = 0;
+  int i;
+
+  /*  the victim may run dry before it is locked, in which case look again;
+   *  give up only once every other worker has run dry */
+  while (lo == hi) {
+    struct worker *victim = NULL;
+    unsigned int largest = 0;
+
+    /*  pick the victim with the most work left */
+    for (i = 0; i < b->threads; i++) {
+      struct worker *other = &b->workers[i];
+      unsigned int size;
+
+      pthread_mutex_lock(&other->lock);
+      size = other->hi - other->lo;
+      pthread_mutex_unlock(&other->lock);
+
+      if ((other != w) && (size > largest)) {
+        largest = size;
+        victim  = other;
+      }
+    }
+
+    if (victim == NULL) {
+      return 0;
+    }
+
+    pthread_mutex_lock(&victim->lock);
+    if (victim->lo < victim->hi) {
+      hi = victim->hi;
+      lo = victim->hi - (victim->hi - victim->lo + 1) / 2;
+      victim->hi = lo;
+    }
+    pthread_mutex_unlock(&victim->lock);
+  }
+
+  pthread_mutex_lock(&w->lock);
+  w->lo = lo;
+  w->hi = hi;
+  pthread_mutex_unlock(&w->lock);
+
+  w->steals++;
+  return 1;
+}
+
+/*
+ *  entry point of a worker thread: play games until no seeds are left
+ *  anywhere
+ *
+ *  void *arg     -- the worker
+ *  void *return  -- unused
+ */
+static void *worker_main(void *arg)
+{
+  struct worker *w = (struct worker*)arg;
+  unsigned int seed;
+
+  while (1) {
+    while (take_seed(w, &seed)) {
+      play_game(w, seed);
+    }
+
+    if (!steal_seeds(w)) {
+      break;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ *  prints the aggregated statistics of a batch
+ *
+ *  struct batch *b -- the batch
+ *  double wall     -- wall-clock time taken by the whole batch, in seconds
+ *  void return
+ */
+static void print_statistics(struct batch *b, double wall)
+{
+  unsigned long games = 0, steals = 0, turns = 0, kills = 0, deaths = 0;
+  unsigned long depth[DUNGEON_DEPTH];
+  double seconds = 0.0, mean_depth = 0.0;
+  int i, j;
+
+  memset(depth, 0, sizeof(depth));
+
+  for (i = 0; i < b->threads; i++) {
+    struct worker *w = &b->workers[i];
+
+    games   += w->games;
+    steals  += w->steals;
+    turns   += w->turns;
+    kills   += w->kills;
+    deaths  += w->deaths;
+    seconds += w->seconds;
+    for (j = 0; j < DUNGEON_DEPTH; j++) {
+      depth[j] += w->depth[j];
+    }
+
+    printf("thread %i: %lu games, %lu steals\n", i, w->games, w->steals);
+  }
+
+  if (games == 0) {
+    printf("no games played\n");
+    return;
+  }
+
+  for (j = 0; j < DUNGEON_DEPTH; j++) {
+    mean_depth += (double)j * depth[j] / games;
+  }
+
+  printf("games:          %lu in %.3f s (%.1f games/s), %lu steals\n",
+    games, wall, games / wall, steals);
+  printf("turns survived: %lu total, %.1f per game\n", turns,
+    (double)turns / games);
+  printf("kills:          %lu total, %.2f per game\n", kills,
+    (double)kills / games);
+  printf("deaths:         %lu (%.1f%% of games)\n", deaths,
+    100.0 * deaths / games);
+  printf("depth reached:  %.2f on average\n", mean_depth);
+  for (j = 0; j < DUNGEON_DEPTH; j++) {
+    printf("  level %i: %lu\n", j, depth[j]);
+  }
+  printf("time per turn:  %.1f ns\n",
+    (turns > 0) ? seconds * 1e9 / turns : 0.0);
+}
+
+/*
+ *  prints the command line usage
+ *
+ *  char *name -- the program name
+ *  void return
+ */
+static void print_usage(char *name)
+{
+  fprintf(stderr,
+    "Usage: %s [-g games] [-s first_seed] [-t threads] [-n max_turns]\n",
+    name);
+}
+
+int main(int argc, char **argv)
+{
+  unsigned int first_seed = 1, games = 1000;
+  struct batch b;
+  struct timespec start, end;
+  double wall;
+  int i, opt;
+
+  b.threads   = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  b.max_turns = 10000;
+
+  while ((opt = getopt(argc, argv, "g:s:t:n:")) != -1) {
+    switch (opt) {
+    case 'g':
+      games = strtoul(optarg, NULL, 10);
+      break;
+    case 's':
+      first_seed = strtoul(optarg, NULL, 10);
+      break;
+    case 't':
+      b.threads = atoi(optarg);
+      break;
+    case 'n':
+      b.max_turns = strtoul(optarg, NULL, 10);
+      break;
+    default:
+      print_usage(argv[0]);
+      return -1;
+    }
+  }
+
+  if (b.threads < 1) {
+    b.threads = 1;
+  }
+
+  b.workers = (struct worker*)calloc(b.threads, sizeof(struct worker));
+  assert(b.workers != NULL);
+
+  /*  split the seeds evenly; stealing balances out games of uneven length */
+  for (i = 0; i < b.threads; i++) {
+    struct worker *w = &b.workers[i];
+
+    pthread_mutex_init(&w->lock, NULL);
+    w->batch = &b;
+    w->lo    = first_seed + (unsigned int)((unsigned long)games * i / b.threads);
+    w->hi    = first_seed + (unsigned int)((unsigned long)games * (i + 1) / b.threads);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < b.threads; i++) {
+    pthread_create(&b.workers[i].thread, NULL, worker_main, &b.workers[i]);
+  }
+  for (i = 0; i < b.threads; i++) {
+    pthread_join(b.workers[i].thread, NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  print_statistics(&b, wall);
+
+  for (i = 0; i < b.threads; i++) {
+    pthread_mutex_destroy(&b.workers[i].lock);
+  }
+  free(b.workers);
+  return 0;
+}
+
@@ -0,0 +1,1313 @@
+
+/*
+ *  bench.c
+ *  Part of Amuleta, a traditional roguelike - https://deveah.github.io/amuleta
+ *  (c) Vlad Dumitru, <dalv.urtimud@gmail.com>
+ *  Licensed under the terms and conditions of the MIT License. Please consult
+ *  the LICENSE file included with this project.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <termbox.h>
+#include "amuleta.h"
+
+/*
+ *  microbenchmarks of the game's hot paths, run without a terminal; the
+ *  results are printed as JSON, one object per benchmark and population
+ *
+ *  allocations are counted by wrapping malloc(3), calloc(3) and realloc(3) at
+ *  link time (see the `bench' target in the Makefile), so only the game's own
+ *  allocations are counted
+ */
+
+/*  number of allocations made so far, by any thread */
+static unsigned long allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+  __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+  __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+  return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+  __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+  return __real_realloc(p, size);
+}
+
+/*
+ *  the state shared by all benchmarks: a game whose topmost level holds a
+ *  given population of rats, drawn off-screen
+ */
+struct bench {
+  struct game *g;
+  struct map *m;
+
+  /*  the benchmarks' own random number generator */
+  struct rng rng;
+
+  /*  number of rats to keep on the level */
+  int population;
+
+  /*  time spent in the measured parts of the current benchmark, and the
+   *  number of operations and allocations made during it */
+  double seconds;
+  unsigned long ops;
+  unsigned long allocations;
+
+  /*  when the current measurement started */
+  struct timespec start;
+  unsigned long start_allocations;
+};
+
+/*  minimum time to spend measuring each benchmark, in seconds */
+static double bench_time = 0.2;
+
+/*  number of operations prepared ahead of a measurement */
+#define BENCH_BATCH 4096
+
+/*  whether or not a result has been printed yet, for the JSON separators */
+static int printed = 0;
+
+/*  sink for the results of lookups, so that they are not optimized away */
+static volatile unsigned long sink = 0;
+
+/*
+ *  starts measuring
+ *
+ *  struct bench *b -- the benchmark state
+ *  void return
+ */
+static void start_timer(struct bench *b)
+{
+  b->start_allocations = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+  clock_gettime(CLOCK_MONOTONIC, &b->start);
+}
+
+/*
+ *  stops measuring, and adds the operations measured to the total
+ *
+ *  struct bench *b     -- the benchmark state
+ *  unsigned long ops   -- the number of operations measured
+ *  void return
+ */
+static void stop_timer(struct bench *b, unsigned long ops)
+{
+  struct timespec end;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  b->seconds += (end.tv_sec - b->start.tv_sec) +
+    (end.tv_nsec - b->start.tv_nsec) / 1e9;
+  b->allocations += __atomic_load_n(&allocations, __ATOMIC_RELAXED) -
+    b->start_allocations;
+  b->ops += ops;
+}
+
+/*
+ *  counts the rats living on the benchmark level
+ *
+ *  struct bench *b -- the benchmark state
+ *  int return      -- the number of rats
+ */
+static int count_rats(struct bench *b)
+{
+  return b->g->actors->count - 1;
+}
+
+/*
+ *  adds rats to random free cells of the benchmark level, through the same
+ *  path as level generation; rats are made nigh unkillable, so that moving
+ *  them around does not thin them out
+ *
+ *  struct bench *b -- the benchmark state
+ *  int count       -- the number of rats to add
+ *  void return
+ */
+static void add_rats(struct bench *b, int count)
+{
+  struct actor_pool *p = b->g->actors;
+  int slot;
+
+  while (count > 0) {
+    int planned = plan_population(b->m, &b->rng,
+      (count < MAP_MAX_SPAWNS) ? count : MAP_MAX_SPAWNS);
+
+    assert(planned > 0);
+    count -= planned;
+    populate_map(b->g, 0);
+  }
+
+  for (slot = 0; slot < p->used; slot++) {
+    actor_handle a = actor_at_slot(p, slot);
+
+    if ((a != ACTOR_NONE) && (a != b->g->player)) {
+      ACTOR(p, a, hp) = 1 << 30;
+    }
+  }
+}
+
+/*
+ *  kills every rat on the benchmark level, optionally measuring it
+ *
+ *  struct bench *b -- the benchmark state
+ *  int measure     -- whether or not to measure the deaths
+ *  void return
+ */
+static void kill_rats(struct bench *b, int measure)
+{
+  struct actor_pool *p = b->g->actors;
+  actor_handle *rats;
+  int slot, n = 0, i;
+
+  rats = (actor_handle*)malloc(sizeof(actor_handle) * (p->used + 1));
+  assert(rats != NULL);
+
+  for (slot = 0; slot < p->used; slot++) {
+    actor_handle a = actor_at_slot(p, slot);
+
+    if ((a != ACTOR_NONE) && (a != b->g->player)) {
+      rats[n++] = a;
+    }
+  }
+
+  if (measure) {
+    start_timer(b);
+  }
+  for (i = 0; i < n; i++) {
+    actor_death(b->g, rats[i]);
+  }
+  if (measure) {
+    stop_timer(b, n);
+  }
+
+  free(rats);
+}
+
+/*
+ *  picks a random living rat
+ *
+ *  struct bench *b     -- the benchmark state
+ *  actor_handle return -- the rat
+ */
+static actor_handle random_rat(struct bench *b)
+{
+  struct actor_pool *p = b->g->actors;
+
+  while (1) {
+    actor_handle a = actor_at_slot(p, rng_range(&b->rng, p->used));
+
+    if ((a != ACTOR_NONE) && (a != b->g->player)) {
+      return a;
+    }
+  }
+}
+
+/*
+ *  prints the result of a benchmark as a JSON object
+ *
+ *  struct bench *b -- the benchmark state
+ *  char *name      -- the name of the benchmark
+ *  void return
+ */
+static void report(struct bench *b, char *name)
+{
+  double ns = (b->ops > 0) ? b->seconds * 1e9 / b->ops : 0.0;
+
+  printf("%s\n    {\"name\": \"%s\", \"population\": %i, \"ops\": %lu, "
+    "\"ns_per_op\": %.2f, \"allocations_per_op\": %.3f, "
+    "\"ops_per_second\": %.0f}", printed ? "," : "", name, b->population,
+    b->ops, ns, (b->ops > 0) ? (double)b->allocations / b->ops : 0.0,
+    (b->seconds > 0) ? b->ops / b->seconds : 0.0);
+  printed = 1;
+  fflush(stdout);
+}
+
+/*
+ *  prepares the benchmark state: a game standing on its topmost level, with
+ *  the level's population replaced by a given number of rats
+ *
+ *  struct bench *b   -- the benchmark state
+ *  int population    -- the number of rats
+ *  void return
+ */
+static void setup(struct bench *b, int population)
+{
+  memset(b, 0, sizeof(struct bench));
+
+  /*  an open hall has room for the largest population */
+  level_plan[0].generator = &open_generator;
+
+  b->g = initialize_game(1);
+  change_level(b->g, b->g->player, 0);
+  b->m = b->g->dungeon->map[0];
+  b->g->ui = create_offscreen_ui(MINIMUM_TERMINAL_WIDTH,
+    MINIMUM_TERMINAL_HEIGHT);
+
+  rng_seed(&b->rng, 1, RNG_STREAM_AUTOPLAYER);
+  b->population = population;
+
+  kill_rats(b, 0);
+  add_rats(b, population);
+}
+
+/*
+ *  frees the benchmark state
+ *
+ *  struct bench *b -- the benchmark state
+ *  void return
+ */
+static void teardown(struct bench *b)
+{
+  destroy_ui(b->g->ui);
+  destroy_game(b->g);
+}
+
+/*
+ *  starts a new measurement on the benchmark state
+ *
+ *  struct bench *b -- the benchmark state
+ *  void return
+ */
+static void reset(struct bench *b)
+{
+  b->seconds     = 0.0;
+  b->ops         = 0;
+  b->allocations = 0;
+}
+
+/*  generate_dungeon: allocating (and freeing) an empty dungeon */
+static void bench_generate_dungeon(struct bench *b)
+{
+  int i;
+
+  reset(b);
+  while (b->seconds < bench_time) {
+    start_timer(b);
+    for (i = 0; i < 1000; i++) {
+      free_dungeon(generate_dungeon());
+    }
+    stop_timer(b, 1000);
+  }
+  report(b, "generate_dungeon");
+}
+
+/*  generate_map: generating (and freeing) the layout of a level */
+static void bench_generate_map(struct bench *b)
+{
+  int i;
+
+  reset(b);
+  while (b->seconds < bench_time) {
+    start_timer(b);
+    for (i = 0; i < 100; i++) {
+      free_map(generate_map(80, 20));
+    }
+    stop_timer(b, 100);
+  }
+  report(b, "generate_map");
+}
+
+/*
+ *  compares two latencies, for qsort(3)
+ *
+ *  const void *a, *b -- pointers to the latencies
+ *  int return        -- the order of the latencies
+ */
+static int compare_latencies(const void *a, const void *b)
+{
+  double x = *(const double*)a,
+         y = *(const double*)b;
+
+  return (x > y) - (x < y);
+}
+
+/*
+ *  generate_<generator>: laying out (and freeing) an 80x20 level with each
+ *  level generator, for a fixed range of seeds, so that runs can be
+ *  compared; every map is timed on its own for the latency percentiles, and
+ *  checked to have its whole floor reachable from its entry point
+ *
+ *  struct bench *b -- the benchmark state
+ *  int return      -- the number of maps which are not connected
+ */
+static int bench_generators(struct bench *b)
+{
+  #define BENCH_GENERATOR_SEEDS 5000
+  double *latency;
+  int failures = 0;
+  int i, seed;
+
+  latency = (double*)malloc(sizeof(double) * BENCH_GENERATOR_SEEDS);
+  assert(latency != NULL);
+
+  for (i = 0; generators[i] != NULL; i++) {
+    struct map_bitset passable, reached;
+
+    reset(b);
+    for (seed = 0; seed < BENCH_GENERATOR_SEEDS; seed++) {
+      double before = b->seconds;
+      struct rng r;
+      struct map *m;
+
+      rng_seed(&r, (unsigned int)seed, RNG_STREAM_LEVEL(0));
+
+      start_timer(b);
+      m = generate_map(80, 20);
+      generators[i]->generate(m, &r);
+      stop_timer(b, 1);
+
+      latency[seed] = b->seconds - before;
+
+      load_window(m, LAYER_PASSABLE, 0, 0, &passable);
+      if (flood_fill(&passable, m->entry_x, m->entry_y, &reached) !=
+          count_bitset(&passable)) {
+        failures++;
+      }
+
+      free_map(m);
+    }
+
+    qsort(latency, BENCH_GENERATOR_SEEDS, sizeof(double), compare_latencies);
+
+    printf("%s\n    {\"name\": \"generate_%s\", \"maps\": %lu, "
+      "\"maps_per_second\": %.0f, \"p50_ns\": %.0f, \"p99_ns\": %.0f, "
+      "\"allocations_per_map\": %.3f}", printed ? "," : "",
+      generators[i]->name, b->ops, b->ops / b->seconds,
+      latency[BENCH_GENERATOR_SEEDS / 2] * 1e9,
+      latency[BENCH_GENERATOR_SEEDS * 99 / 100] * 1e9,
+      (double)b->allocations / b->ops);
+    printed = 1;
+    fflush(stdout);
+  }
+
+  free(latency);
+  return failures;
+}
+
+/*  find_random_free_tile: picking a random walkable cell */
+static void bench_find_random_free_tile(struct bench *b)
+{
+  int i, x, y;
+
+  reset(b);
+  while (b->seconds < bench_time) {
+    start_timer(b);
+    for (i = 0; i < 10000; i++) {
+      find_random_free_tile(b->m, &b->rng, &x, &y);
+      sink += x + y;
+    }
+    stop_timer(b, 10000);
+  }
+  report(b, "find_random_free_tile");
+}
+
+/*  flood_fill: finding every cell reachable from the level's entry point */
+static void bench_flood_fill(struct bench *b)
+{
+  struct map_bitset passable, reached;
+  int i;
+
+  load_window(b->m, LAYER_PASSABLE, 0, 0, &passable);
+
+  reset(b);
+  while (b->seconds < bench_time) {
+    start_timer(b);
+    for (i = 0; i < 1000; i++) {
+      sink += flood_fill(&passable, b->m->entry_x, b->m->entry_y, &reached);
+    }
+    stop_timer(b, 1000);
+  }
+  report(b, "flood_fill");
+}
+
+/*  distance_field: the distances from a random cell to the whole level, with
+ *  the bit-parallel kernel or with the scalar one */
+static void bench_distance_field(struct bench *b, int scalar)
+{
+  unsigned short distance[WINDOW_HEIGHT][WINDOW_WIDTH];
+  struct map_bitset passable, reached;
+  int i, x[100], y[100];
+
+  load_window(b->m, LAYER_PASSABLE, 0, 0, &passable);
+  for (i = 0; i < 100; i++) {
+    find_random_free_tile(b->m, &b->rng, &x[i], &y[i]);
+  }
+
+  reset(b);
+  while (b->seconds < bench_time) {
+    start_timer(b);
+    for (i = 0; i < 100; i++) {
+      if (scalar) {
+        distance_field_scalar(&passable, x[i], y[i],
+          WINDOW_WIDTH * WINDOW_HEIGHT, distance, &reached);
+      } else {
+        distance_field(&passable, x[i], y[i], WINDOW_WIDTH * WINDOW_HEIGHT,
+          distance, &reached);
+      }
+      sink += distance[0][0];
+    }
+    stop_timer(b, 100);
+  }
+  report(b, scalar ? "distance_field_scalar" : "distance_field");
+}
+
+/*  cast_fov: the field of view from a random cell, cast from scratch */
+static void bench_cast_fov(struct bench *b)
+{
+  struct map_bitset opaque, visible;
+  int i, x[100], y[100];
+
+  load_window(b->m, LAYER_OPAQUE, 0, 0, &opaque);
+  for (i = 0; i < 100; i++) {
+    find_random_free_tile(b->m, &b->rng, &x[i], &y[i]);
+  }
+
+  reset(b);
+  while (b->seconds < bench_time) {
+    start_timer(b);
+    for (i = 0; i < 100; i++) {
+      cast_fov(&opaque, x[i], y[i], MAP_SIGHT_RADIUS, &visible);
+      sink += visible.row[y[i]][0];
+    }
+    stop_timer(b, 100);
+  }
+  report(b, "cast_fov");
+}
+
+/*  update_fov: the field of view of a player pacing between two cells, which
+ *  is served by the cache after the first two steps */
+static void bench_update_fov(struct bench *b)
+{
+  int i, x, y;
+
+  do {
+    find_random_free_tile(b->m, &b->rng, &x, &y);
+  } while (!MAP_CELL_TEST(b->m, LAYER_PASSABLE, x + 1, y));
+
+  reset(b);
+  while (b->seconds < bench_time) {
+    start_timer(b);
+    for (i = 0; i < 1000; i++) {
+      update_fov(b->m, x + (i & 1), y, MAP_SIGHT_RADIUS);
+      clear_dirty(b->m);
+    }
+    stop_timer(b, 1000);
+  }
+  report(b, "update_fov");
+}
+
+/*  carve_cave: a cave laid out as a bitset, smoothed and connected, but not
+ *  yet written into a map */
+static void bench_carve_cave(struct bench *b)
+{
+  struct map_bitset floor;
+  int i, x, y;
+
+  reset(b);
+  while (b->seconds < bench_time) {
+    start_timer(b);
+    for (i = 0; i < 100; i++) {
+      carve_cave(&b->rng, &floor, 80, 20, &x, &y);
+      sink += floor.row[y][0];
+    }
+    stop_timer(b, 100);
+  }
+  report(b, "carve_cave");
+}
+
+/*
+ *  counts the cells of a bitset
+ *
+ *  struct map_bitset *cells -- the bitset
+ *  int return               -- the number of cells
+ */
+static int count_cells(struct map_bitset *cells)
+{
+  int count = 0, x, y;
+
+  for (y = 0; y < WINDOW_HEIGHT; y++) {
+    for (x = 0; x < WINDOW_WIDTH; x++) {
+      count += MAP_BIT_TEST(cells, x, y) ? 1 : 0;
+    }
+  }
+
+  return count;
+}
+
+/*
+ *  checks that the bit-parallel distance field and flood fill agree with the
+ *  scalar search, on window-sized levels strewn with random walls
+ *
+ *  struct bench *b -- the benchmark state
+ *  int return      -- the number of levels on which they disagree
+ */
+static int check_distance_field(struct bench *b)
+{
+  unsigned short fast[WINDOW_HEIGHT][WINDOW_WIDTH],
+                 slow[WINDOW_HEIGHT][WINDOW_WIDTH];
+  struct map_bitset passable, fast_reached, slow_reached;
+  int failures = 0;
+  int i, j, x, y, gx, gy, count;
+
+  for (i = 0; i < 200; i++) {
+    struct map *m = generate_map(WINDOW_WIDTH, WINDOW_HEIGHT);
+    int radius = 1 + rng_range(&b->rng, WINDOW_WIDTH);
+    int walls = rng_range(&b->rng, WINDOW_WIDTH * WINDOW_HEIGHT / 2);
+
+    open_generator.generate(m, &b->rng);
+    for (j = 0; j < walls; j++) {
+      set_tile(m, rng_range(&b->rng, WINDOW_WIDTH),
+        rng_range(&b->rng, WINDOW_HEIGHT), TILE_WALL);
+    }
+    load_window(m, LAYER_PASSABLE, 0, 0, &passable);
+
+    gx = rng_range(&b->rng, WINDOW_WIDTH);
+    gy = rng_range(&b->rng, WINDOW_HEIGHT);
+    distance_field(&passable, gx, gy, radius, fast, &fast_reached);
+    distance_field_scalar(&passable, gx, gy, radius, slow, &slow_reached);
+
+    if (memcmp(&fast_reached, &slow_reached, sizeof(struct map_bitset)) != 0) {
+      failures++;
+    } else {
+      for (y = 0; y < WINDOW_HEIGHT; y++) {
+        for (x = 0; x < WINDOW_WIDTH; x++) {
+          if ((MAP_BIT_TEST(&fast_reached, x, y)) &&
+              (fast[y][x] != slow[y][x])) {
+            failures++;
+            y = WINDOW_HEIGHT;
+            break;
+          }
+        }
+      }
+    }
+
+    /*  with no radius to stop it, the scalar search reaches what a flood
+     *  fill does */
+    if (MAP_BIT_TEST(&passable, gx, gy)) {
+      count = flood_fill(&passable, gx, gy, &fast_reached);
+      distance_field_scalar(&passable, gx, gy, WINDOW_WIDTH * WINDOW_HEIGHT,
+        slow, &slow_reached);
+
+      if ((memcmp(&fast_reached, &slow_reached,
+           sizeof(struct map_bitset)) != 0) ||
+          (count != count_cells(&slow_reached))) {
+        failures++;
+      }
+    }
+
+    free_map(m);
+  }
+
+  return failures;
+}
+
+/*
+ *  large_level: a 4096x4096 level of solid rock, with a single corridor dug
+ *  across it and another down it, so that only the chunks along them take
+ *  memory; then the field of view and the flow field along the corridor,
+ *  whose cost should not depend on the size of the level
+ *
+ *  struct bench *b -- the benchmark state
+ *  void return
+ */
+static void bench_large_level(struct bench *b)
+{
+  struct map *m;
+  int i, chunks;
+
+  reset(b);
+  start_timer(b);
+  m = generate_map(MAP_MAX_SIZE, MAP_MAX_SIZE);
+  for (i = 1; i < MAP_MAX_SIZE - 1; i++) {
+    set_tile(m, i, MAP_MAX_SIZE / 2, TILE_FLOOR);
+    set_tile(m, MAP_MAX_SIZE / 2, i, TILE_FLOOR);
+  }
+  stop_timer(b, 1);
+
+  chunks = m->chunks_wide * m->chunks_high;
+  printf("%s\n    {\"name\": \"large_level\", \"width\": %i, "
+    "\"height\": %i, \"ns\": %.0f, \"chunks\": %i, "
+    "\"chunks_allocated\": %i, \"arena_blocks\": %i, "
+    "\"bytes_allocated\": %lu}",
+    printed ? "," : "", m->width, m->height, b->seconds * 1e9, chunks,
+    m->chunk_count, m->arena->blocks, (unsigned long)m->arena->size);
+  printed = 1;
+  fflush(stdout);
+
+  /*  walk along the corridor, further than the cache of views reaches */
+  reset(b);
+  while (b->seconds < bench_time) {
+    start_timer(b);
+    for (i = 0; i < 1000; i++) {
+      int x = 1 + (i * 7) % (MAP_MAX_SIZE - 2);
+
+      update_fov(m, x, MAP_MAX_SIZE / 2, MAP_SIGHT_RADIUS);
+      update_flow(m, x, MAP_MAX_SIZE / 2);
+      clear_dirty(m);
+    }
+    stop_timer(b, 1000);
+  }
+  report(b, "large_level_fov_and_flow");
+
+  free_map(m);
+}
+
+/*
+ *  checks that the paths found are made of straight runs of open cells, and
+ *  that they are the shortest ones within the pathfinder's window, as the
+ *  scalar search finds them, on levels strewn with random walls
+ *
+ *  struct bench *b -- the benchmark state
+ *  int return      -- the number of paths which are wrong
+ */
+static int check_find_path(struct bench *b)
+{
+  unsigned short distance[WINDOW_HEIGHT][WINDOW_WIDTH];
+  struct pathfinder *pf = game_pathfinder(b->g);
+  struct map_bitset passable, reached;
+  struct path path;
+  int failures = 0;
+  int i, j, k, sx, sy, gx, gy, x, y;
+
+  for (i = 0; i < 200; i++) {
+    struct map *m = generate_map(2 * WINDOW_WIDTH, 2 * WINDOW_HEIGHT);
+    int walls = rng_range(&b->rng, m->width * m->height / 2);
+
+    open_generator.generate(m, &b->rng);
+    for (j = 0; j < walls; j++) {
+      set_tile(m, rng_range(&b->rng, m->width), rng_range(&b->rng, m->height),
+        TILE_WALL);
+    }
+
+    for (j = 0; j < 20; j++) {
+      find_random_free_tile(m, &b->rng, &sx, &sy);
+      find_random_free_tile(m, &b->rng, &gx, &gy);
+      if ((abs(gx - sx) >= WINDOW_WIDTH) || (abs(gy - sy) >= WINDOW_HEIGHT)) {
+        continue;
+      }
+
+      /*  a search, rather than a path from the cache */
+      pf->cached = 0;
+      k = find_path(pf, m, sx, sy, gx, gy, &path);
+
+      load_window(m, LAYER_PASSABLE, pf->x0, pf->y0, &passable);
+      distance_field_scalar(&passable, gx - pf->x0, gy - pf->y0,
+        WINDOW_WIDTH * WINDOW_HEIGHT, distance, &reached);
+
+      if (!k) {
+        failures += MAP_BIT_TEST(&reached, sx - pf->x0, sy - pf->y0) ? 1 : 0;
+        continue;
+      }
+
+      if ((!MAP_BIT_TEST(&reached, sx - pf->x0, sy - pf->y0)) ||
+          (distance[sy - pf->y0][sx - pf->x0] != path.length) ||
+          (path.x[0] != sx) || (path.y[0] != sy) ||
+          ((path.points < PATH_MAX_POINTS) &&
+           ((path.x[path.points - 1] != gx) ||
+            (path.y[path.points - 1] != gy)))) {
+        failures++;
+        continue;
+      }
+
+      for (k = 0; k + 1 < path.points; k++) {
+        if ((path.x[k] != path.x[k + 1]) && (path.y[k] != path.y[k + 1])) {
+          failures++;
+          break;
+        }
+
+        for (x = path.x[k], y = path.y[k];
+             (x != path.x[k + 1]) || (y != path.y[k + 1]);
+             x += (path.x[k + 1] > x) - (path.x[k + 1] < x),
+             y += (path.y[k + 1] > y) - (path.y[k + 1] < y)) {
+          if (!MAP_CELL_TEST(m, LAYER_PASSABLE, x, y)) {
+            failures++;
+            k = path.points;
+            break;
+          }
+        }
+      }
+    }
+
+    free_map(m);
+  }
+
+  pf->cached = 0;
+  return failures;
+}
+
+/*
+ *  find_path: finding paths between random cells of a cave, searching every
+ *  time, or following each path a few steps and asking for the rest of it
+ *  again at every step, as a walking monster would; besides the time taken,
+ *  the nodes expanded by each search and the share of paths taken from the
+ *  cache are reported
+ *
+ *  struct bench *b -- the benchmark state
+ *  int cached      -- non-zero to walk along the paths
+ *  void return
+ */
+static void bench_find_path(struct bench *b, int cached)
+{
+  #define BENCH_PATHS 100
+  #define BENCH_PATH_STEPS 10
+  struct pathfinder *pf = game_pathfinder(b->g);
+  struct path path;
+  struct map *m;
+  struct rng r;
+  int sx[BENCH_PATHS], sy[BENCH_PATHS], gx[BENCH_PATHS], gy[BENCH_PATHS];
+  int i, j, x, y, dx, dy;
+
+  rng_seed(&r, 1, RNG_STREAM_LEVEL(0));
+  m = generate_map(WINDOW_WIDTH, WINDOW_HEIGHT);
+  cave_generator.generate(m, &r);
+
+  for (i = 0; i < BENCH_PATHS; i++) {
+    find_random_free_tile(m, &b->rng, &sx[i], &sy[i]);
+    find_random_free_tile(m, &b->rng, &gx[i], &gy[i]);
+  }
+
+  reset(b);
+  pf->queries        = 0;
+  pf->cache_hits     = 0;
+  pf->nodes_expanded = 0;
+  pf->cached         = 0;
+
+  while (b->seconds < bench_time) {
+    start_timer(b);
+    for (i = 0; i < BENCH_PATHS; i++) {
+      if (!cached) {
+        pf->cached = 0;
+        sink += find_path(pf, m, sx[i], sy[i], gx[i], gy[i], &path);
+        continue;
+      }
+
+      x = sx[i];
+      y = sy[i];
+      for (j = 0; j < BENCH_PATH_STEPS; j++) {
+        if ((!find_path(pf, m, x, y, gx[i], gy[i], &path)) ||
+            (!next_path_step(&path, &dx, &dy))) {
+          break;
+        }
+        x += dx;
+        y += dy;
+      }
+      sink += x + y;
+    }
+    stop_timer(b, cached ? pf->queries - b->ops : BENCH_PATHS);
+  }
+
+  printf("%s\n    {\"name\": \"%s\", \"queries\": %lu, "
+    "\"ns_per_query\": %.2f, \"nodes_expanded_per_search\": %.1f, "
+    "\"cache_hit_rate\": %.3f, \"allocations_per_query\": %.3f}",
+    printed ? "," : "", cached ? "find_path_cached" : "find_path",
+    pf->queries, b->seconds * 1e9 / b->ops,
+    (pf->queries > pf->cache_hits) ?
+      (double)pf->nodes_expanded / (pf->queries - pf->cache_hits) : 0.0,
+    (double)pf->cache_hits / pf->queries, (double)b->allocations / b->ops);
+  printed = 1;
+  fflush(stdout);
+
+  pf->cached = 0;
+  free_map(m);
+}
+
+/*  where the benchmarks save games */
+#define BENCH_SAVE_PATH "amuleta-bench.sav"
+
+/*
+ *  checks whether a file exists
+ *
+ *  char *path  -- the path of the file
+ *  int return  -- non-zero if the file exists
+ */
+static int found_file(char *path)
+{
+  struct stat st;
+
+  return stat(path, &st) == 0;
+}
+
+/*
+ *  starts a game, and walks the player down every level of the dungeon and
+ *  back up to the topmost one, so that every level has been reached, and the
+ *  player's level has changed last
+ *
+ *  struct game *return -- the game, saved at BENCH_SAVE_PATH
+ */
+static struct game *descend_dungeon(void)
+{
+  struct game *g = initialize_game(1);
+  int z;
+
+  for (z = 0; z < DUNGEON_DEPTH; z++) {
+    change_level(g, g->player, z);
+  }
+  change_level(g, g->player, 0);
+
+  g->save_path = BENCH_SAVE_PATH;
+  return g;
+}
+
+/*
+ *  checks that a saved game loads back as it was saved: the same levels,
+ *  tile for tile and layer for layer, and the same actors, standing and
+ *  scheduled as they were; and that a save which fails before it takes
+ *  place leaves the previous one as it was
+ *
+ *  struct bench *b -- the benchmark state
+ *  int return      -- the number of differences found
+ */
+static int check_save(struct bench *b)
+{
+  struct game *g = descend_dungeon(), *loaded;
+  struct actor_pool *p = g->actors, *q;
+  int failures = 0;
+  int z, x, y, slot, found, failed;
+
+  (void)b;
+
+  /*  save twice, so that the second save only writes the player's level,
+   *  and the others are read from the first one */
+  failed = !save_game(g);
+  g->dungeon->map[0]->unsaved = 1;
+  failed |= !save_game(g);
+
+  /*  a directory in the way of the game file being written makes the third
+   *  save fail once the player's level is written */
+  g->dungeon->map[0]->unsaved = 1;
+  if (mkdir(BENCH_SAVE_PATH ".tmp", 0700) == 0) {
+    failed |= save_game(g);
+    rmdir(BENCH_SAVE_PATH ".tmp");
+  }
+
+  if ((failed) || (!found_file(BENCH_SAVE_PATH ".0.2")) ||
+      (found_file(BENCH_SAVE_PATH ".0.1")) ||
+      (found_file(BENCH_SAVE_PATH ".0.3")) ||
+      ((loaded = load_game(BENCH_SAVE_PATH, &found)) == NULL)) {
+    destroy_game(g);
+    remove_save(BENCH_SAVE_PATH);
+    return 1;
+  }
+  q = loaded->actors;
+
+  for (z = 0; z < DUNGEON_DEPTH; z++) {
+    struct map *m = g->dungeon->map[z],
+               *l = loaded->dungeon->map[z];
+
+    if ((m == NULL) || (l == NULL)) {
+      failures += (m != l) ? 1 : 0;
+      continue;
+    }
+
+    if ((m->width != l->width) || (m->height != l->height) ||
+        (m->entry_x != l->entry_x) || (m->entry_y != l->entry_y) ||
+        (m->free_count != l->free_count) ||
+        (m->chunk_count != l->chunk_count)) {
+      failures++;
+      continue;
+    }
+
+    for (y = 0; y < m->height; y++) {
+      for (x = 0; x < m->width; x++) {
+        if ((get_tile(m, x, y) != get_tile(l, x, y)) ||
+            (get_occupant(m, x, y) != get_occupant(l, x, y)) ||
+            (MAP_CELL(m, free_slot, x, y) != MAP_CELL(l, free_slot, x, y)) ||
+            (MAP_CELL_TEST(m, LAYER_PASSABLE, x, y) !=
+             MAP_CELL_TEST(l, LAYER_PASSABLE, x, y)) ||
+            (MAP_CELL_TEST(m, LAYER_OPAQUE, x, y) !=
+             MAP_CELL_TEST(l, LAYER_OPAQUE, x, y)) ||
+            (MAP_CELL_TEST(m, LAYER_OCCUPIED, x, y) !=
+             MAP_CELL_TEST(l, LAYER_OCCUPIED, x, y)) ||
+            (MAP_CELL_TEST(m, LAYER_REMEMBERED, x, y) !=
+             MAP_CELL_TEST(l, LAYER_REMEMBERED, x, y))) {
+          failures++;
+        }
+      }
+    }
+  }
+
+  if ((p->used != q->used) || (p->count != q->count) ||
+      (p->free_slot != q->free_slot) || (g->player != loaded->player) ||
+      (g->scheduler->now != loaded->scheduler->now) ||
+      (g->scheduler->size != loaded->scheduler->size) ||
+      (next_actor(g->scheduler, p) != next_actor(loaded->scheduler, q))) {
+    failures++;
+  }
+
+  for (slot = 0; (failures == 0) && (slot < p->used); slot++) {
+    actor_handle a = actor_at_slot(p, slot);
+
+    if ((a != actor_at_slot(q, slot)) ||
+        ((a != ACTOR_NONE) &&
+         ((ACTOR(p, a, x) != ACTOR(q, a, x)) ||
+          (ACTOR(p, a, y) != ACTOR(q, a, y)) ||
+          (ACTOR(p, a, z) != ACTOR(q, a, z)) ||
+          (ACTOR(p, a, hp) != ACTOR(q, a, hp)) ||
+          (ACTOR(p, a, cell) != ACTOR(q, a, cell)) ||
+          ((ACTOR(p, a, heap_index) < 0) !=
+           (ACTOR(q, a, heap_index) < 0))))) {
+      failures++;
+    }
+  }
+
+  destroy_game(loaded);
+  destroy_game(g);
+  remove_save(BENCH_SAVE_PATH);
+  return failures;
+}
+
+/*
+ *  save_game: saving a game whose every level has been reached, writing
+ *  every level, or only the player's level, as after a turn; an operation is
+ *  a whole save, files synced to disk included; then load_game: loading the
+ *  game back, mapping its levels in memory
+ *
+ *  struct bench *b -- the benchmark state
+ *  void return
+ */
+static void bench_save_game(struct bench *b)
+{
+  struct game *g = descend_dungeon(), *loaded;
+  int incremental, z, found;
+
+  for (incremental = 0; incremental < 2; incremental++) {
+    reset(b);
+    while (b->seconds < bench_time) {
+      for (z = 0; z < DUNGEON_DEPTH; z++) {
+        g->dungeon->map[z]->unsaved = (!incremental) || (z == 0);
+      }
+
+      start_timer(b);
+      sink += save_game(g);
+      stop_timer(b, 1);
+    }
+    report(b, incremental ? "save_game_incremental" : "save_game");
+  }
+
+  /*  the level below the player's is built in the background as the game is
+   *  loaded, and waited for as it is destroyed, which is not measured */
+  reset(b);
+  while (b->seconds < bench_time) {
+    start_timer(b);
+    loaded = load_game(BENCH_SAVE_PATH, &found);
+    stop_timer(b, 1);
+
+    assert(loaded != NULL);
+    destroy_game(loaded);
+  }
+  report(b, "load_game");
+
+  destroy_game(g);
+  remove_save(BENCH_SAVE_PATH);
+}
+
+/*  populate_map: spawning a level's planned inhabitants, among the rats
+ *  already there; an operation is a whole populate_map() call */
+static void bench_populate_map(struct bench *b)
+{
+  actor_handle *spawned;
+  int i;
+
+  spawned = (actor_handle*)malloc(sizeof(actor_handle) * MAP_MAX_SPAWNS);
+  assert(spawned != NULL);
+
+  reset(b);
+  while (b->seconds < bench_time) {
+    /*  plan on cells nobody stands on */
+    plan_population(b->m, &b->rng, 20);
+
+    start_timer(b);
+    populate_map(b->g, 0);
+    stop_timer(b, 1);
+
+    /*  remove the newcomers again */
+    for (i = 0; i < 20; i++) {
+      spawned[i] = get_occupant(b->m, b->m->spawn_x[i], b->m->spawn_y[i]);
+    }
+    for (i = 0; i < 20; i++) {
+      actor_death(b->g, spawned[i]);
+    }
+  }
+  report(b, "populate_map");
+
+  free(spawned);
+}
+
+/*  find_actor_by_position: looking up who stands on a random cell */
+static void bench_find_actor_by_position(struct bench *b)
+{
+  int x[BENCH_BATCH], y[BENCH_BATCH];
+  int i;
+
+  for (i = 0; i < BENCH_BATCH; i++) {
+    x[i] = rng_range(&b->rng, b->m->width);
+    y[i] = rng_range(&b->rng, b->m->height);
+  }
+
+  reset(b);
+  while (b->seconds < bench_time) {
+    start_timer(b);
+    for (i = 0; i < BENCH_BATCH; i++) {
+      sink += find_actor_by_position(b->g, x[i], y[i], 0);
+    }
+    stop_timer(b, BENCH_BATCH);
+  }
+  report(b, "find_actor_by_position");
+}
+
+/*  move_actor: moving a random rat one step in a random direction, which may
+ *  bump into a wall or attack another rat instead */
+static void bench_move_actor(struct bench *b)
+{
+  actor_handle rat[BENCH_BATCH];
+  int dx[BENCH_BATCH], dy[BENCH_BATCH];
+  int i;
+
+  reset(b);
+  while (b->seconds < bench_time) {
+    for (i = 0; i < BENCH_BATCH; i++) {
+      int direction = rng_range(&b->rng, 4);
+
+      rat[i] = random_rat(b);
+      dx[i]  = (direction == 0) ? -1 : (direction == 1) ? 1 : 0;
+      dy[i]  = (direction == 2) ? -1 : (direction == 3) ? 1 : 0;
+    }
+
+    start_timer(b);
+    for (i = 0; i < BENCH_BATCH; i++) {
+      move_actor(b->g, rat[i], dx[i], dy[i]);
+    }
+    stop_timer(b, BENCH_BATCH);
+  }
+  report(b, "move_actor");
+}
+
+/*  next_actor: taking the actor due next out of the scheduler, and
+ *  scheduling it again, as every turn does */
+static void bench_next_actor(struct bench *b)
+{
+  struct actor_pool *p = b->g->actors;
+  int i, slot;
+
+  /*  schedule the whole level, at varied speeds */
+  for (slot = 0; slot < p->used; slot++) {
+    actor_handle a = actor_at_slot(p, slot);
+
+    if ((a != ACTOR_NONE) && (ACTOR(p, a, heap_index) < 0)) {
+      ACTOR(p, a, speed) = 50 + rng_range(&b->rng, 100);
+      schedule_actor(b->g->scheduler, p, a,
+        rng_range(&b->rng, SCHEDULER_TURN));
+    }
+  }
+
+  reset(b);
+  while (b->seconds < bench_time) {
+    start_timer(b);
+    for (i = 0; i < BENCH_BATCH; i++) {
+      actor_handle a = next_actor(b->g->scheduler, p);
+
+      schedule_actor(b->g->scheduler, p, a,
+        SCHEDULER_TURN * ACTOR_SPEED_NORMAL / ACTOR(p, a, speed));
+    }
+    stop_timer(b, BENCH_BATCH);
+  }
+  report(b, "next_actor");
+}
+
+/*  do_act: a turn of the level, in which the player takes a random step and
+ *  then every rat acts, chasing the player through the shared flow field; an
+ *  operation is a single rat's action */
+static void bench_monster_turn(struct bench *b)
+{
+  struct actor_pool *p = b->g->actors;
+  actor_handle *rats;
+  int n = 0, i, slot;
+
+  rats = (actor_handle*)malloc(sizeof(actor_handle) * p->used);
+  assert(rats != NULL);
+
+  for (slot = 0; slot < p->used; slot++) {
+    actor_handle a = actor_at_slot(p, slot);
+
+    if ((a != ACTOR_NONE) && (a != b->g->player)) {
+      rats[n++] = a;
+    }
+  }
+
+  /*  the rats are nigh unkillable, and so is the player */
+  ACTOR(p, b->g->player, hp) = 1 << 30;
+
+  reset(b);
+  while (b->seconds < bench_time) {
+    int direction = rng_range(&b->rng, 4);
+
+    start_timer(b);
+    move_actor(b->g, b->g->player,
+      (direction == 0) ? -1 : (direction == 1) ? 1 : 0,
+      (direction == 2) ? -1 : (direction == 3) ? 1 : 0);
+    for (i = 0; i < n; i++) {
+      do_act(b->g, rats[i]);
+    }
+    stop_timer(b, n);
+  }
+  report(b, "monster_turn");
+
+  free(rats);
+}
+
+/*  actor_death: killing every rat on the level, one at a time */
+static void bench_actor_death(struct bench *b)
+{
+  reset(b);
+  while (b->seconds < bench_time) {
+    kill_rats(b, 1);
+    add_rats(b, b->population);
+  }
+  report(b, "actor_death");
+}
+
+/*  draw_map: redrawing the whole level off-screen */
+static void bench_draw_map_full(struct bench *b)
+{
+  int i;
+
+  reset(b);
+  while (b->seconds < bench_time) {
+    start_timer(b);
+    for (i = 0; i < 100; i++) {
+      b->g->ui->drawn_z = -1;
+      draw_map(b->g, 0);
+    }
+    stop_timer(b, 100);
+  }
+  report(b, "draw_map_full");
+}
+
+/*  draw_map: drawing a frame off-screen after a single rat moved, as happens
+ *  on most turns */
+static void bench_draw_map_incremental(struct bench *b)
+{
+  int i;
+
+  draw_map(b->g, 0);
+
+  reset(b);
+  while (b->seconds < bench_time) {
+    for (i = 0; i < 100; i++) {
+      int direction = rng_range(&b->rng, 4);
+
+      move_actor(b->g, random_rat(b),
+        (direction == 0) ? -1 : (direction == 1) ? 1 : 0,
+        (direction == 2) ? -1 : (direction == 3) ? 1 : 0);
+
+      start_timer(b);
+      draw_map(b->g, 0);
+      stop_timer(b, 1);
+    }
+  }
+  report(b, "draw_map_incremental");
+}
+
+/*
+ *  prints the command line usage
+ *
+ *  char *name -- the program name
+ *  void return
+ */
+static void print_usage(char *name)
+{
+  fprintf(stderr, "Usage: %s [-t seconds_per_benchmark]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+  /*  a level as generated, and a level packed with rats */
+  int populations[] = { 20, 1000 };
+  struct bench b;
+  int i, opt;
+
+  while ((opt = getopt(argc, argv, "t:")) != -1) {
+    switch (opt) {
+    case 't':
+      bench_time = atof(optarg);
+      break;
+    default:
+      print_usage(argv[0]);
+      return -1;
+    }
+  }
+
+  printf("{\n  \"benchmarks\": [");
+
+  /*  these do not depend on the population */
+  setup(&b, 0);
+  bench_generate_dungeon(&b);
+  bench_generate_map(&b);
+  bench_find_random_free_tile(&b);
+  bench_flood_fill(&b);
+  bench_distance_field(&b, 0);
+  bench_distance_field(&b, 1);
+  bench_cast_fov(&b);
+  bench_update_fov(&b);
+  bench_carve_cave(&b);
+  bench_large_level(&b);
+  bench_find_path(&b, 0);
+  bench_find_path(&b, 1);
+  bench_save_game(&b);
+
+  if (check_distance_field(&b) != 0) {
+    fprintf(stderr, "The bit-parallel and scalar searches disagree\n");
+    return -1;
+  }
+  if (check_find_path(&b) != 0) {
+    fprintf(stderr, "Some paths found are not the shortest ones\n");
+    return -1;
+  }
+  if (check_save(&b) != 0) {
+    fprintf(stderr, "Some saved games do not load back as they were\n");
+    return -1;
+  }
+  if (bench_generators(&b) != 0) {
+    fprintf(stderr, "Some generated levels are not connected\n");
+    return -1;
+  }
+  teardown(&b);
+
+  for (i = 0; i < (int)(sizeof(populations) / sizeof(populations[0])); i++) {
+    setup(&b, populations[i]);
+    assert(count_rats(&b) == populations[i]);
+
+    bench_populate_map(&b);
+    bench_find_actor_by_position(&b);
+    bench_move_actor(&b);
+    bench_draw_map_full(&b);
+    bench_draw_map_incremental(&b);
+    bench_next_actor(&b);
+    bench_monster_turn(&b);
+    bench_actor_death(&b);
+
+    teardown(&b);
+  }
+
+  printf("\n  ]\n}\n");
+  return 0;
+}
+
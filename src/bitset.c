@@ -0,0 +1,94 @@
+
+/*
+ *  bitset.c
+ *  Part of Amuleta, a traditional roguelike - https://deveah.github.io/amuleta
+ *  (c) Vlad Dumitru, <dalv.urtimud@gmail.com>
+ *  Licensed under the terms and conditions of the MIT License. Please consult
+ *  the LICENSE file included with this project.
+ */
+
+#include <string.h>
+#include <termbox.h>
+#include "amuleta.h"
+
+/*
+ *  returns the number of set bits of a word
+ *
+ *  unsigned long w -- the word
+ *  int return      -- the number of set bits
+ */
+int count_word_bits(unsigned long w)
+{
+  /*  add up the bits in pairs, then in nibbles, then in bytes, and sum the
+   *  bytes with a multiplication; the masks (0x55.., 0x33.., 0x0f.. and
+   *  0x01..) are worked out for the width of the word, and this does not rely
+   *  on the processor having an instruction for it */
+  w = w - ((w >> 1) & (~0ul / 3));
+  w = (w & (~0ul / 5)) + ((w >> 2) & (~0ul / 5));
+  w = (w + (w >> 4)) & (~0ul / 17);
+
+  return (int)((w * (~0ul / 255)) >> (MAP_WORD_BITS - 8));
+}
+
+/*
+ *  returns the index of the lowest set bit of a word
+ *
+ *  unsigned long w -- the word, which must not be 0
+ *  int return      -- the bit index
+ */
+int lowest_word_bit(unsigned long w)
+{
+#ifdef __GNUC__
+  return __builtin_ctzl(w);
+#else
+  int i = 0;
+
+  while (!(w & 1)) {
+    w >>= 1;
+    i++;
+  }
+
+  return i;
+#endif
+}
+
+/*
+ *  returns the index of the highest set bit of a word
+ *
+ *  unsigned long w -- the word, which must not be 0
+ *  int return      -- the bit index
+ */
+int highest_word_bit(unsigned long w)
+{
+#ifdef __GNUC__
+  return MAP_WORD_BITS - 1 - __builtin_clzl(w);
+#else
+  int i = MAP_WORD_BITS - 1;
+
+  while (!(w >> i)) {
+    i--;
+  }
+
+  return i;
+#endif
+}
+
+/*
+ *  returns the number of cells set in a bitset
+ *
+ *  struct map_bitset *b -- the bitset
+ *  int return           -- the number of cells
+ */
+int count_bitset(struct map_bitset *b)
+{
+  int count = 0, y, w;
+
+  for (y = 0; y < WINDOW_HEIGHT; y++) {
+    for (w = 0; w < MAP_ROW_WORDS; w++) {
+      count += count_word_bits(b->row[y][w]);
+    }
+  }
+
+  return count;
+}
+
@@ -8,7 +8,9 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 #include <termbox.h>
 #include "amuleta.h"
 
@@ -19,7 +21,8 @@ struct tb_cell rat_cell = {
 };
 
 /*
- *  generate a dungeon structure, complete with generated maps
+ *  generate a dungeon structure; its maps are left empty, and are generated
+ *  on demand by ensure_level()
  *
  *  struct dungeon *return -- the dungeon structure
  */
@@ -30,68 +33,861 @@ struct dungeon *generate_dungeon(void)
   assert(d != NULL);
   DEBUG("Allocated dungeon @0x%p\n", d);
 
-  /*  generate maps */
+  /*  no map exists until a level is first reached */
   int i;
   for (i = 0; i < DUNGEON_DEPTH; i++) {
-    d->map[i] = generate_map();
+    d->map[i] = NULL;
   }
 
+  /*  nothing is being prefetched */
+  d->prefetch_z = -1;
+
   DEBUG("Finished creating the dungeon\n");
   return d;
 }
 
 /*
- *  generate a map structure, complete with a level layout
+ *  the chunk every chunk of a map starts out as: solid rock, with nobody on
+ *  it, and nothing seen; it is shared by all maps, and never written to once
+ *  set up (see set_up_blank_chunk())
+ */
+static struct map_chunk blank_chunk;
+static unsigned char blank_tile[CHUNK_SIZE][CHUNK_SIZE];
+static struct tb_cell blank_terrain[CHUNK_SIZE][CHUNK_SIZE];
+static pthread_once_t blank_chunk_once = PTHREAD_ONCE_INIT;
+
+/*  the serial number of the last map generated; maps are generated by the
+ *  prefetching thread as well, so it is only ever changed under its lock */
+static unsigned long last_map_serial = 0;
+static pthread_mutex_t map_serial_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ *  sets up the blank chunk; run once, by whichever thread generates a map
+ *  first
  *
- *  struct map *return -- the map structure
+ *  void return
  */
-struct map *generate_map(void)
+static void set_up_blank_chunk(void)
 {
+  struct tile *rock = tile_palette[TILE_WALL];
   int i, j;
 
+  memset(&blank_chunk, 0, sizeof(blank_chunk));
+
+  for (j = 0; j < CHUNK_SIZE; j++) {
+    for (i = 0; i < CHUNK_SIZE; i++) {
+      blank_tile[j][i]            = TILE_WALL;
+      blank_chunk.occupant[j][i]  = ACTOR_NONE;
+      blank_chunk.free_slot[j][i] = -1;
+      blank_terrain[j][i]         = *rock->cell;
+    }
+
+    blank_chunk.bits[LAYER_PASSABLE][j] =
+      (rock->flags & TILE_FLAG_SOLID) ? 0 : ~0u;
+    blank_chunk.bits[LAYER_OPAQUE][j] =
+      (rock->flags & TILE_FLAG_OPAQUE) ? ~0u : 0;
+  }
+
+  blank_chunk.tile    = blank_tile;
+  blank_chunk.terrain = blank_terrain;
+}
+
+/*
+ *  generate a map structure of a given size, made of solid rock all over; a
+ *  level generator then lays out the level (see `struct generator')
+ *
+ *  int width, height   -- the dimensions of the map, at most MAP_MAX_SIZE
+ *  struct map *return  -- the map structure
+ */
+struct map *generate_map(int width, int height)
+{
+  #define MAP_ARENA_CHUNKS 64
+  struct arena *a;
+  struct map *m;
+  int chunks, laid_out, i;
+
+  assert((width > 0) && (width <= MAP_MAX_SIZE));
+  assert((height > 0) && (height <= MAP_MAX_SIZE));
+  pthread_once(&blank_chunk_once, set_up_blank_chunk);
+
+  /*  everything the map allocates comes out of its own arena, whose first
+   *  block has room for the map, and for the chunks and the list of free
+   *  cells (as it grows) of a level small enough to be laid out all over;
+   *  the terrain of the chunks on screen takes another block */
+  chunks = ((width + CHUNK_MASK) >> CHUNK_BITS) *
+           ((height + CHUNK_MASK) >> CHUNK_BITS);
+  laid_out = (chunks < MAP_ARENA_CHUNKS) ? chunks : MAP_ARENA_CHUNKS;
+  a = create_arena(sizeof(struct map) + sizeof(struct map_chunk*) * chunks +
+    (sizeof(struct map_chunk) + (1 + 2 * sizeof(int)) * CHUNK_SIZE *
+     CHUNK_SIZE) * laid_out);
+
   /*  allocate map struct */
-  struct map *m = (struct map*)malloc(sizeof(struct map));
-  assert(m != NULL);
-  DEBUG("Allocated map @0x%p\n", m);
-
-  /*  basic map generation -- fill the map with floor tiles, and border the
-   *  level with wall tiles */
-  for (i = 0; i < MAP_WIDTH; i++) {
-    for (j = 0; j < MAP_HEIGHT; j++) {
-      if ((i == 0) || (i == MAP_WIDTH-1) ||
-          (j == 0) || (j == MAP_HEIGHT-1)) {
-        m->tile[i][j] = &wall_tile;
+  m = (struct map*)arena_alloc(a, sizeof(struct map));
+  DEBUG("Allocated map @0x%p (%ix%i)\n", m, width, height);
+
+  m->arena  = a;
+  m->width  = width;
+  m->height = height;
+
+  /*  no chunk is written to yet */
+  m->chunks_wide = (width + CHUNK_MASK) >> CHUNK_BITS;
+  m->chunks_high = (height + CHUNK_MASK) >> CHUNK_BITS;
+  m->chunk = (struct map_chunk**)arena_alloc(a,
+    sizeof(struct map_chunk*) * chunks);
+  for (i = 0; i < chunks; i++) {
+    m->chunk[i] = &blank_chunk;
+  }
+  m->chunk_count = 0;
+
+  /*  rock is never free */
+  m->free_cell     = NULL;
+  m->free_count    = 0;
+  m->free_capacity = 0;
+
+  /*  the map has never been drawn, so all of it is going to be */
+  m->dirty_count = 0;
+  m->redraw      = 1;
+
+  /*  nothing has been seen yet */
+  memset(&m->view, 0, sizeof(m->view));
+  m->view_valid = 0;
+  m->fov_cached = 0;
+  m->flow_valid = 0;
+
+  /*  by default, actors arrive in the middle of the level */
+  m->entry_x = width / 2;
+  m->entry_y = height / 2;
+
+  /*  nobody is planned to spawn here yet */
+  m->spawns = 0;
+
+  pthread_mutex_lock(&map_serial_lock);
+  m->serial = ++last_map_serial;
+  pthread_mutex_unlock(&map_serial_lock);
+  m->tile_version     = 0;
+  m->occupant_version = 0;
+
+  /*  the map has never been saved */
+  m->unsaved     = 1;
+  m->save_serial = 0;
+  m->save_data   = NULL;
+  m->save_size   = 0;
+
+  DEBUG("Finished generating the map\n");
+  return m;
+}
+
+/*
+ *  frees a map structure, together with its chunks; they all go at once,
+ *  with the map's arena
+ *
+ *  struct map *m -- the map structure
+ *  void return
+ */
+void free_map(struct map *m)
+{
+  if (m == NULL) {
+    return;
+  }
+
+  unmap_level(m);
+  destroy_arena(m->arena);
+}
+
+/*
+ *  returns the chunk holding a given cell of a map, ready to be written to;
+ *  a chunk still shared with the blank one gets a copy of its own first,
+ *  whose terrain is composed anew once it is on screen
+ *
+ *  struct map *m             -- the map structure
+ *  int x, y                  -- the coordinates of the cell
+ *  struct map_chunk *return  -- the chunk
+ */
+static struct map_chunk *touch_chunk(struct map *m, int x, int y)
+{
+  struct map_chunk **c = &MAP_CHUNK(m, x, y);
+
+  if (*c == &blank_chunk) {
+    *c = (struct map_chunk*)arena_alloc(m->arena, sizeof(struct map_chunk));
+    memcpy(*c, &blank_chunk, sizeof(struct map_chunk));
+    (*c)->tile = (unsigned char(*)[CHUNK_SIZE])arena_alloc(m->arena,
+      sizeof(blank_tile));
+    memcpy((*c)->tile, blank_tile, sizeof(blank_tile));
+    (*c)->terrain = NULL;
+    m->chunk_count++;
+  }
+
+  return *c;
+}
+
+/*
+ *  checks whether a chunk of a map has been written to, and so has a copy of
+ *  its own
+ *
+ *  struct map *m -- the map structure
+ *  int i         -- the chunk's index in the map's chunks
+ *  int return    -- non-zero if the chunk has been written to
+ */
+int chunk_written(struct map *m, int i)
+{
+  return m->chunk[i] != &blank_chunk;
+}
+
+/*
+ *  gives a map a chunk of its own, whose tiles are used where they lie, and
+ *  whose layers are copied, but for the occupied and dirty cells, which are
+ *  left clear; nobody stands on the chunk, and none of its cells is listed as
+ *  free, as a saved level is loaded (see load_game())
+ *
+ *  struct map *m                 -- the map structure
+ *  int i                         -- the chunk's index in the map's chunks,
+ *                                   which must not have been written to
+ *  unsigned char (*tile)[]       -- the chunk's tiles
+ *  unsigned int (*bits)[]        -- the chunk's layers
+ *  void return
+ */
+void restore_chunk(struct map *m, int i, unsigned char (*tile)[CHUNK_SIZE],
+  unsigned int (*bits)[CHUNK_SIZE])
+{
+  struct map_chunk *c;
+
+  assert(m->chunk[i] == &blank_chunk);
+
+  c = (struct map_chunk*)arena_alloc(m->arena, sizeof(struct map_chunk));
+  memcpy(c, &blank_chunk, sizeof(struct map_chunk));
+  memcpy(c->bits, bits, sizeof(c->bits));
+  memset(c->bits[LAYER_OCCUPIED], 0, sizeof(c->bits[LAYER_OCCUPIED]));
+  memset(c->bits[LAYER_DIRTY], 0, sizeof(c->bits[LAYER_DIRTY]));
+  c->tile    = tile;
+  c->terrain = NULL;
+
+  m->chunk[i] = c;
+  m->chunk_count++;
+}
+
+/*
+ *  gives a map its list of free cells, which is used where it lies, as a
+ *  saved level is loaded (see load_game()); the list is only moved to the
+ *  map's arena once it grows, so it must be writable
+ *
+ *  struct map *m -- the map structure, with no free cells listed yet
+ *  int *cell     -- the free cells, as y * width + x
+ *  int count     -- the number of free cells
+ *  int return    -- zero if a cell listed is not passable, or is listed
+ *                   twice, in which case the list is only partly restored
+ */
+int restore_free_cells(struct map *m, int *cell, int count)
+{
+  int i;
+
+  assert(m->free_count == 0);
+
+  m->free_cell     = (count > 0) ? cell : NULL;
+  m->free_capacity = count;
+
+  for (i = 0; i < count; i++) {
+    int x, y;
+
+    if ((cell[i] < 0) || (cell[i] >= m->width * m->height)) {
+      return 0;
+    }
+
+    x = cell[i] % m->width;
+    y = cell[i] / m->width;
+    if ((!MAP_CELL_TEST(m, LAYER_PASSABLE, x, y)) ||
+        (MAP_CELL(m, free_slot, x, y) >= 0)) {
+      return 0;
+    }
+
+    /*  a passable cell lies in a chunk of the map's own */
+    MAP_CELL(m, free_slot, x, y) = i;
+    m->free_count++;
+  }
+
+  return 1;
+}
+
+/*
+ *  returns 32 bits of a layer of a map, for the cells of a row starting at a
+ *  given column; cells outside of the map read as the blank chunk's
+ *
+ *  struct map *m         -- the map structure
+ *  int layer             -- the layer (one of LAYER_*)
+ *  int x, y              -- the coordinates of the first cell
+ *  unsigned int return   -- the bits, the first cell in the lowest one
+ */
+static unsigned int get_layer_bits(struct map *m, int layer, int x, int y)
+{
+  unsigned int row = blank_chunk.bits[layer][0],
+               bits[2];
+  int cx, shift, i;
+
+  if ((y < 0) || (y >= m->height)) {
+    return row;
+  }
+
+  /*  the chunk columns holding the cells, rounding down */
+  cx    = (x >= 0) ? x / CHUNK_SIZE : -((CHUNK_MASK - x) / CHUNK_SIZE);
+  shift = x - cx * CHUNK_SIZE;
+
+  for (i = 0; i < 2; i++) {
+    bits[i] = ((cx + i < 0) || (cx + i >= m->chunks_wide)) ? row :
+      m->chunk[(y >> CHUNK_BITS) * m->chunks_wide + cx + i]->
+        bits[layer][y & CHUNK_MASK];
+  }
+
+  if (shift == 0) {
+    return bits[0];
+  }
+
+  return (bits[0] >> shift) | (bits[1] << (CHUNK_SIZE - shift));
+}
+
+/*
+ *  returns 32 bits of a row of a bitset, starting at a given column; cells
+ *  outside of the bitset read as clear
+ *
+ *  struct map_bitset *b  -- the bitset
+ *  int x, y              -- the coordinates of the first cell
+ *  unsigned int return   -- the bits, the first cell in the lowest one
+ */
+static unsigned int get_window_bits(struct map_bitset *b, int x, int y)
+{
+  unsigned long bits;
+  int w, shift;
+
+  if ((x <= -CHUNK_SIZE) || (x >= WINDOW_WIDTH)) {
+    return 0;
+  }
+  if (x < 0) {
+    return get_window_bits(b, 0, y) << -x;
+  }
+
+  w     = x / MAP_WORD_BITS;
+  shift = x % MAP_WORD_BITS;
+  bits  = b->row[y][w] >> shift;
+
+  if ((shift > MAP_WORD_BITS - CHUNK_SIZE) && (w + 1 < MAP_ROW_WORDS)) {
+    bits |= b->row[y][w + 1] << (MAP_WORD_BITS - shift);
+  }
+
+  return (unsigned int)bits;
+}
+
+/*
+ *  returns the tile found at the given coordinates of a map
+ *
+ *  struct map *m       -- the map structure
+ *  int x, y            -- the coordinates
+ *  struct tile *return -- the tile
+ */
+struct tile *get_tile(struct map *m, int x, int y)
+{
+  return tile_palette[MAP_CELL(m, tile, x, y)];
+}
+
+/*
+ *  returns the flags of the tile found at the given coordinates of a map
+ *
+ *  struct map *m -- the map structure
+ *  int x, y      -- the coordinates
+ *  int return    -- the tile flags
+ */
+int get_tile_flags(struct map *m, int x, int y)
+{
+  return tile_palette[MAP_CELL(m, tile, x, y)]->flags;
+}
+
+/*
+ *  adds a cell to the map's list of free cells, or removes it from the list,
+ *  depending on whether or not it is free now; a removed cell's place is
+ *  taken by the last one in the list
+ *
+ *  struct map *m -- the map structure
+ *  int x, y      -- the coordinates of the cell, whose chunk is written to
+ *  void return
+ */
+static void update_free_cell(struct map *m, int x, int y)
+{
+  struct map_chunk *c = MAP_CHUNK(m, x, y);
+  int free_now = (MAP_CELL_TEST(m, LAYER_PASSABLE, x, y)) &&
+                 (!MAP_CELL_TEST(m, LAYER_OCCUPIED, x, y));
+  int slot = c->free_slot[y & CHUNK_MASK][x & CHUNK_MASK];
+
+  if ((free_now) && (slot < 0)) {
+    /*  the list is moved to a piece of the arena twice as large, leaving the
+     *  old one behind, which adds up to no more than the list itself takes */
+    if (m->free_count == m->free_capacity) {
+      int *grown;
+
+      m->free_capacity = (m->free_capacity == 0) ? 256 :
+                         m->free_capacity * 2;
+      grown = (int*)arena_alloc(m->arena, sizeof(int) * m->free_capacity);
+      if (m->free_count > 0) {
+        memcpy(grown, m->free_cell, sizeof(int) * m->free_count);
+      }
+      m->free_cell = grown;
+    }
+
+    m->free_cell[m->free_count] = y * m->width + x;
+    c->free_slot[y & CHUNK_MASK][x & CHUNK_MASK] = m->free_count;
+    m->free_count++;
+    m->unsaved = 1;
+  } else if ((!free_now) && (slot >= 0)) {
+    int last = m->free_cell[--m->free_count];
+
+    m->free_cell[slot] = last;
+    MAP_CELL(m, free_slot, last % m->width, last / m->width) = slot;
+    c->free_slot[y & CHUNK_MASK][x & CHUNK_MASK] = -1;
+    m->unsaved = 1;
+  }
+}
+
+/*
+ *  swaps two entries of the map's list of free cells
+ *
+ *  struct map *m -- the map structure
+ *  int i, j      -- the positions of the entries
+ *  void return
+ */
+static void swap_free_cells(struct map *m, int i, int j)
+{
+  int a = m->free_cell[i],
+      b = m->free_cell[j];
+
+  m->free_cell[i] = b;
+  m->free_cell[j] = a;
+  MAP_CELL(m, free_slot, a % m->width, a / m->width) = j;
+  MAP_CELL(m, free_slot, b % m->width, b / m->width) = i;
+  m->unsaved = 1;
+}
+
+/*
+ *  changes the tile found at the given coordinates of a map
+ *
+ *  struct map *m -- the map structure
+ *  int x, y      -- the coordinates
+ *  int id        -- the tile identifier (one of TILE_*)
+ *  void return
+ */
+void set_tile(struct map *m, int x, int y, int id)
+{
+  struct map_chunk *c;
+  unsigned int bit = 1u << (x & CHUNK_MASK);
+  int row = y & CHUNK_MASK;
+
+  assert((id >= 0) && (id < TILE_COUNT));
+  assert((x >= 0) && (x < m->width) && (y >= 0) && (y < m->height));
+
+  /*  writing rock over rock would needlessly take a chunk of its own */
+  if (MAP_CELL(m, tile, x, y) == id) {
+    return;
+  }
+
+  c = touch_chunk(m, x, y);
+  c->tile[row][x & CHUNK_MASK] = (unsigned char)id;
+  mark_dirty(m, x, y);
+
+  if (tile_palette[id]->flags & TILE_FLAG_SOLID) {
+    c->bits[LAYER_PASSABLE][row] &= ~bit;
+  } else {
+    c->bits[LAYER_PASSABLE][row] |= bit;
+  }
+  update_free_cell(m, x, y);
+
+  /*  the fields of view computed so far only hold as long as no cell starts
+   *  or stops blocking the sight */
+  if (!(tile_palette[id]->flags & TILE_FLAG_OPAQUE) !=
+      !(c->bits[LAYER_OPAQUE][row] & bit)) {
+    c->bits[LAYER_OPAQUE][row] ^= bit;
+    m->view_valid = 0;
+    m->fov_cached = 0;
+  }
+
+  /*  keep the composed terrain in sync, rather than composing it again */
+  if (c->terrain != NULL) {
+    c->terrain[row][x & CHUNK_MASK] = *tile_palette[id]->cell;
+  }
+
+  /*  the way to the player may have changed, and so may any other way */
+  m->flow_valid = 0;
+  m->tile_version++;
+  m->unsaved = 1;
+}
+
+/*
+ *  lays out a part of the terrain of a map at once: the cells set in a window
+ *  get a given tile, and the others are left alone; this does what calling
+ *  set_tile() on every one of them would, but works out the passable and
+ *  opaque cells a chunk row at a time, which is what a level generator
+ *  writing out a finished layout wants
+ *
+ *  struct map *m             -- the map structure
+ *  int x0, y0                -- the coordinates of the window's top left
+ *                               cell on the map; cells falling outside of
+ *                               the map are left out
+ *  struct map_bitset *cells  -- the cells to get `id'
+ *  int id                    -- the tile identifier (one of TILE_*)
+ *  void return
+ */
+void set_terrain(struct map *m, int x0, int y0, struct map_bitset *cells,
+  int id)
+{
+  struct tile *t;
+  int x, y, j, cx, first, last;
+
+  assert((id >= 0) && (id < TILE_COUNT));
+  t = tile_palette[id];
+
+  /*  only the chunk columns the window overlaps */
+  first = (x0 > 0) ? x0 >> CHUNK_BITS : 0;
+  last  = (x0 + WINDOW_WIDTH - 1) >> CHUNK_BITS;
+  if (last >= m->chunks_wide) {
+    last = m->chunks_wide - 1;
+  }
+
+  for (j = 0; j < WINDOW_HEIGHT; j++) {
+    y = y0 + j;
+    if ((y < 0) || (y >= m->height)) {
+      continue;
+    }
+
+    for (cx = first; cx <= last; cx++) {
+      unsigned int in = get_window_bits(cells, cx * CHUNK_SIZE - x0, j),
+                   left = in;
+      struct map_chunk *c;
+      int row = y & CHUNK_MASK;
+
+      /*  the cells past the right edge of the map are left out */
+      if (m->width - cx * CHUNK_SIZE < CHUNK_SIZE) {
+        in &= (1u << (m->width - cx * CHUNK_SIZE)) - 1;
+        left = in;
+      }
+      if (in == 0) {
+        continue;
+      }
+
+      c = touch_chunk(m, cx * CHUNK_SIZE, y);
+      if (t->flags & TILE_FLAG_SOLID) {
+        c->bits[LAYER_PASSABLE][row] &= ~in;
       } else {
-        m->tile[i][j] = &floor_tile;
+        c->bits[LAYER_PASSABLE][row] |= in;
+      }
+      if (t->flags & TILE_FLAG_OPAQUE) {
+        c->bits[LAYER_OPAQUE][row] |= in;
+      } else {
+        c->bits[LAYER_OPAQUE][row] &= ~in;
+      }
+
+      while (left) {
+        int i = lowest_word_bit(left);
+
+        x = cx * CHUNK_SIZE + i;
+        c->tile[row][i] = (unsigned char)id;
+        if (c->terrain != NULL) {
+          c->terrain[row][i] = *t->cell;
+        }
+        update_free_cell(m, x, y);
+        left &= left - 1;
       }
     }
   }
 
-  DEBUG("Finished generating the map\n");
-  return m;
+  m->view_valid = 0;
+  m->fov_cached = 0;
+  m->redraw     = 1;
+  m->flow_valid = 0;
+  m->tile_version++;
+  m->unsaved = 1;
+}
+
+/*
+ *  fills in a window with a layer of a map (see `struct map_bitset'), a chunk
+ *  row at a time; cells outside of the map read as solid rock would
+ *
+ *  struct map *m         -- the map structure
+ *  int layer             -- the layer (one of LAYER_*)
+ *  int x0, y0            -- the coordinates of the window's top left cell on
+ *                           the map
+ *  struct map_bitset *b  -- the window, to be filled in
+ *  void return
+ */
+void load_window(struct map *m, int layer, int x0, int y0,
+  struct map_bitset *b)
+{
+  int j, w, k;
+
+  for (j = 0; j < WINDOW_HEIGHT; j++) {
+    for (w = 0; w < MAP_ROW_WORDS; w++) {
+      unsigned long word = 0;
+
+      for (k = 0; k < MAP_WORD_BITS; k += CHUNK_SIZE) {
+        word |= (unsigned long)get_layer_bits(m, layer,
+          x0 + w * MAP_WORD_BITS + k, y0 + j) << k;
+      }
+
+      b->row[j][w] = word;
+    }
+  }
+}
+
+/*
+ *  adds the cells set in a window to a layer of a map; cells falling outside
+ *  of the map are left out
+ *
+ *  struct map *m         -- the map structure
+ *  int layer             -- the layer (one of LAYER_*)
+ *  int x0, y0            -- the coordinates of the window's top left cell on
+ *                           the map
+ *  struct map_bitset *b  -- the window
+ *  void return
+ */
+void merge_window(struct map *m, int layer, int x0, int y0,
+  struct map_bitset *b)
+{
+  int j, cx, first, last;
+
+  /*  only the chunk columns the window overlaps */
+  first = (x0 > 0) ? x0 >> CHUNK_BITS : 0;
+  last  = (x0 + WINDOW_WIDTH - 1) >> CHUNK_BITS;
+  if (last >= m->chunks_wide) {
+    last = m->chunks_wide - 1;
+  }
+
+  for (j = 0; j < WINDOW_HEIGHT; j++) {
+    int y = y0 + j;
+
+    if ((y < 0) || (y >= m->height)) {
+      continue;
+    }
+
+    for (cx = first; cx <= last; cx++) {
+      unsigned int in = get_window_bits(b, cx * CHUNK_SIZE - x0, j);
+      struct map_chunk *c = m->chunk[(y >> CHUNK_BITS) * m->chunks_wide + cx];
+
+      if ((in & ~c->bits[layer][y & CHUNK_MASK]) == 0) {
+        continue;
+      }
+
+      c = touch_chunk(m, cx * CHUNK_SIZE, y);
+      c->bits[layer][y & CHUNK_MASK] |= in;
+      m->unsaved = 1;
+    }
+  }
+}
+
+/*
+ *  returns which of the cells around a given one (itself included) are set
+ *  in a layer of a map, as one bit per cell (see NEIGHBOUR_BIT()); cells
+ *  outside of the map read as solid rock would
+ *
+ *  struct map *m -- the map structure
+ *  int layer     -- the layer (one of LAYER_*)
+ *  int x, y      -- the coordinates of the cell in the middle
+ *  int return    -- the neighbourhood mask
+ */
+int cell_neighbourhood(struct map *m, int layer, int x, int y)
+{
+  int mask = 0, dy;
+
+  for (dy = -1; dy <= 1; dy++) {
+    mask |= (int)(get_layer_bits(m, layer, x - 1, y + dy) & 7) <<
+      ((dy + 1) * 3);
+  }
+
+  return mask;
+}
+
+/*
+ *  returns the actor standing at the given coordinates of a map
+ *
+ *  struct map *m         -- the map structure
+ *  int x, y              -- the coordinates
+ *  actor_handle return  -- the actor, or ACTOR_NONE if the cell is unoccupied
+ */
+actor_handle get_occupant(struct map *m, int x, int y)
+{
+  return MAP_CELL(m, occupant, x, y);
+}
+
+/*
+ *  records which actor stands at the given coordinates of a map; every
+ *  change of an actor's position must be reflected here
+ *
+ *  struct map *m   -- the map structure
+ *  int x, y        -- the coordinates
+ *  actor_handle a -- the actor, or ACTOR_NONE to mark the cell as unoccupied
+ *  void return
+ */
+void set_occupant(struct map *m, int x, int y, actor_handle a)
+{
+  struct map_chunk *c;
+  unsigned int bit = 1u << (x & CHUNK_MASK);
+
+  if (MAP_CELL(m, occupant, x, y) == a) {
+    return;
+  }
+
+  c = touch_chunk(m, x, y);
+  c->occupant[y & CHUNK_MASK][x & CHUNK_MASK] = a;
+  mark_dirty(m, x, y);
+
+  if (a != ACTOR_NONE) {
+    c->bits[LAYER_OCCUPIED][y & CHUNK_MASK] |= bit;
+  } else {
+    c->bits[LAYER_OCCUPIED][y & CHUNK_MASK] &= ~bit;
+  }
+  update_free_cell(m, x, y);
+  m->occupant_version++;
+}
+
+/*
+ *  records that the appearance of a cell has changed, so that it is drawn
+ *  again the next time the map is shown
+ *
+ *  struct map *m -- the map structure
+ *  int x, y      -- the coordinates
+ *  void return
+ */
+void mark_dirty(struct map *m, int x, int y)
+{
+  struct map_chunk *c;
+
+  /*  nothing to do if the cell is already listed, or if everything is going
+   *  to be drawn anyway */
+  if ((m->redraw) || (MAP_CELL_TEST(m, LAYER_DIRTY, x, y))) {
+    return;
+  }
+
+  if (m->dirty_count == MAP_MAX_DIRTY) {
+    m->redraw = 1;
+    return;
+  }
+
+  c = touch_chunk(m, x, y);
+  c->bits[LAYER_DIRTY][y & CHUNK_MASK] |= 1u << (x & CHUNK_MASK);
+  m->dirty_cell[m->dirty_count++] = y * m->width + x;
+}
+
+/*
+ *  forgets about all changed cells, once the map has been drawn
+ *
+ *  struct map *m -- the map structure
+ *  void return
+ */
+void clear_dirty(struct map *m)
+{
+  int i;
+
+  for (i = 0; i < m->dirty_count; i++) {
+    int x = m->dirty_cell[i] % m->width,
+        y = m->dirty_cell[i] / m->width;
+
+    MAP_CHUNK(m, x, y)->bits[LAYER_DIRTY][y & CHUNK_MASK] = 0;
+  }
+
+  m->dirty_count = 0;
+  m->redraw      = 0;
+}
+
+/*
+ *  composes the appearance of the terrain of a part of a map (see
+ *  `struct map_chunk'), unless it is already up to date; only the chunks
+ *  overlapping the part are looked at, and only they take memory for it
+ *
+ *  struct map *m         -- the map structure
+ *  int x, y              -- the coordinates of the part's top left cell
+ *  int width, height     -- the dimensions of the part
+ *  void return
+ */
+void compose_terrain(struct map *m, int x, int y, int width, int height)
+{
+  int cx, cy, i, j;
+
+  for (cy = y >> CHUNK_BITS; cy <= (y + height - 1) >> CHUNK_BITS; cy++) {
+    for (cx = x >> CHUNK_BITS; cx <= (x + width - 1) >> CHUNK_BITS; cx++) {
+      struct map_chunk *c = m->chunk[cy * m->chunks_wide + cx];
+
+      if (c->terrain != NULL) {
+        continue;
+      }
+
+      c->terrain = (struct tb_cell(*)[CHUNK_SIZE])arena_alloc(m->arena,
+        sizeof(struct tb_cell) * CHUNK_SIZE * CHUNK_SIZE);
+
+      for (j = 0; j < CHUNK_SIZE; j++) {
+        for (i = 0; i < CHUNK_SIZE; i++) {
+          c->terrain[j][i] = *tile_palette[c->tile[j][i]]->cell;
+        }
+      }
+    }
+  }
 }
 
 /*
- *  finds a random free tile (ie. a non-solid terrain type) on a given map
+ *  finds a random free tile (ie. a non-solid terrain type, with nobody
+ *  standing on it) on a given map, each with the same probability, in
+ *  constant time; the map must have at least one
  *
  *  struct map *m -- the map structure
+ *  struct rng *r -- the random number generator
  *  int *x        -- pointer to where to store `x'
  *  int *y        -- pointer to where to store `y'
  */
-void find_random_free_tile(struct map *m, int *x, int *y)
+void find_random_free_tile(struct map *m, struct rng *r, int *x, int *y)
 {
-  while (1) {
-    *x = rand() % MAP_WIDTH;
-    *y = rand() % MAP_HEIGHT;
+  int cell;
 
-    if (!(m->tile[*x][*y]->flags & TILE_FLAG_SOLID)) {
-      break;
-    }
+  assert(m->free_count > 0);
+  cell = m->free_cell[rng_range(r, (unsigned int)m->free_count)];
+
+  *x = cell % m->width;
+  *y = cell / m->width;
+}
+
+/*
+ *  decides where the inhabitants of a map will spawn, without creating them;
+ *  this only touches the map itself, so it is safe to run off the main thread
+ *
+ *  each spawn takes constant time, and no two land on the same cell: the
+ *  front of the list of free cells is shuffled one pick at a time, so cells
+ *  already picked are never picked again; the level's entry point is kept
+ *  clear by moving it out of the way first
+ *
+ *  struct map *m -- the map structure
+ *  struct rng *r -- the random number generator
+ *  int count     -- the number of inhabitants, at most MAP_MAX_SPAWNS
+ *  int return    -- the number of inhabitants planned, fewer than `count' if
+ *                   the map runs out of free cells
+ */
+int plan_population(struct map *m, struct rng *r, int count)
+{
+  int first = 0, i;
+
+  assert(count <= MAP_MAX_SPAWNS);
+  m->spawns = 0;
+
+  if (MAP_CELL(m, free_slot, m->entry_x, m->entry_y) >= 0) {
+    swap_free_cells(m, 0, MAP_CELL(m, free_slot, m->entry_x, m->entry_y));
+    first = 1;
+  }
+
+  for (i = first; (i < first + count) && (i < m->free_count); i++) {
+    int cell;
+
+    swap_free_cells(m, i, i + rng_range(r, (unsigned int)(m->free_count - i)));
+    cell = m->free_cell[i];
+
+    m->spawn_x[m->spawns] = cell % m->width;
+    m->spawn_y[m->spawns] = cell / m->width;
+    m->spawns++;
   }
+
+  return m->spawns;
 }
 
 /*
- *  populate a map with other entities
+ *  populate a map with other entities, as planned by plan_population()
  *
  *  struct game *g  -- the game structure to which the actors are attached
  *  int z           -- the level index of the map
@@ -99,32 +895,198 @@ void find_random_free_tile(struct map *m, int *x, int *y)
  */
 void populate_map(struct game *g, int z)
 {
+  struct actor_pool *p = g->actors;
+  struct map *m = g->dungeon->map[z];
   int i;
 
-  struct actor *last_added = g->actors;
-  while (last_added->next) {
-    last_added = last_added->next;
-  }
+  for (i = 0; i < m->spawns; i++) {
+    int x = m->spawn_x[i],
+        y = m->spawn_y[i];
+    actor_handle rat;
 
-  for (i = 0; i < 20; i++) {
-    int x, y;
-    find_random_free_tile(g->dungeon->map[z], &x, &y);
+    /*  plan_population() never picks a cell somebody stands on */
+    assert(get_occupant(m, x, y) == ACTOR_NONE);
 
     /*  populate with rats */
-    struct actor *rat = malloc(sizeof(struct actor));
-    rat->name = "Rat";
-    rat->cell = &rat_cell;
-    rat->x = x;
-    rat->y = y;
-    rat->z = z;
+    rat = spawn_actor(p);
+    ACTOR(p, rat, name) = "Rat";
+    ACTOR(p, rat, cell) = &rat_cell;
+    ACTOR(p, rat, x) = x;
+    ACTOR(p, rat, y) = y;
+    ACTOR(p, rat, z) = z;
+
+    ACTOR(p, rat, hp) = 1;
+    ACTOR(p, rat, max_hp) = 1;
+
+    set_occupant(m, x, y, rat);
+  }
+
+  m->spawns = 0;
+}
+
+/*
+ *  builds the map of a level, laid out and sized as the level's plan says
+ *  (see `level_plan'), including the planned population; the result depends
+ *  only on the arguments, and no state is shared with the rest of the game,
+ *  so this may run on any thread
+ *
+ *  int z               -- the level index
+ *  struct rng *r       -- the level's random number generator, seeded with
+ *                         the level's own stream (see RNG_STREAM_LEVEL)
+ *  struct map *return  -- the map structure
+ */
+struct map *build_level(int z, struct rng *r)
+{
+  struct map_bitset passable, reachable;
+  struct map *m;
+  int first = 0, cell, x, y;
+
+  m = generate_map(level_plan[z].width, level_plan[z].height);
+  level_plan[z].generator->generate(m, r);
 
-    rat->hp = 1;
-    rat->max_hp = 1;
-    rat->next = NULL;
+  /*  all levels but the last one lead further down; the stairs are picked
+   *  among the free cells other than the entry point, which is moved to the
+   *  front of the list out of the way */
+  if (z < DUNGEON_DEPTH - 1) {
+    if (MAP_CELL(m, free_slot, m->entry_x, m->entry_y) >= 0) {
+      swap_free_cells(m, 0, MAP_CELL(m, free_slot, m->entry_x, m->entry_y));
+      first = 1;
+    }
+
+    if (m->free_count > first) {
+      cell = m->free_cell[first +
+        rng_range(r, (unsigned int)(m->free_count - first))];
+      x = cell % m->width;
+      y = cell / m->width;
+      set_tile(m, x, y, TILE_STAIRS_DOWN);
 
-    last_added->next = rat;
-    last_added = last_added->next;
+      /*  make sure the way down can be found from the entry point; the
+       *  search works on a window, so larger levels are left to their
+       *  generator */
+      if ((m->width <= WINDOW_WIDTH) && (m->height <= WINDOW_HEIGHT)) {
+        load_window(m, LAYER_PASSABLE, 0, 0, &passable);
+        if ((flood_fill(&passable, m->entry_x, m->entry_y, &reachable) == 0) ||
+            (!MAP_BIT_TEST(&reachable, x, y))) {
+          WARN("Level %i has no way from its entry point to its stairs\n", z);
+        }
+      }
+    } else {
+      WARN("Level %i has no room for its stairs\n", z);
+    }
   }
+
+  plan_population(m, r, 20);
+  DEBUG("Level %i takes %i of its %i chunks\n", z, m->chunk_count,
+    m->chunks_wide * m->chunks_high);
+  return m;
+}
+
+/*
+ *  entry point of the prefetch thread
+ *
+ *  void *arg     -- the dungeon structure
+ *  void *return  -- unused
+ */
+static void *prefetch_worker(void *arg)
+{
+  struct dungeon *d = (struct dungeon*)arg;
+
+  d->prefetch_map = build_level(d->prefetch_z, &d->prefetch_rng);
+  return NULL;
+}
+
+/*
+ *  starts building a level on a background thread, so that it is ready by the
+ *  time it is reached; does nothing if the level already exists, or if
+ *  another level is being prefetched
+ *
+ *  struct game *g  -- the game structure
+ *  int z           -- the level index
+ *  void return
+ */
+void prefetch_level(struct game *g, int z)
+{
+  struct dungeon *d = g->dungeon;
+
+  if ((z < 0) || (z >= DUNGEON_DEPTH) || (d->map[z] != NULL) ||
+      (d->prefetch_z >= 0)) {
+    return;
+  }
+
+  d->prefetch_z    = z;
+  d->prefetch_map  = NULL;
+  rng_seed(&d->prefetch_rng, g->random_seed, RNG_STREAM_LEVEL(z));
+
+  if (pthread_create(&d->prefetch_thread, NULL, prefetch_worker, d) != 0) {
+    WARN("Unable to start prefetching level %i\n", z);
+    d->prefetch_z = -1;
+    return;
+  }
+
+  DEBUG("Prefetching level %i\n", z);
+}
+
+/*
+ *  waits for the level being prefetched (if any) to be finished, and hands
+ *  its map over to the caller
+ *
+ *  struct dungeon *d   -- the dungeon structure
+ *  int *z              -- pointer to where to store the level index
+ *  struct map *return  -- the finished map, or NULL if nothing was prefetched
+ */
+static struct map *finish_prefetch(struct dungeon *d, int *z)
+{
+  if (d->prefetch_z < 0) {
+    return NULL;
+  }
+
+  pthread_join(d->prefetch_thread, NULL);
+
+  *z = d->prefetch_z;
+  d->prefetch_z = -1;
+  return d->prefetch_map;
+}
+
+/*
+ *  returns the map of a given level, generating and populating it first if
+ *  the level has not been reached before; every level is generated from its
+ *  own seed, so the result does not depend on the order levels are visited
+ *  in, nor on whether it was prefetched
+ *
+ *  struct game *g      -- the game structure
+ *  int z               -- the level index
+ *  struct map *return  -- the level's map
+ */
+struct map *ensure_level(struct game *g, int z)
+{
+  struct dungeon *d = g->dungeon;
+  struct map *m;
+  int prefetched_z;
+
+  assert((z >= 0) && (z < DUNGEON_DEPTH));
+
+  if (d->map[z] != NULL) {
+    return d->map[z];
+  }
+
+  /*  take over whatever has been prefetched, even if it is another level */
+  m = finish_prefetch(d, &prefetched_z);
+  if (m != NULL) {
+    DEBUG("Received prefetched level %i\n", prefetched_z);
+    d->map[prefetched_z] = m;
+    populate_map(g, prefetched_z);
+  }
+
+  if (d->map[z] == NULL) {
+    struct rng r;
+
+    INFO("Generating level %i\n", z);
+    rng_seed(&r, g->random_seed, RNG_STREAM_LEVEL(z));
+    d->map[z] = build_level(z, &r);
+    populate_map(g, z);
+  }
+
+  return d->map[z];
 }
 
 /*
@@ -135,11 +1097,21 @@ void populate_map(struct game *g, int z)
  */
 void free_dungeon(struct dungeon *d)
 {
-  /*  free the attached maps */
+  struct map *m;
   int i;
+
+  /*  wait for the prefetch thread, and discard its work */
+  m = finish_prefetch(d, &i);
+  free_map(m);
+
+  /*  free the attached maps */
   for (i = 0; i < DUNGEON_DEPTH; i++) {
-    free(d->map[i]);
-    DEBUG("Deallocated map @0x%p (%i)\n", d->map[i], i);
+    if (d->map[i] == NULL) {
+      continue;
+    }
+
+    DEBUG("Deallocating map @0x%p (%i)\n", d->map[i], i);
+    free_map(d->map[i]);
   }
 
   /*  free the dungeon structure */
@@ -0,0 +1,379 @@
+
+/*
+ *  flow.c
+ *  Part of Amuleta, a traditional roguelike - https://deveah.github.io/amuleta
+ *  (c) Vlad Dumitru, <dalv.urtimud@gmail.com>
+ *  Licensed under the terms and conditions of the MIT License. Please consult
+ *  the LICENSE file included with this project.
+ */
+
+#include <string.h>
+#include <termbox.h>
+#include "amuleta.h"
+
+/*
+ *  a wavefront, with an empty row above and below the window, so that the
+ *  rows next to each one can be read without checking for the edges; row `y'
+ *  of the window is stored at row[y + 1]
+ */
+struct wave {
+  unsigned long row[WINDOW_HEIGHT + 2][MAP_ROW_WORDS];
+};
+
+/*
+ *  advances a breadth-first wavefront by one step, working on whole words:
+ *  a cell joins the next wave if it is passable, not yet reached, and next to
+ *  a cell of the current wave; only the rows the current wave spans (and the
+ *  ones next to them) are looked at
+ *
+ *  the current wave must be empty outside of its span, and the next one must
+ *  be empty altogether; the current wave is emptied once it has been used, so
+ *  that the two can take turns
+ *
+ *  struct wave *wave           -- the current wave
+ *  struct map_bitset *passable -- the passable cells
+ *  struct map_bitset *reached  -- the cells reached so far, to be updated
+ *  struct wave *next           -- the next wave, to be filled in
+ *  int *top, *bottom           -- the first and last rows of the current
+ *                                 wave, to be updated to those of the next
+ *  int return                  -- non-zero if the next wave is not empty
+ */
+static int advance_wave(struct wave *wave, struct map_bitset *passable,
+  struct map_bitset *reached, struct wave *next, int *top, int *bottom)
+{
+  int from = (*top > 0) ? *top - 1 : 0,
+      to   = (*bottom < WINDOW_HEIGHT - 1) ? *bottom + 1 : WINDOW_HEIGHT - 1;
+  int first = WINDOW_HEIGHT, last = -1;
+  int y, w;
+
+  for (y = from; y <= to; y++) {
+    unsigned long *above = wave->row[y],
+                  *row   = wave->row[y + 1],
+                  *below = wave->row[y + 2];
+    unsigned long any = 0;
+
+    for (w = 0; w < MAP_ROW_WORDS; w++) {
+      unsigned long grown = row[w] | (row[w] << 1) | (row[w] >> 1) |
+                            above[w] | below[w];
+
+      if (w > 0) {
+        grown |= row[w - 1] >> (MAP_WORD_BITS - 1);
+      }
+      if (w < MAP_ROW_WORDS - 1) {
+        grown |= row[w + 1] << (MAP_WORD_BITS - 1);
+      }
+
+      grown &= passable->row[y][w] & ~reached->row[y][w];
+      next->row[y + 1][w] = grown;
+      reached->row[y][w] |= grown;
+      any |= grown;
+    }
+
+    if (any) {
+      if (y < first) {
+        first = y;
+      }
+      last = y;
+    }
+  }
+
+  memset(wave->row[*top + 1], 0,
+    sizeof(wave->row[0]) * (size_t)(*bottom - *top + 1));
+
+  *top    = first;
+  *bottom = last;
+  return last >= 0;
+}
+
+/*
+ *  extends a set of cells of a row along the runs of passable cells they lie
+ *  on, both ways, in a fixed number of steps; the seeds must be passable
+ *
+ *  towards the higher bits, adding the seeds to the passable cells carries
+ *  through the run above each of them, clearing it; towards the lower bits,
+ *  where no carry goes, the seeds are spread by doubling shifts instead
+ *
+ *  unsigned long *seed     -- the cells to start from
+ *  unsigned long *passable -- the passable cells of the row
+ *  unsigned long *row      -- the extended cells, to be filled in
+ *  void return
+ */
+static void fill_row(unsigned long *seed, unsigned long *passable,
+  unsigned long *row)
+{
+  unsigned long carry = 0;
+  int w, shift;
+
+  for (w = 0; w < MAP_ROW_WORDS; w++) {
+    unsigned long sum = passable[w] + seed[w],
+                  out = (sum < seed[w]);
+
+    sum += carry;
+    out |= (sum < carry);
+
+    /*  a seed lying above another on the same run ends up set rather than
+     *  cleared, so the seeds are added back */
+    row[w] = passable[w] & (~sum | seed[w]);
+    carry  = out;
+  }
+
+  carry = 0;
+  for (w = MAP_ROW_WORDS - 1; w >= 0; w--) {
+    unsigned long p = passable[w],
+                  g = seed[w] | (carry & p);
+
+    for (shift = 1; shift < MAP_WORD_BITS; shift *= 2) {
+      g |= p & (g >> shift);
+      p &= p >> shift;
+    }
+
+    row[w] |= g;
+    carry   = (g & 1) << (MAP_WORD_BITS - 1);
+  }
+}
+
+/*
+ *  finds every passable cell reachable from a given cell, moving in the four
+ *  cardinal directions; rather than one step at a time, each row is filled
+ *  along its passable runs at once (see fill_row()), and the rows are swept
+ *  down and up again until none of them grows; only the rows next to one
+ *  that grew are filled again
+ *
+ *  struct map_bitset *passable -- the passable cells
+ *  int x, y                    -- the starting cell
+ *  struct map_bitset *reached  -- the reachable cells, to be filled in
+ *  int return                  -- the number of reachable cells, or 0 if the
+ *                                 starting cell is not passable
+ */
+int flood_fill(struct map_bitset *passable, int x, int y,
+  struct map_bitset *reached)
+{
+  /*  one flag per row, with one more above and below the window */
+  unsigned char stale[WINDOW_HEIGHT + 2];
+  int pending = 1, count = 0;
+
+  memset(reached, 0, sizeof(struct map_bitset));
+  if (!MAP_BIT_TEST(passable, x, y)) {
+    return 0;
+  }
+
+  memset(stale, 0, sizeof(stale));
+  MAP_BIT_SET(reached, x, y);
+
+  /*  the starting cell is reached already, so its row would not grow */
+  stale[y]     = 1;
+  stale[y + 1] = 1;
+  stale[y + 2] = 1;
+
+  while (pending) {
+    int sweep, i;
+
+    pending = 0;
+    for (sweep = 0; sweep < 2; sweep++) {
+      for (i = 0; i < WINDOW_HEIGHT; i++) {
+        int j = (sweep == 0) ? i : WINDOW_HEIGHT - 1 - i;
+        unsigned long seed[MAP_ROW_WORDS], row[MAP_ROW_WORDS], grew = 0;
+        int w;
+
+        if (!stale[j + 1]) {
+          continue;
+        }
+        stale[j + 1] = 0;
+
+        for (w = 0; w < MAP_ROW_WORDS; w++) {
+          seed[w] = reached->row[j][w];
+          if (j > 0) {
+            seed[w] |= reached->row[j - 1][w];
+          }
+          if (j < WINDOW_HEIGHT - 1) {
+            seed[w] |= reached->row[j + 1][w];
+          }
+          seed[w] &= passable->row[j][w];
+        }
+
+        fill_row(seed, passable->row[j], row);
+
+        for (w = 0; w < MAP_ROW_WORDS; w++) {
+          grew |= row[w] ^ reached->row[j][w];
+          reached->row[j][w] = row[w];
+        }
+
+        if (grew) {
+          stale[j]     = 1;
+          stale[j + 2] = 1;
+          pending      = 1;
+        }
+      }
+    }
+  }
+
+  for (y = 0; y < WINDOW_HEIGHT; y++) {
+    int w;
+
+    for (w = 0; w < MAP_ROW_WORDS; w++) {
+      count += count_word_bits(reached->row[y][w]);
+    }
+  }
+
+  return count;
+}
+
+/*
+ *  computes the number of steps from a goal to every passable cell at most
+ *  `radius' steps away from it, moving in the four cardinal directions; a
+ *  whole wavefront is advanced at once (see advance_wave()), and only the
+ *  cells it reaches are visited one by one, to record their distance; the
+ *  result is the same as that of distance_field_scalar()
+ *
+ *  struct map_bitset *passable -- the passable cells
+ *  int x, y                    -- the goal
+ *  int radius                  -- the largest distance to record
+ *  unsigned short distance[][] -- the distances, to be filled in for the
+ *                                 reached cells only
+ *  struct map_bitset *reached  -- the reached cells, to be filled in
+ *  void return
+ */
+void distance_field(struct map_bitset *passable, int x, int y, int radius,
+  unsigned short distance[WINDOW_HEIGHT][WINDOW_WIDTH],
+  struct map_bitset *reached)
+{
+  struct wave waves[2];
+  int top = y, bottom = y, current = 0, d;
+
+  memset(reached, 0, sizeof(struct map_bitset));
+  memset(waves, 0, sizeof(waves));
+  MAP_BIT_SET(reached, x, y);
+  waves[0].row[y + 1][x / MAP_WORD_BITS] = 1ul << (x % MAP_WORD_BITS);
+  distance[y][x] = 0;
+
+  for (d = 1; d <= radius; d++) {
+    int j, w;
+
+    if (!advance_wave(&waves[current], passable, reached, &waves[!current],
+        &top, &bottom)) {
+      break;
+    }
+    current = !current;
+
+    for (j = top; j <= bottom; j++) {
+      for (w = 0; w < MAP_ROW_WORDS; w++) {
+        unsigned long row = waves[current].row[j + 1][w];
+
+        while (row) {
+          distance[j][w * MAP_WORD_BITS + lowest_word_bit(row)] =
+            (unsigned short)d;
+          row &= row - 1;
+        }
+      }
+    }
+  }
+}
+
+/*
+ *  computes the same as distance_field(), one cell at a time, with a plain
+ *  breadth-first search; this serves as a reference for the former
+ *
+ *  struct map_bitset *passable -- the passable cells
+ *  int x, y                    -- the goal
+ *  int radius                  -- the largest distance to record
+ *  unsigned short distance[][] -- the distances, to be filled in for the
+ *                                 reached cells only
+ *  struct map_bitset *reached  -- the reached cells, to be filled in
+ *  void return
+ */
+void distance_field_scalar(struct map_bitset *passable, int x, int y,
+  int radius, unsigned short distance[WINDOW_HEIGHT][WINDOW_WIDTH],
+  struct map_bitset *reached)
+{
+  int queue[WINDOW_WIDTH * WINDOW_HEIGHT];
+  int head = 0, tail = 0;
+
+  memset(reached, 0, sizeof(struct map_bitset));
+  MAP_BIT_SET(reached, x, y);
+  distance[y][x] = 0;
+  queue[tail++] = y * WINDOW_WIDTH + x;
+
+  while (head < tail) {
+    int cell = queue[head++];
+    int cx = cell % WINDOW_WIDTH,
+        cy = cell / WINDOW_WIDTH;
+    int d = distance[cy][cx] + 1;
+    int i;
+
+    if (d > radius) {
+      continue;
+    }
+
+    for (i = 0; i < 4; i++) {
+      int nx = cx + ((i == 0) ? -1 : (i == 1) ? 1 : 0),
+          ny = cy + ((i == 2) ? -1 : (i == 3) ? 1 : 0);
+
+      if ((nx < 0) || (nx >= WINDOW_WIDTH) ||
+          (ny < 0) || (ny >= WINDOW_HEIGHT) ||
+          (MAP_BIT_TEST(reached, nx, ny)) ||
+          (!MAP_BIT_TEST(passable, nx, ny))) {
+        continue;
+      }
+
+      distance[ny][nx] = (unsigned short)d;
+      MAP_BIT_SET(reached, nx, ny);
+      queue[tail++] = ny * WINDOW_WIDTH + nx;
+    }
+  }
+}
+
+/*
+ *  brings the flow field of a map up to date for a given goal; the search
+ *  stops MAP_FLOW_RADIUS steps away, so its cost does not depend on the size
+ *  of the level, and it runs on a window of the level centred on the goal;
+ *  nothing is done if the field already leads to the goal
+ *
+ *  when the goal moves a single step, every distance may change by one, so
+ *  patching the old field would visit the same cells as searching anew;
+ *  instead, the field is searched at most once per goal position, however
+ *  many monsters follow it, and only once one of them needs it
+ *
+ *  struct map *m -- the map structure
+ *  int x, y      -- the coordinates of the goal
+ *  void return
+ */
+void update_flow(struct map *m, int x, int y)
+{
+  struct map_bitset passable;
+
+  if ((m->flow_valid) && (m->flow_x == x) && (m->flow_y == y)) {
+    return;
+  }
+
+  m->flow_x     = x;
+  m->flow_y     = y;
+  m->flow_x0    = x - WINDOW_WIDTH / 2;
+  m->flow_y0    = y - WINDOW_HEIGHT / 2;
+  m->flow_valid = 1;
+
+  load_window(m, LAYER_PASSABLE, m->flow_x0, m->flow_y0, &passable);
+  distance_field(&passable, x - m->flow_x0, y - m->flow_y0, MAP_FLOW_RADIUS,
+    m->flow_distance, &m->flow_reached);
+}
+
+/*
+ *  returns the number of steps from a cell to the goal of the flow field
+ *
+ *  struct map *m -- the map structure
+ *  int x, y      -- the coordinates of the cell
+ *  int return    -- the distance, or MAP_FLOW_UNREACHABLE if the goal is not
+ *                   within MAP_FLOW_RADIUS steps
+ */
+int get_flow_distance(struct map *m, int x, int y)
+{
+  x -= m->flow_x0;
+  y -= m->flow_y0;
+
+  if ((!m->flow_valid) ||
+      (x < 0) || (x >= WINDOW_WIDTH) || (y < 0) || (y >= WINDOW_HEIGHT) ||
+      (!MAP_BIT_TEST(&m->flow_reached, x, y))) {
+    return MAP_FLOW_UNREACHABLE;
+  }
+
+  return m->flow_distance[y][x];
+}
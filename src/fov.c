@@ -0,0 +1,282 @@
+
+/*
+ *  fov.c
+ *  Part of Amuleta, a traditional roguelike - https://deveah.github.io/amuleta
+ *  (c) Vlad Dumitru, <dalv.urtimud@gmail.com>
+ *  Licensed under the terms and conditions of the MIT License. Please consult
+ *  the LICENSE file included with this project.
+ */
+
+#include <string.h>
+#include <termbox.h>
+#include "amuleta.h"
+
+/*
+ *  the transformations taking the first octant to each of the eight, as the
+ *  multipliers taking a (column, row) offset within the octant to an x offset
+ *  (the first two) and to a y offset (the last two)
+ */
+static int octant[8][4] = {
+  {  1,  0,  0,  1 },
+  {  0,  1,  1,  0 },
+  {  0, -1,  1,  0 },
+  { -1,  0,  0,  1 },
+  { -1,  0,  0, -1 },
+  {  0, -1, -1,  0 },
+  {  0,  1, -1,  0 },
+  {  1,  0,  0, -1 }
+};
+
+/*
+ *  checks whether a cell blocks the sight; cells outside of the window do
+ *
+ *  struct map_bitset *opaque -- the opaque cells
+ *  int x, y                  -- the coordinates of the cell
+ *  int return                -- non-zero if the cell is opaque
+ */
+static int blocks_sight(struct map_bitset *opaque, int x, int y)
+{
+  if ((x < 0) || (x >= WINDOW_WIDTH) || (y < 0) || (y >= WINDOW_HEIGHT)) {
+    return 1;
+  }
+
+  return (int)MAP_BIT_TEST(opaque, x, y);
+}
+
+/*
+ *  lights the cells of an octant seen from a given position, row after row,
+ *  between two slopes; an opaque cell splits the light, and the part left of
+ *  it is cast recursively, one row further
+ *
+ *  struct map_bitset *opaque  -- the opaque cells
+ *  int x, y                   -- the position seen from
+ *  int radius                 -- the largest distance seen at
+ *  int row                    -- the first row to light
+ *  double start, end          -- the slopes the light lies between
+ *  int *t                     -- the transformation of the octant (see
+ *                                `octant')
+ *  struct map_bitset *visible -- the cells seen, to be updated
+ *  void return
+ */
+static void cast_octant(struct map_bitset *opaque, int x, int y, int radius,
+  int row, double start, double end, int *t, struct map_bitset *visible)
+{
+  double next_start = start;
+  int blocked = 0, dx, dy;
+
+  if (start < end) {
+    return;
+  }
+
+  for (dy = -row; (dy >= -radius) && (!blocked); dy--) {
+    for (dx = dy; dx <= 0; dx++) {
+      int cx = x + dx * t[0] + dy * t[1],
+          cy = y + dx * t[2] + dy * t[3];
+      double left  = (dx - 0.5) / (dy + 0.5),
+             right = (dx + 0.5) / (dy - 0.5);
+      int opaque_cell;
+
+      if (start < right) {
+        continue;
+      }
+      if (end > left) {
+        break;
+      }
+
+      if ((dx * dx + dy * dy <= radius * radius) &&
+          (cx >= 0) && (cx < WINDOW_WIDTH) &&
+          (cy >= 0) && (cy < WINDOW_HEIGHT)) {
+        MAP_BIT_SET(visible, cx, cy);
+      }
+
+      opaque_cell = blocks_sight(opaque, cx, cy);
+      if (blocked) {
+        if (opaque_cell) {
+          next_start = right;
+        } else {
+          blocked = 0;
+          start   = next_start;
+        }
+      } else if ((opaque_cell) && (-dy < radius)) {
+        blocked = 1;
+        cast_octant(opaque, x, y, radius, -dy + 1, start, left, t, visible);
+        next_start = right;
+      }
+    }
+  }
+}
+
+/*
+ *  finds the cells seen from a given position, with recursive shadowcasting:
+ *  each octant around the position is lit row after row, and opaque cells
+ *  cast shadows over the rows behind them; opaque cells are seen, but not
+ *  seen through
+ *
+ *  struct map_bitset *opaque  -- the opaque cells
+ *  int x, y                   -- the position seen from
+ *  int radius                 -- the largest distance seen at
+ *  struct map_bitset *visible -- the cells seen, to be filled in
+ *  void return
+ */
+void cast_fov(struct map_bitset *opaque, int x, int y, int radius,
+  struct map_bitset *visible)
+{
+  int i;
+
+  memset(visible, 0, sizeof(struct map_bitset));
+  MAP_BIT_SET(visible, x, y);
+
+  for (i = 0; i < 8; i++) {
+    cast_octant(opaque, x, y, radius, 1, 1.0, 0.0, octant[i], visible);
+  }
+}
+
+/*
+ *  checks whether a cell is in a field of view
+ *
+ *  struct fov_view *v  -- the field of view
+ *  int x, y            -- the coordinates of the cell on the level
+ *  int return          -- non-zero if the cell is seen
+ */
+int view_contains(struct fov_view *v, int x, int y)
+{
+  x -= v->x0;
+  y -= v->y0;
+
+  return (x >= 0) && (x < WINDOW_WIDTH) && (y >= 0) && (y < WINDOW_HEIGHT) &&
+         (MAP_BIT_TEST(&v->visible, x, y));
+}
+
+/*
+ *  gathers which cells of a run along a row are in a field of view
+ *
+ *  struct fov_view *v  -- the field of view
+ *  int x, y            -- the coordinates of the run's first cell on the
+ *                         level
+ *  int n               -- the length of the run, at most CHUNK_SIZE
+ *  unsigned int return -- the cells seen, as bit k for the cell at (x + k, y)
+ */
+unsigned int view_run(struct fov_view *v, int x, int y, int n)
+{
+  unsigned int bits = 0;
+  int k = 0;
+
+  x -= v->x0;
+  y -= v->y0;
+  if ((y < 0) || (y >= WINDOW_HEIGHT)) {
+    return 0;
+  }
+
+  /*  skip the part of the run left of the window */
+  if (x < 0) {
+    k = -x;
+  }
+
+  /*  the run spans at most two words of the row */
+  while ((k < n) && (x + k < WINDOW_WIDTH)) {
+    int offset = (x + k) % MAP_WORD_BITS;
+
+    bits |= (unsigned int)(v->visible.row[y][(x + k) / MAP_WORD_BITS] >>
+      offset) << k;
+    k += MAP_WORD_BITS - offset;
+  }
+
+  return (n < CHUNK_SIZE) ? bits & ((1u << n) - 1) : bits;
+}
+
+/*
+ *  marks dirty the cells of a map seen in one field of view but not in
+ *  another
+ *
+ *  struct map *m       -- the map structure
+ *  struct fov_view *a  -- the field of view whose cells are looked at
+ *  struct fov_view *b  -- the field of view they are looked for in
+ *  void return
+ */
+static void mark_view_changes(struct map *m, struct fov_view *a,
+  struct fov_view *b)
+{
+  int j, w;
+
+  for (j = 0; j < WINDOW_HEIGHT; j++) {
+    for (w = 0; w < MAP_ROW_WORDS; w++) {
+      unsigned long row = a->visible.row[j][w];
+
+      while (row) {
+        int x = a->x0 + w * MAP_WORD_BITS + lowest_word_bit(row),
+            y = a->y0 + j;
+
+        if ((x >= 0) && (x < m->width) && (y >= 0) && (y < m->height) &&
+            (!view_contains(b, x, y))) {
+          mark_dirty(m, x, y);
+        }
+        row &= row - 1;
+      }
+    }
+  }
+}
+
+/*
+ *  brings the field of view of a map up to date for a given position, and
+ *  adds what is seen to the remembered cells; fields of view are looked up in
+ *  the map's cache before being cast (see `struct map'), so that nothing is
+ *  cast while the position does not change, or when it goes back to a recent
+ *  one; the cells which came into view or left it are marked dirty
+ *
+ *  the sight is cast on a window of the level centred on the position, so
+ *  its cost does not depend on the size of the level
+ *
+ *  struct map *m -- the map structure
+ *  int x, y      -- the position seen from
+ *  int radius    -- the largest distance seen at
+ *  void return
+ */
+void update_fov(struct map *m, int x, int y, int radius)
+{
+  struct map_bitset opaque;
+  struct fov_view view;
+  int i;
+
+  if ((m->view_valid) && (m->view.x == x) && (m->view.y == y) &&
+      (m->view.radius == radius)) {
+    return;
+  }
+
+  for (i = 0; i < m->fov_cached; i++) {
+    if ((m->fov_cache[i].x == x) && (m->fov_cache[i].y == y) &&
+        (m->fov_cache[i].radius == radius)) {
+      break;
+    }
+  }
+
+  if (i < m->fov_cached) {
+    view = m->fov_cache[i];
+  } else {
+    view.x      = x;
+    view.y      = y;
+    view.radius = radius;
+    view.x0     = x - WINDOW_WIDTH / 2;
+    view.y0     = y - WINDOW_HEIGHT / 2;
+    load_window(m, LAYER_OPAQUE, view.x0, view.y0, &opaque);
+    cast_fov(&opaque, x - view.x0, y - view.y0, radius, &view.visible);
+
+    /*  the least recently used view makes room, if need be */
+    if (m->fov_cached < MAP_FOV_CACHE) {
+      m->fov_cached++;
+    }
+    i = m->fov_cached - 1;
+  }
+
+  /*  move the view to the front of the cache */
+  memmove(&m->fov_cache[1], &m->fov_cache[0], sizeof(struct fov_view) * i);
+  m->fov_cache[0] = view;
+
+  /*  redraw the cells whose visibility changed */
+  mark_view_changes(m, &m->view, &view);
+  mark_view_changes(m, &view, &m->view);
+
+  merge_window(m, LAYER_REMEMBERED, view.x0, view.y0, &view.visible);
+
+  m->view       = view;
+  m->view_valid = 1;
+}
@@ -20,41 +20,74 @@ struct tb_cell player_cell = {
 };
 
 /*
- *  initialize the game, creating the dungeon and the player
+ *  creates a game structure, with an empty dungeon, and nobody in it; see
+ *  initialize_game() for a game ready to be played
  *
  *  unsigned int random_seed -- the random seed used to generate the dungeon
  *  struct game *return      -- the game structure
  */
-struct game *initialize_game(unsigned int random_seed)
+struct game *create_game(unsigned int random_seed)
 {
   /*  allocate the game structure */
   struct game *g = (struct game*)malloc(sizeof(struct game));
   assert(g != NULL);
   DEBUG("Allocated game structure @0x%p\n", g);
 
-  /*  save the random seed for future reference */
+  /*  save the random seed for future reference; the gameplay and every level
+   *  draw from their own streams derived from it */
   g->random_seed = random_seed;
-  srand(g->random_seed);
+  rng_seed(&g->rng, g->random_seed, RNG_STREAM_GAME);
   INFO("Random seed is %i\n", g->random_seed);
   
-  /*  generate the dungeon */
+  /*  create the dungeon; levels are generated once they are reached */
   g->dungeon = generate_dungeon();
 
-  /*  generate the player actor entity */
-  g->player = create_player();
+  g->actors = create_actor_pool();
+  g->player = ACTOR_NONE;
 
-  /*  the player actor entity is the first one in the `actors' list */
-  g->actors = g->player;
-  g->player->next = NULL;
+  /*  nobody acts until the player enters a level */
+  g->scheduler = create_scheduler();
 
-  /*  populate the dungeon */
-  int i;
-  for (i = 0; i < DUNGEON_DEPTH; i++) {
-    populate_map(g, i);
-  }
+  /*  paths are searched with the same memory throughout the game, which is
+   *  only allocated once a path is first searched (see game_pathfinder()) */
+  g->pathfinder = NULL;
+
+  /*  read input from the terminal, unless told otherwise; the user interface
+   *  is attached by whoever plays the game in the terminal */
+  g->input      = NULL;
+  g->input_data = NULL;
+  g->ui         = NULL;
+
+  g->kills     = 0;
+  g->max_depth = 0;
 
   /*  mark the game as not running (yet) */
   g->running = 0;
+  g->turns   = 0;
+
+  /*  the game is not saved, unless told otherwise */
+  g->save_path = NULL;
+  g->saves     = 0;
+
+  DEBUG("Finished creating game structure\n");
+  return g;
+}
+
+/*
+ *  initialize the game, creating the dungeon and the player
+ *
+ *  unsigned int random_seed -- the random seed used to generate the dungeon
+ *  struct game *return      -- the game structure
+ */
+struct game *initialize_game(unsigned int random_seed)
+{
+  struct game *g = create_game(random_seed);
+
+  /*  generate the player actor entity, which is the first one in the
+   *  `actors' pool; it enters the topmost level once the game runs, which
+   *  gives that level time to be built in the background */
+  g->player = create_player(g->actors);
+  prefetch_level(g, 0);
 
   DEBUG("Finished initializing game structure\n");
   return g;
@@ -71,49 +104,123 @@ void destroy_game(struct game *g)
   /*  free the dungeon */
   free_dungeon(g->dungeon);
 
-  /*  free all actors */
-  struct actor *current = g->actors;
-  while (current) {
-    struct actor *next = current->next;
-    free(current);
-    current = next;
+  /*  free all actors at once */
+  destroy_scheduler(g->scheduler);
+  destroy_actor_pool(g->actors);
+  if (g->pathfinder != NULL) {
+    destroy_pathfinder(g->pathfinder);
   }
 
   free(g);
   DEBUG("Deallocated game structure @0x%p\n", g);
 }
 
+/*
+ *  returns the pathfinder of a game, allocating it on first use
+ *
+ *  struct game *g            -- the game structure
+ *  struct pathfinder *return -- the pathfinder
+ */
+struct pathfinder *game_pathfinder(struct game *g)
+{
+  if (g->pathfinder == NULL) {
+    g->pathfinder = create_pathfinder();
+  }
+
+  return g->pathfinder;
+}
+
 /*
  *  creates the player actor with default values
  *
- *  struct actor *return -- the actor structure
+ *  struct actor_pool *p  -- the pool in which to spawn the player
+ *  actor_handle return   -- the player actor
  */
-struct actor *create_player(void)
+actor_handle create_player(struct actor_pool *p)
 {
-  /*  allocate the actor structure */
-  struct actor *a = (struct actor*)malloc(sizeof(struct actor));
-  assert (a != NULL);
-  DEBUG("Allocated player structure @0x%p\n", a);
+  /*  spawn the actor */
+  actor_handle a = spawn_actor(p);
+  DEBUG("Spawned player actor %08x\n", a);
 
   /*  set the name of the player; TODO: ask the user for this */
-  a->name = "You";
+  ACTOR(p, a, name) = "You";
 
-  a->cell = &player_cell;
+  ACTOR(p, a, cell) = &player_cell;
+  ACTOR(p, a, flags) |= ACTOR_FLAG_PLAYER;
 
-  /*  hp and max_hp are initialized to 1 as a default, so that the player actor
-   *  may be alive */
-  a->hp = 1;
-  a->max_hp = 1;
+  /*  the player outlasts a few rat bites, now that rats bite back */
+  ACTOR(p, a, hp) = 10;
+  ACTOR(p, a, max_hp) = 10;
 
-  /*  the player's coordinates are by default the center of the topmost level
-   */
-  a->x = MAP_WIDTH/2;
-  a->y = MAP_HEIGHT/2;
-  a->z = 0;
+  /*  the player is not yet on any level; see change_level() */
+  ACTOR(p, a, x) = -1;
+  ACTOR(p, a, y) = -1;
+  ACTOR(p, a, z) = -1;
 
   return a;
 }
 
+/*
+ *  computes how long an actor needs to recover after acting
+ *
+ *  struct game *g        -- the game structure
+ *  actor_handle a        -- the actor in question
+ *  unsigned long return  -- the delay, in scheduler ticks
+ */
+static unsigned long action_delay(struct game *g, actor_handle a)
+{
+  int speed = ACTOR(g->actors, a, speed);
+
+  if (speed < 1) {
+    speed = 1;
+  }
+
+  return (unsigned long)SCHEDULER_TURN * ACTOR_SPEED_NORMAL / speed;
+}
+
+/*
+ *  schedules every actor on a level, so that the level comes to life
+ *
+ *  struct game *g  -- the game structure
+ *  int z           -- the level index
+ *  void return
+ */
+static void activate_level(struct game *g, int z)
+{
+  int slot;
+
+  /*  the actor pool is much smaller than a large level */
+  for (slot = 0; slot < g->actors->used; slot++) {
+    actor_handle a = actor_at_slot(g->actors, slot);
+
+    if ((a != ACTOR_NONE) && (ACTOR(g->actors, a, z) == z) &&
+        (ACTOR(g->actors, a, heap_index) < 0)) {
+      schedule_actor(g->scheduler, g->actors, a, action_delay(g, a));
+    }
+  }
+}
+
+/*
+ *  removes every actor on a level from the scheduler, so that the level costs
+ *  nothing while the player is elsewhere
+ *
+ *  struct game *g  -- the game structure
+ *  int z           -- the level index
+ *  void return
+ */
+static void deactivate_level(struct game *g, int z)
+{
+  int slot;
+
+  for (slot = 0; slot < g->actors->used; slot++) {
+    actor_handle a = actor_at_slot(g->actors, slot);
+
+    if ((a != ACTOR_NONE) && (ACTOR(g->actors, a, z) == z)) {
+      unschedule_actor(g->scheduler, g->actors, a);
+    }
+  }
+}
+
 /*
  *  begins playing a game
  *
@@ -126,21 +233,39 @@ void run_game(struct game *g)
   g->running = 1;
   INFO("Started game session\n");
 
+  /*  a new game starts on the topmost level */
+  if (ACTOR(g->actors, g->player, z) < 0) {
+    change_level(g, g->player, 0);
+  }
+
   while (g->running) {
-    
-    /*  loop through all the actors in the game, and make them act */
-    struct actor *current = g->actors;
+    /*  let whoever is due act; only the actors on the player's level are
+     *  scheduled, so the cost of a turn does not grow with the dungeon */
+    actor_handle current = next_actor(g->scheduler, g->actors);
+
+    if (current == ACTOR_NONE) {
+      WARN("Nobody is left to act\n");
+      break;
+    }
 
-    while (current) {
-      DEBUG("Current turn: actor @0x%p (%s)\n", current, current->name);
-      do_act(g, current);
+    DEBUG("Current turn: actor %08x (%s) at tick %lu\n", current,
+      ACTOR(g->actors, current, name), g->scheduler->now);
+    do_act(g, current);
 
-      /*  check for an early game exit request */
-      if (!g->running) {
-        break;
-      }
+    /*  the actor acts again once it has recovered, unless it died, or was
+     *  scheduled anew in the meantime (by changing levels, for instance) */
+    if ((actor_alive(g->actors, current)) &&
+        (ACTOR(g->actors, current, heap_index) < 0)) {
+      schedule_actor(g->scheduler, g->actors, current,
+        action_delay(g, current));
+    }
 
-      current = current->next;
+    /*  the game is saved once the player is done with a turn, and due to
+     *  act again: every so often, and when the game is quit */
+    if ((current == g->player) && (g->save_path != NULL) &&
+        (actor_alive(g->actors, current)) &&
+        ((!g->running) || (g->turns % SAVE_INTERVAL == 0))) {
+      save_game(g);
     }
   }
 
@@ -162,7 +287,8 @@ void handle_key(struct game *g, struct tb_event *ev)
 
   DEBUG("Handling key '%c' (code %i)\n", (ev->ch < 32) ? '.' : ev->ch, ev->ch);
 
-  /*  handle an exit request */
+  /*  handle an exit request; the game is saved at the end of the turn (see
+   *  run_game()) */
   if (ev->ch == 'Q') {
     DEBUG("User requested exit\n");
     g->running = 0;
@@ -178,6 +304,93 @@ void handle_key(struct game *g, struct tb_event *ev)
   } else if ((ev->key == TB_KEY_ARROW_RIGHT) || (ev->ch == 'l')) {
     move_actor(g, g->player,  1,  0);
   }
+
+  /*  handle descending, which is only possible on a down staircase */
+  if (ev->ch == '>') {
+    struct actor_pool *p = g->actors;
+    int z = ACTOR(p, g->player, z);
+
+    if (get_tile(g->dungeon->map[z], ACTOR(p, g->player, x),
+          ACTOR(p, g->player, y)) == &stairs_down_tile) {
+      change_level(g, g->player, z + 1);
+    }
+  }
+}
+
+/*
+ *  lets the computer make a monster complete its turn: monsters close enough
+ *  to the player follow the level's flow field towards it, and attack it once
+ *  adjacent, while the others wander around
+ *
+ *  struct game *g  -- the game structure
+ *  actor_handle a  -- the monster in question
+ *  void return
+ */
+static void monster_act(struct game *g, actor_handle a)
+{
+  struct actor_pool *p = g->actors;
+  int x = ACTOR(p, a, x),
+      y = ACTOR(p, a, y),
+      z = ACTOR(p, a, z);
+  struct map *m = g->dungeon->map[z];
+  int best, best_dx = 0, best_dy = 0;
+  int open, i;
+
+  if (ACTOR(p, g->player, z) == z) {
+    int px = ACTOR(p, g->player, x),
+        py = ACTOR(p, g->player, y);
+
+    /*  attack the player if it is next to the monster */
+    if (abs(px - x) + abs(py - y) == 1) {
+      move_actor(g, a, px - x, py - y);
+      return;
+    }
+
+    /*  the field is only searched again once the player has moved */
+    update_flow(m, px, py);
+  }
+
+  /*  the neighbours the monster may step onto; other monsters are in the
+   *  way, and are waited for rather than attacked */
+  open = cell_neighbourhood(m, LAYER_PASSABLE, x, y) &
+         ~cell_neighbourhood(m, LAYER_OCCUPIED, x, y);
+
+  /*  step onto the neighbour closest to the player */
+  best = get_flow_distance(m, x, y);
+  for (i = 0; i < 4; i++) {
+    int dx = (i == 0) ? -1 : (i == 1) ? 1 : 0,
+        dy = (i == 2) ? -1 : (i == 3) ? 1 : 0;
+    int distance;
+
+    if (!(open & NEIGHBOUR_BIT(dx, dy))) {
+      continue;
+    }
+
+    distance = get_flow_distance(m, x + dx, y + dy);
+    if (distance < best) {
+      best    = distance;
+      best_dx = dx;
+      best_dy = dy;
+    }
+  }
+
+  if ((best_dx != 0) || (best_dy != 0)) {
+    move_actor(g, a, best_dx, best_dy);
+    return;
+  }
+
+  /*  the player is out of reach, so wander around every now and then */
+  if (best == MAP_FLOW_UNREACHABLE) {
+    i = rng_range(&g->rng, 8);
+    if (i < 4) {
+      int dx = (i == 0) ? -1 : (i == 1) ? 1 : 0,
+          dy = (i == 2) ? -1 : (i == 3) ? 1 : 0;
+
+      if (open & NEIGHBOUR_BIT(dx, dy)) {
+        move_actor(g, a, dx, dy);
+      }
+    }
+  }
 }
 
 /*
@@ -185,44 +398,52 @@ void handle_key(struct game *g, struct tb_event *ev)
  *  the user's input; if not, let the computer make the actor complete its turn
  *
  *  struct game *g  -- the game structure
- *  struct actor *a -- the actor in question
+ *  actor_handle a  -- the actor in question
  *  void return
  */
-void do_act(struct game *g, struct actor *a)
+void do_act(struct game *g, actor_handle a)
 {
   if (a == g->player) {
-    /*  if the actor in question is the player, draw the interface, ask for
-     *  input, and then act accordingly */
+    /*  if the actor in question is the player, ask for input, and then act
+     *  accordingly; without an input callback, draw the interface and read
+     *  the input from the terminal */
     struct tb_event ev;
 
-    draw_map(g, g->player->z);
-    tb_poll_event(&ev);
+    if (g->input != NULL) {
+      if (!g->input(g, &ev, g->input_data)) {
+        DEBUG("Input source exhausted\n");
+        g->running = 0;
+        return;
+      }
+    } else {
+      draw_map(g, ACTOR(g->actors, g->player, z));
+      tb_poll_event(&ev);
+    }
+
     handle_key(g, &ev);
+    g->turns++;
   } else {
-    /*  TODO */
+    monster_act(g, a);
   }
 }
 
 /*
- *  finds an actor (or NULL) at a given position in the dungeon
+ *  finds an actor (or ACTOR_NONE) at a given position in the dungeon
  *
  *  struct game *g        -- the attached game instance
  *  int x, y, z           -- target coordinates
- *  struct actor *return  -- the actor, or NULL if no actor present
+ *  actor_handle return   -- the actor, or ACTOR_NONE if no actor present
  */
-struct actor *find_actor_by_position(struct game *g, int x, int y, int z)
+actor_handle find_actor_by_position(struct game *g, int x, int y, int z)
 {
-  struct actor *current = g->actors;
-
-  while (current) {
-    if ((current->x == x) && (current->y == y) && (current->z == z)) {
-      return current;
-    }
-
-    current = current->next;
+  /*  there is nobody outside the dungeon, nor on levels not yet generated */
+  if ((z < 0) || (z >= DUNGEON_DEPTH) || (g->dungeon->map[z] == NULL) ||
+      (x < 0) || (x >= g->dungeon->map[z]->width) ||
+      (y < 0) || (y >= g->dungeon->map[z]->height)) {
+    return ACTOR_NONE;
   }
 
-  return NULL;
+  return get_occupant(g->dungeon->map[z], x, y);
 }
 
 /*
@@ -230,69 +451,164 @@ struct actor *find_actor_by_position(struct game *g, int x, int y, int z)
  *  vertically; if the destination does not support an actor, do nothing
  *
  *  struct game *g  -- the game state
- *  struct actor *a -- the actor in question
+ *  actor_handle a  -- the actor in question
  *  int relx, rely  -- relative (x, y) coordinates
  *  void return
  */
-void move_actor(struct game *g, struct actor *a, int relx, int rely)
+void move_actor(struct game *g, actor_handle a, int relx, int rely)
 {
+  struct actor_pool *p = g->actors;
+  struct map *m = g->dungeon->map[ACTOR(p, a, z)];
+  int x = ACTOR(p, a, x),
+      y = ACTOR(p, a, y);
+
   /*  an actor cannot move on a solid tile */
-  if (g->dungeon->map[a->z]->tile[a->x + relx][a->y + rely]->flags & TILE_FLAG_SOLID) {
-    DEBUG("Actor @0x%p (%s) tried to move onto a solid tile: (%i, %i)\n", a,
-      a->name, a->x + relx, a->y + rely);
+  if (!MAP_CELL_TEST(m, LAYER_PASSABLE, x + relx, y + rely)) {
+    DEBUG("Actor %08x (%s) tried to move onto a solid tile: (%i, %i)\n", a,
+      ACTOR(p, a, name), x + relx, y + rely);
     return;
   }
 
   /*  an actor may attempt to move onto a tile occupied by another actor,
    *  and this will trigger a melee attack */
-  struct actor *target = find_actor_by_position(g, a->x + relx, a->y + rely,
-                                                a->z);
-  if (target != NULL) {
+  actor_handle target = get_occupant(m, x + relx, y + rely);
+  if (target != ACTOR_NONE) {
     melee_attack(g, a, target);
     return;
   }
 
-  /*  update the coordinates */
-  a->x += relx;
-  a->y += rely;
+  /*  update the coordinates, keeping the occupancy index in sync */
+  set_occupant(m, x, y, ACTOR_NONE);
+  ACTOR(p, a, x) = x + relx;
+  ACTOR(p, a, y) = y + rely;
+  set_occupant(m, x + relx, y + rely, a);
+}
+
+/*
+ *  moves an actor onto another level, generating that level first if needed;
+ *  the actor arrives at the level's entry point, or stays where it is if the
+ *  level has no room for it
+ *
+ *  struct game *g  -- the game state
+ *  actor_handle a  -- the actor in question
+ *  int z           -- the destination level index
+ *  void return
+ */
+void change_level(struct game *g, actor_handle a, int z)
+{
+  struct actor_pool *p = g->actors;
+  struct map *m;
+  int x, y, i;
+  int from = ACTOR(p, a, z);
+
+  m = ensure_level(g, z);
+
+  /*  arrive at the entry point; if somebody else is standing there, take the
+   *  next free cell in reading order, going over the level at most once */
+  x = m->entry_x;
+  y = m->entry_y;
+  for (i = 0; (i < m->width * m->height) &&
+              ((!MAP_CELL_TEST(m, LAYER_PASSABLE, x, y)) ||
+               (MAP_CELL_TEST(m, LAYER_OCCUPIED, x, y))); i++) {
+    x = (x + 1) % m->width;
+    if (x == 0) {
+      y = (y + 1) % m->height;
+    }
+  }
+
+  if (i == m->width * m->height) {
+    WARN("Actor %08x (%s) found no room on level %i\n", a, ACTOR(p, a, name),
+      z);
+    return;
+  }
+
+  /*  leave the current level, if any */
+  if (from >= 0) {
+    set_occupant(g->dungeon->map[from], ACTOR(p, a, x), ACTOR(p, a, y),
+      ACTOR_NONE);
+  }
+
+  ACTOR(p, a, x) = x;
+  ACTOR(p, a, y) = y;
+  ACTOR(p, a, z) = z;
+  set_occupant(m, x, y, a);
+
+  DEBUG("Actor %08x (%s) entered level %i at (%i, %i)\n", a,
+    ACTOR(p, a, name), z, x, y);
+
+  if (a == g->player) {
+    /*  only the player's level is active */
+    if (from >= 0) {
+      deactivate_level(g, from);
+    }
+    activate_level(g, z);
+
+    if (z > g->max_depth) {
+      g->max_depth = z;
+    }
+
+    /*  get the level below ready while the player is busy with this one */
+    prefetch_level(g, z + 1);
+  } else if (z == ACTOR(p, g->player, z)) {
+    if (ACTOR(p, a, heap_index) < 0) {
+      schedule_actor(g->scheduler, p, a, action_delay(g, a));
+    }
+  } else {
+    unschedule_actor(g->scheduler, p, a);
+  }
 }
 
 /*
  *  attempts to perform a melee attack
  *
  *  struct game *g          -- the game state
- *  struct actor *attacker
- *  struct actor *defender
+ *  actor_handle attacker
+ *  actor_handle defender
  *  void return
  */
-void melee_attack(struct game *g, struct actor *attacker, struct actor *defender)
+void melee_attack(struct game *g, actor_handle attacker, actor_handle defender)
 {
-  defender->hp--;
+  ACTOR(g->actors, defender, hp)--;
 
   /*  if the melee attack kills the defender, trigger a death event */
-  if (defender->hp <= 0) {
+  if (ACTOR(g->actors, defender, hp) <= 0) {
+    if (attacker == g->player) {
+      g->kills++;
+    }
+
     actor_death(g, defender);
   }
 }
 
 /*
- *  disposes of an actor structure
+ *  disposes of an actor; this is O(log n) in the number of scheduled actors,
+ *  and is safe for any actor, including the first one in the pool
  *
  *  struct game *g  -- the game state
- *  struct actor *a -- the actor in question
+ *  actor_handle a  -- the actor in question
  *  void return
  */
-void actor_death(struct game *g, struct actor *a)
+void actor_death(struct game *g, actor_handle a)
 {
+  struct actor_pool *p = g->actors;
+
+  /*  the actor no longer occupies its cell */
+  set_occupant(g->dungeon->map[ACTOR(p, a, z)], ACTOR(p, a, x), ACTOR(p, a, y),
+    ACTOR_NONE);
+
   /*  dispose of the actor */
-  struct actor *current = g->actors;
+  DEBUG("Actor %08x (%s) died\n", a, ACTOR(p, a, name));
+  unschedule_actor(g->scheduler, p, a);
+  despawn_actor(p, a);
 
-  while (current->next != a) {
-    current = current->next;
-  }
+  /*  the game is over once the player dies, and cannot be resumed */
+  if (a == g->player) {
+    INFO("The player died after %lu turns\n", g->turns);
+    g->running = 0;
 
-  struct actor *temp = current->next;
-  current->next = current->next->next;
-  free(temp);
+    if (g->save_path != NULL) {
+      remove_save(g->save_path);
+    }
+  }
 }
 
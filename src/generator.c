@@ -0,0 +1,628 @@
+
+/*
+ *  generator.c
+ *  Part of Amuleta, a traditional roguelike - https://deveah.github.io/amuleta
+ *  (c) Vlad Dumitru, <dalv.urtimud@gmail.com>
+ *  Licensed under the terms and conditions of the MIT License. Please consult
+ *  the LICENSE file included with this project.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termbox.h>
+#include "amuleta.h"
+
+/*
+ *  level generators lay out the terrain of a blank map (see generate_map()),
+ *  which is solid rock until they dig into it; the only memory they take is
+ *  that of the chunks they dig into, and the floor they leave is connected by
+ *  construction, so a level never needs to be generated again
+ */
+
+/*
+ *  turns a rectangle of a map to floor, a window at a time
+ *
+ *  struct map *m   -- the map structure
+ *  int x, y        -- the coordinates of the rectangle's top left cell
+ *  int w, h        -- the dimensions of the rectangle
+ *  void return
+ */
+static void dig_rectangle(struct map *m, int x, int y, int w, int h)
+{
+  struct map_bitset cells;
+  int i, j, wx, wy;
+
+  for (wy = 0; wy < h; wy += WINDOW_HEIGHT) {
+    for (wx = 0; wx < w; wx += WINDOW_WIDTH) {
+      memset(&cells, 0, sizeof(cells));
+
+      for (j = 0; (j < WINDOW_HEIGHT) && (wy + j < h); j++) {
+        for (i = 0; (i < WINDOW_WIDTH) && (wx + i < w); i++) {
+          MAP_BIT_SET(&cells, i, j);
+        }
+      }
+
+      set_terrain(m, x + wx, y + wy, &cells, TILE_FLOOR);
+    }
+  }
+}
+
+/*
+ *  lays out a single hall, bordered by rock, and entered in the middle
+ *
+ *  struct map *m -- the map structure
+ *  struct rng *r -- the random number generator
+ *  void return
+ */
+static void generate_open(struct map *m, struct rng *r)
+{
+  (void)r;
+
+  dig_rectangle(m, 1, 1, m->width - 2, m->height - 2);
+}
+
+/*
+ *  digs an L-shaped corridor between two cells, going either horizontally or
+ *  vertically first
+ *
+ *  struct map *m   -- the map structure
+ *  struct rng *r   -- the random number generator
+ *  int ax, ay      -- the coordinates of the first cell
+ *  int bx, by      -- the coordinates of the second cell
+ *  void return
+ */
+static void dig_corridor(struct map *m, struct rng *r, int ax, int ay,
+  int bx, int by)
+{
+  int x = ax, y = ay;
+  int horizontal_first = rng_range(r, 2);
+
+  while ((x != bx) || (y != by)) {
+    if ((x != bx) && ((horizontal_first) || (y == by))) {
+      x += (x < bx) ? 1 : -1;
+    } else {
+      y += (y < by) ? 1 : -1;
+    }
+
+    if (get_tile(m, x, y) != &floor_tile) {
+      set_tile(m, x, y, TILE_FLOOR);
+    }
+  }
+}
+
+/*
+ *  lays out a region of a map, and picks a cell of its floor: a region too
+ *  small to be split gets a room of random size, with a wall kept along its
+ *  right and bottom edges; a larger one is split in two across its longer
+ *  side, both halves are laid out, and their picked cells are joined by a
+ *  corridor, so that the floor of the whole region is connected
+ *
+ *  struct map *m   -- the map structure
+ *  struct rng *r   -- the random number generator
+ *  int x, y        -- the coordinates of the region's top left cell
+ *  int w, h        -- the dimensions of the region
+ *  int *px, *py    -- pointers to where to store the picked cell
+ *  void return
+ */
+static void split_region(struct map *m, struct rng *r, int x, int y, int w,
+  int h, int *px, int *py)
+{
+  #define BSP_MIN_WIDTH   10
+  #define BSP_MIN_HEIGHT  6
+  #define BSP_MIN_ROOM    3
+  int split_x = (w >= 2 * BSP_MIN_WIDTH),
+      split_y = (h >= 2 * BSP_MIN_HEIGHT);
+  int ax, ay, bx, by;
+
+  if ((split_x) && (split_y)) {
+    /*  split the side holding more minimal regions */
+    split_x = (w / BSP_MIN_WIDTH >= h / BSP_MIN_HEIGHT);
+    split_y = !split_x;
+  }
+
+  if (split_x) {
+    int cut = BSP_MIN_WIDTH + rng_range(r, w - 2 * BSP_MIN_WIDTH + 1);
+
+    split_region(m, r, x, y, cut, h, &ax, &ay);
+    split_region(m, r, x + cut, y, w - cut, h, &bx, &by);
+  } else if (split_y) {
+    int cut = BSP_MIN_HEIGHT + rng_range(r, h - 2 * BSP_MIN_HEIGHT + 1);
+
+    split_region(m, r, x, y, w, cut, &ax, &ay);
+    split_region(m, r, x, y + cut, w, h - cut, &bx, &by);
+  } else {
+    int room_w = BSP_MIN_ROOM + rng_range(r, w - BSP_MIN_ROOM),
+        room_h = BSP_MIN_ROOM + rng_range(r, h - BSP_MIN_ROOM);
+    int room_x = x + rng_range(r, w - room_w),
+        room_y = y + rng_range(r, h - room_h);
+    dig_rectangle(m, room_x, room_y, room_w, room_h);
+
+    *px = room_x + rng_range(r, room_w);
+    *py = room_y + rng_range(r, room_h);
+    return;
+  }
+
+  dig_corridor(m, r, ax, ay, bx, by);
+
+  if (rng_range(r, 2)) {
+    *px = ax;
+    *py = ay;
+  } else {
+    *px = bx;
+    *py = by;
+  }
+}
+
+/*
+ *  lays out rooms joined by corridors, by binary space partitioning (see
+ *  split_region()); the level is entered in one of the rooms
+ *
+ *  struct map *m -- the map structure
+ *  struct rng *r -- the random number generator
+ *  void return
+ */
+static void generate_bsp(struct map *m, struct rng *r)
+{
+  /*  the regions' right and bottom walls (see split_region()) stand in for
+   *  the border on those sides */
+  split_region(m, r, 1, 1, m->width - 1, m->height - 1, &m->entry_x,
+    &m->entry_y);
+}
+
+/*
+ *  draws a word of random bits, each of them set with even odds
+ *
+ *  struct rng *r         -- the random number generator
+ *  unsigned long return  -- the bits
+ */
+static unsigned long random_word(struct rng *r)
+{
+  unsigned long w = rng_next(r);
+
+  if (MAP_WORD_BITS > 32) {
+    w = (w << 16 << 16) | rng_next(r);
+  }
+
+  return w;
+}
+
+/*
+ *  turns the border of a cave to rock, and clears the bits past the end of
+ *  each row, and the rows past the last one
+ *
+ *  struct map_bitset *rock -- the rock cells of the cave
+ *  int width, height       -- the dimensions of the cave
+ *  void return
+ */
+static void enclose_cave(struct map_bitset *rock, int width, int height)
+{
+  int y, w;
+
+  for (y = 0; y < WINDOW_HEIGHT; y++) {
+    for (w = 0; w < MAP_ROW_WORDS; w++) {
+      int bits = width - w * MAP_WORD_BITS;
+      unsigned long valid = (bits <= 0) ? 0 :
+                            (bits < MAP_WORD_BITS) ? (1ul << bits) - 1 : ~0ul;
+
+      if (y >= height) {
+        rock->row[y][w] = 0;
+      } else if ((y == 0) || (y == height - 1)) {
+        rock->row[y][w] = valid;
+      } else {
+        rock->row[y][w] &= valid;
+      }
+    }
+
+    if (y < height) {
+      MAP_BIT_SET(rock, 0, y);
+      MAP_BIT_SET(rock, width - 1, y);
+    }
+  }
+}
+
+/*
+ *  applies the 4-5 rule to a cave once: a cell turns to rock if it is rock
+ *  and at least four of its neighbours are, or if it is not and at least five
+ *  of them are -- that is, if at least five cells of the 3x3 block around it
+ *  are rock; the nine cells of the block are added a word at a time, with
+ *  full adders working on all bits of a word side by side, into a count
+ *  sliced across four words
+ *
+ *  struct map_bitset *rock -- the rock cells of the cave
+ *  struct map_bitset *next -- the rock cells after smoothing
+ *  int width, height       -- the dimensions of the cave
+ *  void return
+ */
+static void smooth_cave(struct map_bitset *rock, struct map_bitset *next,
+  int width, int height)
+{
+  unsigned long sum[WINDOW_HEIGHT][MAP_ROW_WORDS],
+                carry[WINDOW_HEIGHT][MAP_ROW_WORDS];
+  int y, w;
+
+  /*  add up the three cells of each row of a block: bit x of `west' and
+   *  `east' holds the cell next to x on that side */
+  for (y = 0; y < height; y++) {
+    unsigned long *row = rock->row[y];
+
+    for (w = 0; w < MAP_ROW_WORDS; w++) {
+      unsigned long mid  = row[w],
+                    west = (mid << 1) | ((w > 0) ?
+                           row[w - 1] >> (MAP_WORD_BITS - 1) : 0),
+                    east = (mid >> 1) | ((w < MAP_ROW_WORDS - 1) ?
+                           row[w + 1] << (MAP_WORD_BITS - 1) : 0);
+
+      sum[y][w]   = west ^ mid ^ east;
+      carry[y][w] = (west & mid) | (east & (west ^ mid));
+    }
+  }
+
+  /*  then add up the three rows of each block: the sums are worth one, and
+   *  the carries two */
+  for (y = 1; y < height - 1; y++) {
+    for (w = 0; w < MAP_ROW_WORDS; w++) {
+      unsigned long s0 = sum[y - 1][w], s1 = sum[y][w], s2 = sum[y + 1][w],
+                    c0 = carry[y - 1][w], c1 = carry[y][w],
+                    c2 = carry[y + 1][w];
+      unsigned long ones, twos, fours, eights, twos_a, twos_b;
+
+      ones   = s0 ^ s1 ^ s2;
+      twos_a = (s0 & s1) | (s2 & (s0 ^ s1));
+      twos_b = c0 ^ c1 ^ c2;
+      fours  = (c0 & c1) | (c2 & (c0 ^ c1));
+      twos   = twos_a ^ twos_b;
+      eights = fours & twos_a & twos_b;
+      fours ^= twos_a & twos_b;
+
+      next->row[y][w] = eights | (fours & (twos | ones));
+    }
+  }
+
+  enclose_cave(next, width, height);
+}
+
+/*
+ *  digs an L-shaped tunnel between two cells of a cave, going either
+ *  horizontally or vertically first
+ *
+ *  struct map_bitset *floor  -- the floor cells of the cave
+ *  struct rng *r             -- the random number generator
+ *  int ax, ay                -- the coordinates of the first cell
+ *  int bx, by                -- the coordinates of the second cell
+ *  void return
+ */
+static void dig_tunnel(struct map_bitset *floor, struct rng *r, int ax,
+  int ay, int bx, int by)
+{
+  int x = ax, y = ay;
+  int horizontal_first = rng_range(r, 2);
+
+  while ((x != bx) || (y != by)) {
+    if ((x != bx) && ((horizontal_first) || (y == by))) {
+      x += (x < bx) ? 1 : -1;
+    } else {
+      y += (y < by) ? 1 : -1;
+    }
+
+    MAP_BIT_SET(floor, x, y);
+  }
+}
+
+/*
+ *  a run of floor cells within a row of a cave, and the run it has been
+ *  found to be connected to (see carve_cave())
+ */
+struct cave_run {
+  short y, start, end;
+  short parent;
+};
+
+/*
+ *  finds the run standing for all the runs connected to a given one, and
+ *  shortens the way there for the next time
+ *
+ *  struct cave_run *run  -- the runs
+ *  int i                 -- the run
+ *  int return            -- the run standing for it
+ */
+static int find_region(struct cave_run *run, int i)
+{
+  while (run[i].parent != i) {
+    run[i].parent = run[run[i].parent].parent;
+    i = run[i].parent;
+  }
+
+  return i;
+}
+
+/*
+ *  lists the runs of floor cells of a row of a cave; a run starts at a floor
+ *  cell with no floor to its west, and ends at one with no floor to its east
+ *
+ *  struct map_bitset *floor  -- the floor cells of the cave
+ *  int y                     -- the row
+ *  struct cave_run *run      -- the runs, to be added to
+ *  int count                 -- the number of runs listed so far
+ *  int return                -- the number of runs listed now
+ */
+static int find_runs(struct map_bitset *floor, int y, struct cave_run *run,
+  int count)
+{
+  unsigned long *row = floor->row[y];
+  int first = count, w;
+
+  for (w = 0; w < MAP_ROW_WORDS; w++) {
+    unsigned long starts = row[w] & ~((row[w] << 1) | ((w > 0) ?
+                           row[w - 1] >> (MAP_WORD_BITS - 1) : 0));
+
+    while (starts) {
+      run[count].y      = (short)y;
+      run[count].start  = (short)(w * MAP_WORD_BITS + lowest_word_bit(starts));
+      run[count].parent = (short)count;
+      count++;
+      starts &= starts - 1;
+    }
+  }
+
+  for (w = 0; w < MAP_ROW_WORDS; w++) {
+    unsigned long ends = row[w] & ~((row[w] >> 1) | ((w < MAP_ROW_WORDS - 1) ?
+                         row[w + 1] << (MAP_WORD_BITS - 1) : 0));
+
+    while (ends) {
+      run[first++].end = (short)(w * MAP_WORD_BITS + lowest_word_bit(ends));
+      ends &= ends - 1;
+    }
+  }
+
+  return count;
+}
+
+/*
+ *  lays out a cave as a bitset: rock is scattered at random and smoothed by
+ *  the 4-5 rule (see smooth_cave()); then the floor is split into regions, by
+ *  joining the runs of floor cells of each row with the overlapping runs of
+ *  the row above into disjoint sets; regions too small to matter are filled
+ *  in, and every other region is joined by a tunnel to the nearest region
+ *  already joined, so that the whole floor is connected; no memory is
+ *  allocated
+ *
+ *  struct rng *r             -- the random number generator
+ *  struct map_bitset *floor  -- the floor cells, to be filled in
+ *  int width, height         -- the dimensions of the cave, at least 5 and
+ *                               at most those of a window
+ *  int *x, *y                -- pointers to where to store a cell of the
+ *                               largest region
+ *  void return
+ */
+void carve_cave(struct rng *r, struct map_bitset *floor, int width,
+  int height, int *x, int *y)
+{
+  #define CAVE_SMOOTHING  4
+  #define CAVE_MIN_REGION 8
+  #define CAVE_MAX_RUNS   (WINDOW_HEIGHT * (WINDOW_WIDTH / 2))
+  struct map_bitset rock[2];
+  struct cave_run run[CAVE_MAX_RUNS];
+  short size[CAVE_MAX_RUNS], region_x[CAVE_MAX_RUNS],
+        region_y[CAVE_MAX_RUNS];
+  int runs = 0, regions = 0, largest = -1;
+  int i, j, w;
+
+  assert((width >= 5) && (width <= WINDOW_WIDTH));
+  assert((height >= 5) && (height <= WINDOW_HEIGHT));
+
+  /*  start with rock on about half of the cells, at random */
+  for (j = 0; j < height; j++) {
+    for (w = 0; w < MAP_ROW_WORDS; w++) {
+      rock[0].row[j][w] = random_word(r);
+    }
+  }
+  enclose_cave(&rock[0], width, height);
+
+  for (i = 0; i < CAVE_SMOOTHING; i++) {
+    smooth_cave(&rock[i & 1], &rock[(i + 1) & 1], width, height);
+  }
+
+  /*  the top row is all rock, which makes it a mask of the bits within a
+   *  row; the rows past the last one are clear */
+  for (j = 0; j < height; j++) {
+    for (w = 0; w < MAP_ROW_WORDS; w++) {
+      floor->row[j][w] = ~rock[CAVE_SMOOTHING & 1].row[j][w] &
+                         rock[CAVE_SMOOTHING & 1].row[0][w];
+    }
+  }
+
+  memset(floor->row[height], 0,
+    sizeof(floor->row[0]) * (WINDOW_HEIGHT - height));
+
+  /*  join the runs of each row with those of the row above which they
+   *  touch; both lists are ordered, so they are walked side by side */
+  for (j = 1; j < height - 1; j++) {
+    int above = runs - 1, first = runs;
+
+    while ((above >= 0) && (run[above].y == j - 1)) {
+      above--;
+    }
+    above++;
+
+    runs = find_runs(floor, j, run, runs);
+    i = first;
+
+    while ((above < first) && (i < runs)) {
+      if ((run[above].start <= run[i].end) &&
+          (run[i].start <= run[above].end)) {
+        int a = find_region(run, above),
+            b = find_region(run, i);
+
+        /*  the earlier run stands for both */
+        if (a < b) {
+          run[b].parent = (short)a;
+        } else {
+          run[a].parent = (short)b;
+        }
+      }
+
+      if (run[above].end < run[i].end) {
+        above++;
+      } else {
+        i++;
+      }
+    }
+  }
+
+  /*  a run is only ever joined to an earlier one, so a single pass in order
+   *  points every run straight at the run standing for its region */
+  for (i = 0; i < runs; i++) {
+    run[i].parent = run[run[i].parent].parent;
+    size[i] = 0;
+  }
+  for (i = 0; i < runs; i++) {
+    size[run[i].parent] += run[i].end - run[i].start + 1;
+  }
+
+  /*  fill in the small regions before any tunnel is dug through them */
+  for (i = 0; i < runs; i++) {
+    if (size[run[i].parent] < CAVE_MIN_REGION) {
+      for (j = run[i].start; j <= run[i].end; j++) {
+        MAP_BIT_CLEAR(floor, j, run[i].y);
+      }
+    }
+  }
+
+  for (i = 0; i < runs; i++) {
+    if ((run[i].parent == i) && (size[i] >= CAVE_MIN_REGION)) {
+      /*  a region's first run comes before all its other ones */
+      region_x[regions] = (short)(run[i].start +
+        rng_range(r, run[i].end - run[i].start + 1));
+      region_y[regions] = run[i].y;
+
+      if ((largest < 0) || (size[i] > size[largest])) {
+        largest = i;
+        *x = region_x[regions];
+        *y = region_y[regions];
+      }
+
+      /*  join the region to the nearest one joined so far */
+      if (regions > 0) {
+        int nearest = 0, distance = WINDOW_WIDTH + WINDOW_HEIGHT;
+
+        for (j = 0; j < regions; j++) {
+          int d = abs(region_x[j] - region_x[regions]) +
+                  abs(region_y[j] - region_y[regions]);
+
+          if (d < distance) {
+            distance = d;
+            nearest  = j;
+          }
+        }
+
+        dig_tunnel(floor, r, region_x[regions], region_y[regions],
+          region_x[nearest], region_y[nearest]);
+      }
+
+      regions++;
+    }
+  }
+
+  /*  the odds of no region being large enough are too slim to be worth a
+   *  better cave than a single hall */
+  if (regions == 0) {
+    *x = width / 2;
+    *y = height / 2;
+
+    for (j = *y - 1; j <= *y + 1; j++) {
+      for (i = *x - 1; i <= *x + 1; i++) {
+        MAP_BIT_SET(floor, i, j);
+      }
+    }
+  }
+}
+
+/*
+ *  lays out a cave (see carve_cave()); a level larger than a window is split
+ *  into sections of about the same size, each of them a cave of its own,
+ *  joined to the section on its left (or, for the first of a row, to the one
+ *  above) by a corridor between the sections' largest regions; the level is
+ *  entered in the first section
+ *
+ *  struct map *m -- the map structure
+ *  struct rng *r -- the random number generator
+ *  void return
+ */
+static void generate_cave(struct map *m, struct rng *r)
+{
+  #define CAVE_MAX_SECTIONS ((MAP_MAX_SIZE + WINDOW_WIDTH - 1) / WINDOW_WIDTH)
+  struct map_bitset floor;
+  int above_x[CAVE_MAX_SECTIONS], above_y[CAVE_MAX_SECTIONS];
+  int columns = (m->width + WINDOW_WIDTH - 1) / WINDOW_WIDTH,
+      rows    = (m->height + WINDOW_HEIGHT - 1) / WINDOW_HEIGHT;
+  int i, j;
+
+  for (j = 0; j < rows; j++) {
+    int y0 = j * m->height / rows,
+        y1 = (j + 1) * m->height / rows;
+
+    for (i = 0; i < columns; i++) {
+      int x0 = i * m->width / columns,
+          x1 = (i + 1) * m->width / columns;
+      int x, y;
+
+      carve_cave(r, &floor, x1 - x0, y1 - y0, &x, &y);
+      set_terrain(m, x0, y0, &floor, TILE_FLOOR);
+      x += x0;
+      y += y0;
+
+      if (i > 0) {
+        dig_corridor(m, r, x, y, above_x[i - 1], above_y[i - 1]);
+      } else if (j > 0) {
+        dig_corridor(m, r, x, y, above_x[0], above_y[0]);
+      } else {
+        m->entry_x = x;
+        m->entry_y = y;
+      }
+
+      /*  the section above is no longer needed once the section below it
+       *  is carved, so this one takes its place */
+      above_x[i] = x;
+      above_y[i] = y;
+    }
+  }
+}
+
+struct generator open_generator = {
+  .name     = "open",
+  .generate = generate_open
+};
+
+struct generator bsp_generator = {
+  .name     = "bsp",
+  .generate = generate_bsp
+};
+
+struct generator cave_generator = {
+  .name     = "cave",
+  .generate = generate_cave
+};
+
+/*  every generator, followed by NULL */
+struct generator *generators[] = {
+  &open_generator,
+  &bsp_generator,
+  &cave_generator,
+  NULL
+};
+
+/*  the generator and the size of each level; levels grow larger as the
+ *  player goes deeper */
+struct level_plan level_plan[DUNGEON_DEPTH] = {
+  { &bsp_generator,   80,  20 },
+  { &bsp_generator,  100,  30 },
+  { &cave_generator, 120,  40 },
+  { &bsp_generator,  160,  50 },
+  { &bsp_generator,  200,  60 },
+  { &cave_generator, 240,  80 },
+  { &bsp_generator,  320, 100 },
+  { &bsp_generator,  400, 120 },
+  { &cave_generator, 512, 160 },
+  { &bsp_generator,  640, 200 }
+};
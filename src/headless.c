@@ -0,0 +1,108 @@
+
+/*
+ *  headless.c
+ *  Part of Amuleta, a traditional roguelike - https://deveah.github.io/amuleta
+ *  (c) Vlad Dumitru, <dalv.urtimud@gmail.com>
+ *  Licensed under the terms and conditions of the MIT License. Please consult
+ *  the LICENSE file included with this project.
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termbox.h>
+#include "amuleta.h"
+
+/*
+ *  loads a script of player commands from a file; whitespace is ignored, and
+ *  every other character is issued as a key press
+ *
+ *  char *path                -- path to the script file
+ *  unsigned long max_turns   -- number of turns to replay the script for, or
+ *                               0 to play it only once
+ *  struct script *return     -- the script, or NULL if it could not be read
+ */
+struct script *load_script(char *path, unsigned long max_turns)
+{
+  FILE *f = fopen(path, "r");
+  int c;
+
+  if (f == NULL) {
+    WARN("Unable to open script '%s'\n", path);
+    return NULL;
+  }
+
+  struct script *s = (struct script*)malloc(sizeof(struct script));
+  assert(s != NULL);
+
+  /*  the file size is an upper bound for the number of commands */
+  fseek(f, 0, SEEK_END);
+  s->commands = (char*)malloc(ftell(f) + 1);
+  assert(s->commands != NULL);
+  rewind(f);
+
+  s->length = 0;
+  while ((c = fgetc(f)) != EOF) {
+    if (!isspace(c)) {
+      s->commands[s->length++] = (char)c;
+    }
+  }
+  fclose(f);
+
+  s->position  = 0;
+  s->max_turns = max_turns;
+
+  DEBUG("Loaded script '%s' (%li commands)\n", path, s->length);
+  return s;
+}
+
+/*
+ *  frees a script
+ *
+ *  struct script *s -- the script
+ *  void return
+ */
+void free_script(struct script *s)
+{
+  free(s->commands);
+  free(s);
+}
+
+/*
+ *  input callback which issues the commands of a script (see `struct game')
+ *
+ *  struct game *g      -- the game structure
+ *  struct tb_event *ev -- the event to fill in
+ *  void *data          -- the script
+ *  int return          -- 0 once the script is over, non-zero otherwise
+ */
+int script_input(struct game *g, struct tb_event *ev, void *data)
+{
+  struct script *s = (struct script*)data;
+
+  if (s->length == 0) {
+    return 0;
+  }
+
+  /*  replay the script until enough turns have been taken */
+  if (s->position == s->length) {
+    if (g->turns >= s->max_turns) {
+      return 0;
+    }
+
+    s->position = 0;
+  }
+
+  if ((s->max_turns > 0) && (g->turns >= s->max_turns)) {
+    return 0;
+  }
+
+  memset(ev, 0, sizeof(struct tb_event));
+  ev->type = TB_EVENT_KEY;
+  ev->ch   = (unsigned char)s->commands[s->position++];
+
+  return 1;
+}
+
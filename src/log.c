@@ -7,13 +7,790 @@
  *  the LICENSE file included with this project.
  */
 
+#define _POSIX_C_SOURCE 200112L
+
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 #include "amuleta.h"
 
-/*  pointer to the log file handle */
-FILE *log_file = NULL;
+/*
+ *  appending to the log only copies the log site pointer and the raw
+ *  arguments into a ring buffer owned by the calling thread; a background
+ *  thread formats the entries and writes them to the log file in batches.
+ *  Entries are stamped with the time they are written out at, which is at
+ *  most LOG_FLUSH_INTERVAL after they were appended, well within the second
+ *  that timestamps are counted in
+ */
+
+/*  a log entry, waiting to be formatted */
+struct log_entry {
+  /*  the order in which entries were appended, across all threads */
+  unsigned long sequence;
+
+  struct log_site *site;
+  int argc;
+  union log_argument argv[LOG_MAX_ARGUMENTS];
+
+  /*  the characters of the string arguments, which the caller may free as
+   *  soon as the entry is appended; those which do not fit are cut short */
+  #define LOG_TEXT_SIZE 128
+  char text[LOG_TEXT_SIZE];
+};
+
+/*
+ *  a single-producer, single-consumer ring of log entries; the producer is the
+ *  thread owning the ring, and the consumer is the log thread
+ */
+struct log_ring {
+  #define LOG_RING_SIZE 1024
+  struct log_entry entry[LOG_RING_SIZE];
+
+  /*  the next entry to be written (owned by the producer), and the next entry
+   *  to be formatted (owned by the consumer); both only ever grow, and are
+   *  taken modulo LOG_RING_SIZE */
+  unsigned long head, tail;
+
+  /*  set once the owning thread has exited; the ring is freed once drained */
+  int orphaned;
+
+  /*  snapshot of `head' and `orphaned', taken by the consumer when draining */
+  unsigned long drain_head;
+  int drain_orphaned;
+
+  /*  the next ring in the list of all rings */
+  struct log_ring *next;
+};
+
+/*  pointer to the log file handle; the log is shared by the whole process,
+ *  and games simply skip logging while it is closed */
+static FILE *log_file = NULL;
+
+/*  whether or not entries are accepted; set while the log thread runs */
+static int log_running = 0;
+
+/*  the sequence number of the next entry */
+static unsigned long log_sequence = 0;
+
+/*  the log file currently open, counting from 1; log sites are assigned their
+ *  binary identifiers anew for every log file */
+static unsigned int log_epoch = 0;
+
+/*  the identifier of the next log site to be written to the binary log, and
+ *  the timestamp of the last entry written, which the next one is relative
+ *  to; only used by the log thread */
+static unsigned long next_site_id = 0;
+static long last_timestamp = 0;
+
+/*  the names of the log levels, as written in the text log */
+static char *level_names[] = { "DBG", "INF", "WRN", "ERR" };
+
+/*  the rings of all threads which have logged anything; the lock is held while
+ *  the list changes, and while the rings are being drained */
+static struct log_ring *rings = NULL;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*  the calling thread's ring; the key is created once, and kept across log
+ *  files, along with the rings */
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+/*  the log thread, and the means to wake it up early or stop it */
+static pthread_t log_thread;
+static pthread_mutex_t wakeup_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+static int stop_requested = 0;
+
+/*  how often the log thread writes entries out, in milliseconds */
+#define LOG_FLUSH_INTERVAL 20
+
+/*  the signals upon which pending entries are written out before crashing */
+static int crash_signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+#define CRASH_SIGNALS ((int)(sizeof(crash_signals) / sizeof(crash_signals[0])))
+
+/*  the descriptor of the log file, and a buffer set aside for the crash
+ *  handler, which can use neither stdio nor malloc(3); `crashing' is set
+ *  while the handler writes entries out */
+static int log_fd = -1;
+static char crash_buffer[4096];
+static int crash_length = 0;
+static volatile sig_atomic_t crashing = 0;
+
+/*
+ *  finds the conversions in a format string, and the kind of argument each of
+ *  them takes: 'i' for int, 'l' for long, 'd' for double, 'p' for pointers
+ *  and 's' for strings
+ *
+ *  char *format  -- the format string, as taken by printf(3)
+ *  char *kind    -- array of LOG_MAX_ARGUMENTS kinds to fill in
+ *  int return    -- the number of arguments, at most LOG_MAX_ARGUMENTS
+ */
+int log_conversions(char *format, char *kind)
+{
+  int argc = 0;
+  char *s;
+
+  for (s = format; *s; s++) {
+    int is_long = 0;
+
+    if (*s != '%') {
+      continue;
+    }
+
+    s++;
+    while ((*s) && (strchr("-+ #0123456789.hlzjtL", *s) != NULL)) {
+      if (strchr("lzjt", *s) != NULL) {
+        is_long = 1;
+      }
+      s++;
+    }
+
+    if (!*s) {
+      break;
+    }
+    if ((*s == '%') || (argc == LOG_MAX_ARGUMENTS)) {
+      continue;
+    }
+
+    if (*s == 's') {
+      kind[argc++] = 's';
+    } else if (*s == 'p') {
+      kind[argc++] = 'p';
+    } else if (strchr("fFeEgGaA", *s) != NULL) {
+      kind[argc++] = 'd';
+    } else {
+      kind[argc++] = is_long ? 'l' : 'i';
+    }
+  }
+
+  return argc;
+}
+
+/*
+ *  finds the kinds of the arguments taken by a log site's format; the format
+ *  is only scanned the first time around, and the kinds are kept in the site
+ *
+ *  struct log_site *site -- the site
+ *  char *scratch         -- array of LOG_MAX_ARGUMENTS kinds, used while
+ *                           another thread is filling the site in
+ *  char **kind           -- pointer to where to store the kinds
+ *  int return            -- the number of arguments
+ */
+static int site_conversions(struct log_site *site, char *scratch, char **kind)
+{
+  int state = 0;
+
+  if (__atomic_load_n(&site->scanned, __ATOMIC_ACQUIRE) == 2) {
+    *kind = site->kind;
+    return site->argc;
+  }
+
+  /*  only one thread fills the site in; any other scans the format on its
+   *  own until then */
+  if (__atomic_compare_exchange_n(&site->scanned, &state, 1, 0,
+      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+    site->argc = log_conversions(site->format, site->kind);
+    __atomic_store_n(&site->scanned, 2, __ATOMIC_RELEASE);
+    *kind = site->kind;
+    return site->argc;
+  }
+
+  *kind = scratch;
+  return log_conversions(site->format, scratch);
+}
+
+/*
+ *  writes out the crash buffer; only write(2) is used, so this is safe to
+ *  call from a signal handler
+ *
+ *  void return
+ */
+static void flush_crash_buffer(void)
+{
+  int done = 0, n;
+
+  while (done < crash_length) {
+    n = (int)write(log_fd, crash_buffer + done, crash_length - done);
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+
+  crash_length = 0;
+}
+
+/*
+ *  appends bytes to the crash buffer, writing it out whenever it fills up
+ *
+ *  char *bytes   -- the bytes
+ *  size_t length -- how many there are
+ *  void return
+ */
+static void put_crash_bytes(char *bytes, size_t length)
+{
+  while (length > 0) {
+    size_t n = sizeof(crash_buffer) - crash_length;
+
+    if (n > length) {
+      n = length;
+    }
+    memcpy(crash_buffer + crash_length, bytes, n);
+    crash_length += (int)n;
+    bytes        += n;
+    length       -= n;
+
+    if (crash_length == (int)sizeof(crash_buffer)) {
+      flush_crash_buffer();
+    }
+  }
+}
+
+#if !LOG_BINARY
+
+/*
+ *  appends a number to the crash buffer, as text
+ *
+ *  unsigned long v -- the magnitude of the number
+ *  int negative    -- non-zero if the number is negative
+ *  int base        -- the base to write it in, up to 16
+ *  void return
+ */
+static void put_crash_number(unsigned long v, int negative, int base)
+{
+  char digits[32];
+  int i = sizeof(digits);
+
+  do {
+    digits[--i] = "0123456789abcdef"[v % base];
+    v /= base;
+  } while (v > 0);
+
+  if (negative) {
+    digits[--i] = '-';
+  }
+
+  put_crash_bytes(digits + i, sizeof(digits) - i);
+}
+
+/*
+ *  appends a signed number to the crash buffer, in decimal
+ *
+ *  long v      -- the number
+ *  void return
+ */
+static void put_crash_signed(long v)
+{
+  put_crash_number(v < 0 ? 0ul - (unsigned long)v : (unsigned long)v, v < 0,
+    10);
+}
+
+/*
+ *  appends a string to the crash buffer
+ *
+ *  char *s     -- the string, or NULL
+ *  void return
+ */
+static void put_crash_string(char *s)
+{
+  if (s == NULL) {
+    s = "(null)";
+  }
+
+  put_crash_bytes(s, strlen(s));
+}
+
+/*
+ *  writes a log entry as a line of text into the crash buffer, much like
+ *  write_log_line() does, but without stdio; flags, widths and precisions
+ *  are ignored, and floating point numbers are only shown as '?'
+ *
+ *  struct log_entry *e -- the entry
+ *  long timestamp      -- when the entry is written out
+ *  void return
+ */
+static void put_crash_line(struct log_entry *e, long timestamp)
+{
+  struct log_site *site = e->site;
+  char *s = site->format;
+  int argi = 0;
+
+  put_crash_string("[");
+  put_crash_signed(timestamp);
+  put_crash_string(" -- ");
+  put_crash_string(site->file);
+  put_crash_string(":");
+  put_crash_string(site->function);
+  put_crash_string(":");
+  put_crash_signed(site->line);
+  put_crash_string("] [");
+  put_crash_string(level_names[site->level]);
+  put_crash_string("] ");
+
+  while (*s) {
+    char *start = s;
+    union log_argument *arg;
+    int is_long = 0;
+
+    while ((*s) && (*s != '%')) {
+      s++;
+    }
+    put_crash_bytes(start, s - start);
+
+    if (!*s) {
+      break;
+    }
+
+    s++;
+    while ((*s) && (strchr("-+ #0123456789.hlzjtL", *s) != NULL)) {
+      if (strchr("lzjt", *s) != NULL) {
+        is_long = 1;
+      }
+      s++;
+    }
+    if (!*s) {
+      break;
+    }
+
+    if (*s == '%') {
+      put_crash_string("%");
+    } else if (argi < e->argc) {
+      arg = &e->argv[argi++];
+
+      if (*s == 's') {
+        put_crash_string((char*)arg->p);
+      } else if (*s == 'p') {
+        put_crash_string("0x");
+        put_crash_number((unsigned long)arg->p, 0, 16);
+      } else if (strchr("fFeEgGaA", *s) != NULL) {
+        put_crash_string("?");
+      } else if (strchr("xXo", *s) != NULL) {
+        put_crash_number(is_long ? (unsigned long)arg->l :
+          (unsigned int)arg->l, 0, *s == 'o' ? 8 : 16);
+      } else if (*s == 'u') {
+        put_crash_number(is_long ? (unsigned long)arg->l :
+          (unsigned int)arg->l, 0, 10);
+      } else {
+        put_crash_signed(is_long ? arg->l : (int)arg->l);
+      }
+    }
+
+    s++;
+  }
+}
+
+#endif
+
+/*
+ *  writes a log entry as a line of text, formatting one conversion at a time
+ *
+ *  FILE *f                   -- the file to write to
+ *  struct log_site *site     -- the site which appended the entry
+ *  long timestamp            -- the timestamp of the entry
+ *  union log_argument *argv  -- the raw arguments
+ *  int argc                  -- the number of arguments
+ *  void return
+ */
+void write_log_line(FILE *f, struct log_site *site, long timestamp,
+  union log_argument *argv, int argc)
+{
+  char *s = site->format;
+  char spec[32];
+  int argi = 0;
+
+  fprintf(f, "[%li -- %s:%s:%i] [%s] ", timestamp, site->file, site->function,
+    site->line, level_names[site->level]);
+
+  while (*s) {
+    char *start = s;
+    int length;
+
+    /*  copy text up to the next conversion as it is */
+    while ((*s) && (*s != '%')) {
+      s++;
+    }
+    fwrite(start, 1, s - start, f);
+
+    if (!*s) {
+      break;
+    }
+
+    /*  isolate the conversion specification */
+    start = s++;
+    while ((*s) && (strchr("-+ #0123456789.hlzjtL", *s) != NULL)) {
+      s++;
+    }
+    if (!*s) {
+      break;
+    }
+
+    length = s - start + 1;
+    if (length >= (int)sizeof(spec)) {
+      length = sizeof(spec) - 1;
+    }
+    memcpy(spec, start, length);
+    spec[length] = '\0';
+
+    if (*s == '%') {
+      fputc('%', f);
+    } else if (argi < argc) {
+      union log_argument *arg = &argv[argi++];
+
+      if (strchr("sp", *s) != NULL) {
+        fprintf(f, spec, arg->p);
+      } else if (strchr("fFeEgGaA", *s) != NULL) {
+        fprintf(f, spec, arg->d);
+      } else if (strchr(spec, 'l') || strchr(spec, 'z') || strchr(spec, 'j') ||
+                 strchr(spec, 't')) {
+        fprintf(f, spec, arg->l);
+      } else {
+        fprintf(f, spec, (int)arg->l);
+      }
+    }
+
+    s++;
+  }
+}
+
+#if LOG_BINARY
+
+/*
+ *  writes bytes to the binary log, or to the crash buffer while crashing
+ *
+ *  void *bytes   -- the bytes
+ *  size_t length -- how many there are
+ *  void return
+ */
+static void put_bytes(void *bytes, size_t length)
+{
+  if (crashing) {
+    put_crash_bytes((char*)bytes, length);
+  } else {
+    fwrite(bytes, 1, length, log_file);
+  }
+}
+
+/*
+ *  writes a number to the binary log, 7 bits per byte, least significant
+ *  first; the high bit of a byte is set if more bytes follow
+ *
+ *  unsigned long v -- the number
+ *  void return
+ */
+static void put_varint(unsigned long v)
+{
+  unsigned char bytes[(sizeof(unsigned long) * 8 + 6) / 7];
+  int length = 0;
+
+  while (v >= 0x80) {
+    bytes[length++] = (unsigned char)((v & 0x7f) | 0x80);
+    v >>= 7;
+  }
+  bytes[length++] = (unsigned char)v;
+
+  put_bytes(bytes, length);
+}
+
+/*
+ *  writes a signed number to the binary log, zigzag-encoded so that numbers
+ *  close to zero take few bytes either way
+ *
+ *  long v      -- the number
+ *  void return
+ */
+static void put_signed(long v)
+{
+  unsigned long sign = (unsigned long)v >> (sizeof(long) * 8 - 1);
+
+  put_varint(((unsigned long)v << 1) ^ (0ul - sign));
+}
+
+/*
+ *  writes a string to the binary log: its length plus one (or 0 for NULL),
+ *  followed by its characters
+ *
+ *  char *s     -- the string
+ *  void return
+ */
+static void put_string(char *s)
+{
+  size_t length;
+
+  if (s == NULL) {
+    put_varint(0);
+    return;
+  }
+
+  length = strlen(s);
+  put_varint(length + 1);
+  put_bytes(s, length);
+}
+
+/*
+ *  writes a single entry to the binary log; the first entry of every site is
+ *  preceded by a record describing the site, and later entries refer to it by
+ *  its identifier
+ *
+ *  struct log_entry *e -- the entry
+ *  long timestamp      -- when the entry is written out
+ *  void return
+ */
+static void write_entry(struct log_entry *e, long timestamp)
+{
+  struct log_site *site = e->site;
+  char scratch[LOG_MAX_ARGUMENTS], *kind;
+  char record;
+  int i;
+
+  if (site->epoch != log_epoch) {
+    site->epoch = log_epoch;
+    site->id    = next_site_id++;
+
+    record = LOG_RECORD_SITE;
+    put_bytes(&record, 1);
+    put_varint(site->id);
+    put_varint(site->level);
+    put_varint(site->line);
+    put_string(site->file);
+    put_string(site->function);
+    put_string(site->format);
+  }
+
+  record = LOG_RECORD_ENTRY;
+  put_bytes(&record, 1);
+  put_varint(site->id);
+  put_signed(timestamp - last_timestamp);
+  last_timestamp = timestamp;
+
+  /*  the kinds of the arguments follow from the site's format */
+  site_conversions(site, scratch, &kind);
+  for (i = 0; i < e->argc; i++) {
+    switch (kind[i]) {
+    case 's':
+      put_string((char*)e->argv[i].p);
+      break;
+    case 'p':
+      put_varint((unsigned long)e->argv[i].p);
+      break;
+    case 'd':
+      put_bytes(&e->argv[i].d, sizeof(double));
+      break;
+    default:
+      put_signed(e->argv[i].l);
+    }
+  }
+}
+
+#else
+
+/*
+ *  writes a single entry to the text log, or to the crash buffer while
+ *  crashing
+ *
+ *  struct log_entry *e -- the entry
+ *  long timestamp      -- when the entry is written out
+ *  void return
+ */
+static void write_entry(struct log_entry *e, long timestamp)
+{
+  if (crashing) {
+    put_crash_line(e, timestamp);
+  } else {
+    write_log_line(log_file, e->site, timestamp, e->argv, e->argc);
+  }
+}
+
+#endif
+
+/*
+ *  formats and writes out every pending entry, and frees the rings of threads
+ *  which have exited; must be called with `rings_lock' held
+ *
+ *  long timestamp -- the time the entries are written out at
+ *  void return
+ */
+static void drain_rings(long timestamp)
+{
+  struct log_ring **link;
+  struct log_ring *r;
+
+  /*  take a snapshot of how far every ring has been filled */
+  for (r = rings; r != NULL; r = r->next) {
+    r->drain_orphaned = __atomic_load_n(&r->orphaned, __ATOMIC_ACQUIRE);
+    r->drain_head     = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  }
+
+  /*  write the entries out in the order they were appended in, by merging
+   *  the rings on their sequence numbers */
+  while (1) {
+    struct log_ring *oldest = NULL;
+
+    for (r = rings; r != NULL; r = r->next) {
+      if ((r->tail != r->drain_head) && ((oldest == NULL) ||
+          (r->entry[r->tail % LOG_RING_SIZE].sequence <
+           oldest->entry[oldest->tail % LOG_RING_SIZE].sequence))) {
+        oldest = r;
+      }
+    }
+
+    if (oldest == NULL) {
+      break;
+    }
+
+    write_entry(&oldest->entry[oldest->tail % LOG_RING_SIZE], timestamp);
+    __atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+  }
+
+  /*  the crash handler may neither free memory nor use stdio */
+  if (crashing) {
+    return;
+  }
+
+  /*  an orphaned ring receives no more entries, so once it is empty it can
+   *  go; the snapshot of its head was taken after it was orphaned, so every
+   *  entry has been written */
+  link = &rings;
+  while (*link) {
+    r = *link;
+
+    if ((r->drain_orphaned) && (r->tail == r->drain_head)) {
+      *link = r->next;
+      free(r);
+    } else {
+      link = &r->next;
+    }
+  }
+
+  fflush(log_file);
+}
+
+/*
+ *  entry point of the log thread: drain the rings periodically, and when
+ *  woken up, until asked to stop
+ *
+ *  void *arg     -- unused
+ *  void *return  -- unused
+ */
+static void *log_worker(void *arg)
+{
+  struct timespec deadline;
+  int stop = 0;
+
+  (void)arg;
+
+  while (!stop) {
+    pthread_mutex_lock(&wakeup_lock);
+    if (!stop_requested) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_nsec += LOG_FLUSH_INTERVAL * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&wakeup, &wakeup_lock, &deadline);
+    }
+    stop = stop_requested;
+    pthread_mutex_unlock(&wakeup_lock);
+
+    pthread_mutex_lock(&rings_lock);
+    drain_rings((long)time(NULL));
+    pthread_mutex_unlock(&rings_lock);
+  }
+
+  return NULL;
+}
+
+/*
+ *  marks the ring of an exiting thread as orphaned (see pthread_key_create(3))
+ *
+ *  void *ring  -- the ring
+ *  void return
+ */
+static void orphan_ring(void *ring)
+{
+  __atomic_store_n(&((struct log_ring*)ring)->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ *  writes out pending entries when the process crashes, then lets the signal
+ *  take its course. The entries are formatted into the crash buffer and
+ *  written with write(2): stdio and malloc(3) are left alone, as the crashing
+ *  thread may hold their locks. The one call which is not async-signal-safe
+ *  is pthread_mutex_trylock(3), and it never blocks; if the rings are being
+ *  drained, or a ring is being added, at the time (possibly by the crashing
+ *  thread itself), nothing is written, and the pending entries are lost
+ *
+ *  int sig     -- the signal number
+ *  void return
+ */
+static void crash_handler(int sig)
+{
+  static struct log_site crash_site = { LOG_LEVEL_ERROR, __FILE__,
+    "crash_handler", __LINE__, "Caught signal %i\n", 0, 0, 0, 0, { 0 } };
+  struct log_entry e;
+  long now;
+
+  /*  `rings_lock' is kept, so that the log thread writes nothing more */
+  if (pthread_mutex_trylock(&rings_lock) == 0) {
+    now = (long)time(NULL);
+    crashing = 1;
+    drain_rings(now);
+
+    e.site      = &crash_site;
+    e.argc      = 1;
+    e.argv[0].l = sig;
+    write_entry(&e, now);
+    flush_crash_buffer();
+  }
+
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+/*
+ *  returns the calling thread's ring, creating it on first use
+ *
+ *  struct log_ring *return -- the ring
+ */
+static struct log_ring *thread_ring(void)
+{
+  struct log_ring *r = (struct log_ring*)pthread_getspecific(ring_key);
+
+  if (r != NULL) {
+    return r;
+  }
+
+  r = (struct log_ring*)malloc(sizeof(struct log_ring));
+  assert(r != NULL);
+  r->head     = 0;
+  r->tail     = 0;
+  r->orphaned = 0;
+  pthread_setspecific(ring_key, r);
+
+  pthread_mutex_lock(&rings_lock);
+  r->next = rings;
+  rings = r;
+  pthread_mutex_unlock(&rings_lock);
+
+  return r;
+}
+
+/*
+ *  creates the key of the threads' rings (see pthread_once(3))
+ *
+ *  void return
+ */
+static void create_ring_key(void)
+{
+  pthread_key_create(&ring_key, orphan_ring);
+}
 
 /*
  *  initializes the log file
@@ -22,50 +799,174 @@ FILE *log_file = NULL;
  */
 void initialize_log(void)
 {
-  log_file = fopen(LOG_FILE_PATH, "w");
+  int i;
+
+  log_file = fopen(LOG_FILE_PATH, "wb");
   assert(log_file != NULL);
 
+  /*  every log site is written out anew to the new file */
+  log_epoch++;
+  next_site_id   = 0;
+  last_timestamp = 0;
+
+#if LOG_BINARY
+  fwrite(LOG_BINARY_MAGIC, 1, strlen(LOG_BINARY_MAGIC), log_file);
+#endif
+
+  /*  the crash handler writes to the file without stdio, so nothing may be
+   *  left in its buffer outside of drain_rings() */
+  fflush(log_file);
+  log_fd = fileno(log_file);
+
+  pthread_once(&ring_key_once, create_ring_key);
+
+  stop_requested = 0;
+  if (pthread_create(&log_thread, NULL, log_worker, NULL) != 0) {
+    fclose(log_file);
+    log_file = NULL;
+    return;
+  }
+
+  for (i = 0; i < CRASH_SIGNALS; i++) {
+    signal(crash_signals[i], crash_handler);
+  }
+
+  __atomic_store_n(&log_running, 1, __ATOMIC_RELEASE);
   INFO("Amuleta logging initialized at timestamp %i\n", time(NULL));
 }
 
 /*
- *  terminates the log file
+ *  terminates the log file, writing out every pending entry first
  *
  *  void return
  */
 void terminate_log(void)
 {
+  int i;
+
   /*  if the log file is not open, do nothing */
   if (log_file == NULL) {
     return;
   }
 
   INFO("Amuleta logging terminated at timestamp %i\n", time(NULL));
+  __atomic_store_n(&log_running, 0, __ATOMIC_RELEASE);
+
+  /*  the log thread drains the rings one last time before it exits */
+  pthread_mutex_lock(&wakeup_lock);
+  stop_requested = 1;
+  pthread_cond_signal(&wakeup);
+  pthread_mutex_unlock(&wakeup_lock);
+  pthread_join(log_thread, NULL);
+
+  for (i = 0; i < CRASH_SIGNALS; i++) {
+    signal(crash_signals[i], SIG_DFL);
+  }
+
   fclose(log_file);
+  log_file = NULL;
 }
 
 /*
- *  appends a log entry
+ *  copies a string argument into the text of an entry, cutting it short if
+ *  there is not enough room left
  *
- *  parameters similar to the printf(3) function
+ *  struct log_entry *e -- the entry
+ *  int *used           -- pointer to how many characters of the text are
+ *                         taken already
+ *  char *s             -- the string, or NULL
+ *  char *return        -- the copy, or NULL
+ */
+static char *copy_string(struct log_entry *e, int *used, char *s)
+{
+  char *copy;
+
+  if (s == NULL) {
+    return NULL;
+  }
+
+  /*  with no room left at all, the string is left out */
+  if (*used == LOG_TEXT_SIZE) {
+    return &e->text[LOG_TEXT_SIZE - 1];
+  }
+
+  copy = &e->text[*used];
+  while ((*s) && (*used < LOG_TEXT_SIZE - 1)) {
+    e->text[(*used)++] = *s++;
+  }
+  e->text[(*used)++] = '\0';
+
+  return copy;
+}
+
+/*
+ *  appends a log entry; the arguments are copied as they are, strings
+ *  included (see copy_string()), and formatted later on; this is called
+ *  through the DEBUG, INFO, WARN and ERROR macros, which supply the log site
+ *
+ *  struct log_site *site -- the site appending the entry
+ *  ...                   -- the arguments of the site's format
  *  void return
  */
-void append_log(char *format, ...)
+void append_log(struct log_site *site, ...)
 {
+  struct log_ring *r;
+  struct log_entry *e;
+  unsigned long head;
+  char scratch[LOG_MAX_ARGUMENTS], *kind;
+  int i, used = 0, stopping;
   va_list args;
 
-  /*  if there's nothing to format, do nothing */
-  if (format == NULL) {
+  /*  if the log file is not open, do nothing */
+  if (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE)) {
     return;
   }
 
-  /*  if the log file is not open, do nothing */
-  if (log_file == NULL) {
-    return;
+  r = thread_ring();
+  head = r->head;
+
+  /*  if the ring is full, wake the log thread up and wait for it; once the
+   *  log is being terminated, the ring may never be drained again, so the
+   *  entry is dropped instead */
+  while (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE) {
+    pthread_mutex_lock(&wakeup_lock);
+    stopping = stop_requested;
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&wakeup_lock);
+
+    if ((stopping) || (!__atomic_load_n(&log_running, __ATOMIC_ACQUIRE))) {
+      return;
+    }
+    sched_yield();
   }
 
-  va_start(args, format);
-  vfprintf(log_file, format, args);
+  e = &r->entry[head % LOG_RING_SIZE];
+  e->sequence = __atomic_fetch_add(&log_sequence, 1, __ATOMIC_RELAXED);
+  e->site     = site;
+  e->argc     = site_conversions(site, scratch, &kind);
+
+  /*  collect the arguments, according to the conversions in the format */
+  va_start(args, site);
+  for (i = 0; i < e->argc; i++) {
+    switch (kind[i]) {
+    case 's':
+      e->argv[i].p = copy_string(e, &used, va_arg(args, char*));
+      break;
+    case 'p':
+      e->argv[i].p = va_arg(args, void*);
+      break;
+    case 'd':
+      e->argv[i].d = va_arg(args, double);
+      break;
+    case 'l':
+      e->argv[i].l = va_arg(args, long);
+      break;
+    default:
+      e->argv[i].l = va_arg(args, int);
+    }
+  }
   va_end(args);
+
+  __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
 }
 
@@ -0,0 +1,260 @@
+
+/*
+ *  logdecode.c
+ *  Part of Amuleta, a traditional roguelike - https://deveah.github.io/amuleta
+ *  (c) Vlad Dumitru, <dalv.urtimud@gmail.com>
+ *  Licensed under the terms and conditions of the MIT License. Please consult
+ *  the LICENSE file included with this project.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termbox.h>
+#include "amuleta.h"
+
+/*
+ *  turns a binary log (see `make LOG_BINARY=1') back into the lines of text
+ *  the text log would have held
+ */
+
+/*
+ *  reads a number written by put_varint (see log.c)
+ *
+ *  FILE *f           -- the binary log
+ *  unsigned long *v  -- pointer to where to store the number
+ *  int return        -- 0 if the log ended early, non-zero otherwise
+ */
+static int get_varint(FILE *f, unsigned long *v)
+{
+  int c, shift = 0;
+
+  *v = 0;
+  do {
+    if ((c = fgetc(f)) == EOF) {
+      return 0;
+    }
+
+    *v |= (unsigned long)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+
+  return 1;
+}
+
+/*
+ *  reads a number written by put_signed (see log.c)
+ *
+ *  FILE *f     -- the binary log
+ *  long *v     -- pointer to where to store the number
+ *  int return  -- 0 if the log ended early, non-zero otherwise
+ */
+static int get_signed(FILE *f, long *v)
+{
+  unsigned long u;
+
+  if (!get_varint(f, &u)) {
+    return 0;
+  }
+
+  *v = (long)((u >> 1) ^ (0ul - (u & 1)));
+  return 1;
+}
+
+/*
+ *  reads a string written by put_string (see log.c)
+ *
+ *  FILE *f     -- the binary log
+ *  char **s    -- pointer to where to store the newly allocated string, or
+ *                 NULL if a NULL string was written
+ *  int return  -- 0 if the log ended early, non-zero otherwise
+ */
+static int get_string(FILE *f, char **s)
+{
+  unsigned long length;
+
+  *s = NULL;
+  if (!get_varint(f, &length)) {
+    return 0;
+  }
+
+  if (length == 0) {
+    return 1;
+  }
+
+  *s = (char*)malloc(length);
+  assert(*s != NULL);
+
+  if (fread(*s, 1, length - 1, f) != length - 1) {
+    free(*s);
+    *s = NULL;
+    return 0;
+  }
+  (*s)[length - 1] = '\0';
+
+  return 1;
+}
+
+/*
+ *  reads a site record, and adds the site to the list of known sites
+ *
+ *  FILE *f                   -- the binary log
+ *  struct log_site ***sites  -- pointer to the list of known sites
+ *  unsigned long *count      -- pointer to the number of known sites
+ *  int return                -- 0 if the record is broken, non-zero otherwise
+ */
+static int read_site(FILE *f, struct log_site ***sites, unsigned long *count)
+{
+  struct log_site *site;
+  unsigned long id, level, line;
+
+  if ((!get_varint(f, &id)) || (!get_varint(f, &level)) ||
+      (!get_varint(f, &line)) || (id != *count) || (level > LOG_LEVEL_ERROR)) {
+    return 0;
+  }
+
+  site = (struct log_site*)malloc(sizeof(struct log_site));
+  assert(site != NULL);
+
+  site->id      = id;
+  site->level   = (int)level;
+  site->line    = (int)line;
+  site->epoch   = 0;
+  site->scanned = 0;
+
+  if ((!get_string(f, &site->file)) || (!get_string(f, &site->function)) ||
+      (!get_string(f, &site->format)) || (site->format == NULL)) {
+    free(site);
+    return 0;
+  }
+
+  /*  sites are numbered in the order they first appear, so the list only
+   *  ever grows by one */
+  if ((*count & (*count - 1)) == 0) {
+    *sites = (struct log_site**)realloc(*sites,
+      sizeof(struct log_site*) * (*count == 0 ? 1 : *count * 2));
+    assert(*sites != NULL);
+  }
+  (*sites)[(*count)++] = site;
+
+  return 1;
+}
+
+/*
+ *  reads an entry record, and prints it as a line of text
+ *
+ *  FILE *f                 -- the binary log
+ *  struct log_site **sites -- the list of known sites
+ *  unsigned long count     -- the number of known sites
+ *  long *timestamp         -- pointer to the timestamp of the previous entry
+ *  int return              -- 0 if the record is broken, non-zero otherwise
+ */
+static int read_entry(FILE *f, struct log_site **sites, unsigned long count,
+  long *timestamp)
+{
+  union log_argument argv[LOG_MAX_ARGUMENTS];
+  char kind[LOG_MAX_ARGUMENTS];
+  struct log_site *site;
+  unsigned long id, u;
+  long delta;
+  int argc, i, ok = 1;
+
+  if ((!get_varint(f, &id)) || (id >= count) || (!get_signed(f, &delta))) {
+    return 0;
+  }
+
+  site = sites[id];
+  *timestamp += delta;
+
+  argc = log_conversions(site->format, kind);
+  for (i = 0; i < argc; i++) {
+    argv[i].p = NULL;
+  }
+
+  for (i = 0; (ok) && (i < argc); i++) {
+    switch (kind[i]) {
+    case 's':
+      ok = get_string(f, (char**)&argv[i].p);
+      break;
+    case 'p':
+      ok = get_varint(f, &u);
+      argv[i].p = (void*)u;
+      break;
+    case 'd':
+      ok = (fread(&argv[i].d, sizeof(double), 1, f) == 1);
+      break;
+    default:
+      ok = get_signed(f, &argv[i].l);
+    }
+  }
+
+  if (ok) {
+    write_log_line(stdout, site, *timestamp, argv, argc);
+  }
+
+  for (i = 0; i < argc; i++) {
+    if (kind[i] == 's') {
+      free(argv[i].p);
+    }
+  }
+
+  return ok;
+}
+
+int main(int argc, char **argv)
+{
+  struct log_site **sites = NULL;
+  unsigned long count = 0, i;
+  long timestamp = 0;
+  char magic[sizeof(LOG_BINARY_MAGIC)];
+  size_t magic_length = strlen(LOG_BINARY_MAGIC);
+  FILE *f = stdin;
+  int c, ok = 1;
+
+  if (argc > 2) {
+    fprintf(stderr, "Usage: %s [log.bin]\n", argv[0]);
+    return -1;
+  }
+
+  if ((argc == 2) && ((f = fopen(argv[1], "rb")) == NULL)) {
+    fprintf(stderr, "Unable to open '%s'\n", argv[1]);
+    return -1;
+  }
+
+  if ((fread(magic, 1, magic_length, f) != magic_length) ||
+      (memcmp(magic, LOG_BINARY_MAGIC, magic_length) != 0)) {
+    fprintf(stderr, "Not a binary Amuleta log\n");
+    return -1;
+  }
+
+  while ((ok) && ((c = fgetc(f)) != EOF)) {
+    if (c == LOG_RECORD_SITE) {
+      ok = read_site(f, &sites, &count);
+    } else if (c == LOG_RECORD_ENTRY) {
+      ok = read_entry(f, sites, count, &timestamp);
+    } else {
+      ok = 0;
+    }
+  }
+
+  /*  a log cut short by a crash is still worth reading up to that point */
+  if (!ok) {
+    fprintf(stderr, "The log is truncated or corrupt\n");
+  }
+
+  for (i = 0; i < count; i++) {
+    free(sites[i]->file);
+    free(sites[i]->function);
+    free(sites[i]->format);
+    free(sites[i]);
+  }
+  free(sites);
+
+  if (f != stdin) {
+    fclose(f);
+  }
+
+  return ok ? 0 : -1;
+}
+
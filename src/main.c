@@ -7,18 +7,21 @@
  *  the LICENSE file included with this project.
  */
 
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <termbox.h>
 #include "amuleta.h"
 
 /*  whether or not the termbox library has been initialized */
-int tb_initialized = 0;
+static int tb_initialized = 0;
 
 /*  terminal dimensions */
-int terminal_width  = 0,
-    terminal_height = 0;
+static int terminal_width  = 0,
+           terminal_height = 0;
 
 /*
  *  map from termbox error code to human-readable string
@@ -39,7 +42,14 @@ char *tb_error_to_string(int tb_error) {
   }
 }
 
-int main(int argc, char **argv)
+/*
+ *  plays a game in the terminal, resuming the saved game if there is one
+ *
+ *  unsigned int random_seed -- the random seed used to generate the dungeon,
+ *                              if a new game is started
+ *  int return               -- the process exit code
+ */
+int play_interactive(unsigned int random_seed)
 {
   /*  initialize termbox */
   int err = tb_init();
@@ -65,19 +75,23 @@ int main(int argc, char **argv)
   /*  initialize the log file */
   initialize_log();
 
-  struct game *g = NULL;
-
-  /*  if the user has provided a random seed, use that one; if not, use the
-   *  current timestamp as a random seed for dungeon generation */
-  if (argc < 2) {
-    g = initialize_game(time(NULL));
-  } else {
-    g = initialize_game(atoi(argv[1]));
+  /*  resume the saved game, if there is one; the game is saved as it is
+   *  played from then on, so a save which cannot be read is left alone,
+   *  rather than replaced by a new game */
+  int found;
+  struct game *g = load_game(SAVE_PATH, &found);
+  if ((g == NULL) && (found)) {
+    terminate_log();
+    tb_shutdown();
+    fprintf(stderr, "Unable to resume the saved game at '%s'; move it away "
+      "to start a new game (see %s for details)\n", SAVE_PATH, LOG_FILE_PATH);
+    return -1;
   }
-
-  /*  generate the character maps used to display strings */
-  default_character_map     = generate_character_map(TB_WHITE, TB_DEFAULT);
-  highlighted_character_map = generate_character_map(TB_WHITE | TB_BOLD, TB_DEFAULT);
+  if (g == NULL) {
+    g = initialize_game(random_seed);
+  }
+  g->save_path = SAVE_PATH;
+  g->ui = create_ui();
 
   /*  show the title screen */
   draw_title_screen();
@@ -86,13 +100,104 @@ int main(int argc, char **argv)
   run_game(g);
 
   /*  deallocate the game's resources */
+  destroy_ui(g->ui);
   destroy_game(g);
 
   /*  destroy all resources and exit */
   terminate_log();
-  free_character_map(default_character_map);
-  free_character_map(highlighted_character_map);
   tb_shutdown();
   return 0;
 }
 
+/*
+ *  plays a game without a terminal, issuing the commands of a script as fast
+ *  as possible, and reports how fast the game ran
+ *
+ *  unsigned int random_seed  -- the random seed used to generate the dungeon
+ *  char *script_path         -- path to the script file
+ *  unsigned long max_turns   -- number of turns to replay the script for, or
+ *                               0 to play it only once
+ *  int log                   -- whether or not to write the log file
+ *  int return                -- the process exit code
+ */
+int play_headless(unsigned int random_seed, char *script_path,
+  unsigned long max_turns, int log)
+{
+  struct timespec start, end;
+  double elapsed;
+
+  /*  logging every turn would dwarf the game itself, so it is optional */
+  if (log) {
+    initialize_log();
+  }
+
+  struct script *s = load_script(script_path, max_turns);
+  if (s == NULL) {
+    fprintf(stderr, "Unable to read script '%s'\n", script_path);
+    terminate_log();
+    return -1;
+  }
+
+  struct game *g = initialize_game(random_seed);
+  g->input      = script_input;
+  g->input_data = s;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  run_game(g);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("seed %u: %lu turns in %.3f s (%.0f turns/s)\n", random_seed,
+    g->turns, elapsed, (elapsed > 0) ? g->turns / elapsed : 0.0);
+
+  destroy_game(g);
+  free_script(s);
+  terminate_log();
+  return 0;
+}
+
+/*
+ *  prints the command line usage
+ *
+ *  char *name -- the program name
+ *  void return
+ */
+void print_usage(char *name)
+{
+  fprintf(stderr,
+    "Usage: %s [seed]\n"
+    "       %s --headless SCRIPT [--turns N] [--log] [seed]\n", name, name);
+}
+
+int main(int argc, char **argv)
+{
+  char *script_path = NULL;
+  unsigned long max_turns = 0;
+  int log = 0;
+  int i;
+
+  /*  if the user does not provide a random seed, use the current timestamp as
+   *  a random seed for dungeon generation */
+  unsigned int random_seed = time(NULL);
+
+  for (i = 1; i < argc; i++) {
+    if ((strcmp(argv[i], "--headless") == 0) && (i + 1 < argc)) {
+      script_path = argv[++i];
+    } else if ((strcmp(argv[i], "--turns") == 0) && (i + 1 < argc)) {
+      max_turns = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--log") == 0) {
+      log = 1;
+    } else if (argv[i][0] != '-') {
+      random_seed = atoi(argv[i]);
+    } else {
+      print_usage(argv[0]);
+      return -1;
+    }
+  }
+
+  if (script_path != NULL) {
+    return play_headless(random_seed, script_path, max_turns, log);
+  }
+
+  return play_interactive(random_seed);
+}
@@ -0,0 +1,742 @@
+
+/*
+ *  path.c
+ *  Part of Amuleta, a traditional roguelike - https://deveah.github.io/amuleta
+ *  (c) Vlad Dumitru, <dalv.urtimud@gmail.com>
+ *  Licensed under the terms and conditions of the MIT License. Please consult
+ *  the LICENSE file included with this project.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termbox.h>
+#include "amuleta.h"
+
+/*
+ *  paths are searched with A* on a window of the level holding both ends,
+ *  moving in the four cardinal directions at a cost of one per step; rather
+ *  than one cell at a time, the search jumps along straight lines of open
+ *  cells, and only stops where the way branches off in a way that no
+ *  shorter path could have taken (jump point search), so that open areas
+ *  and corridors cost a handful of nodes
+ */
+
+/*
+ *  allocates a pathfinder, with all the memory it is ever going to need
+ *
+ *  struct pathfinder *return -- the pathfinder
+ */
+struct pathfinder *create_pathfinder(void)
+{
+  struct pathfinder *pf = (struct pathfinder*)malloc(sizeof(struct pathfinder));
+  assert(pf != NULL);
+  DEBUG("Allocated pathfinder @0x%p\n", pf);
+
+  memset(pf->node, 0, sizeof(pf->node));
+  pf->search    = 0;
+  pf->heap_size = 0;
+  pf->cached    = 0;
+
+  pf->queries        = 0;
+  pf->cache_hits     = 0;
+  pf->nodes_expanded = 0;
+  pf->last_expanded  = 0;
+
+  return pf;
+}
+
+/*
+ *  frees a pathfinder
+ *
+ *  struct pathfinder *pf -- the pathfinder
+ *  void return
+ */
+void destroy_pathfinder(struct pathfinder *pf)
+{
+  DEBUG("Deallocating pathfinder @0x%p\n", pf);
+  free(pf);
+}
+
+/*
+ *  checks whether a cell of the window searched may be stepped on; cells
+ *  outside of the window may not
+ *
+ *  struct pathfinder *pf -- the pathfinder
+ *  int x, y              -- the coordinates of the cell within the window
+ *  int return            -- non-zero if the cell is open
+ */
+static int walkable(struct pathfinder *pf, int x, int y)
+{
+  if ((x < 0) || (x >= WINDOW_WIDTH) || (y < 0) || (y >= WINDOW_HEIGHT)) {
+    return 0;
+  }
+
+  return (int)MAP_BIT_TEST(&pf->open, x, y);
+}
+
+/*
+ *  stores a node at a given position in the open list
+ *
+ *  struct pathfinder *pf -- the pathfinder
+ *  int i                 -- the position
+ *  int cell              -- the node's cell
+ *  unsigned long key     -- the node's key
+ *  void return
+ */
+static void place(struct pathfinder *pf, int i, int cell, unsigned long key)
+{
+  pf->heap[i] = (short)cell;
+  pf->key[i]  = key;
+  pf->node[cell].heap_index = (short)i;
+}
+
+/*
+ *  moves a node up the open list until its parent comes before it
+ *
+ *  struct pathfinder *pf -- the pathfinder
+ *  int i                 -- the position of the node
+ *  void return
+ */
+static void sift_up(struct pathfinder *pf, int i)
+{
+  int cell = pf->heap[i];
+  unsigned long key = pf->key[i];
+
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+
+    if (pf->key[parent] <= key) {
+      break;
+    }
+
+    place(pf, i, pf->heap[parent], pf->key[parent]);
+    i = parent;
+  }
+
+  place(pf, i, cell, key);
+}
+
+/*
+ *  moves a node down the open list until it comes before both of its
+ *  children
+ *
+ *  struct pathfinder *pf -- the pathfinder
+ *  int i                 -- the position of the node
+ *  void return
+ */
+static void sift_down(struct pathfinder *pf, int i)
+{
+  int cell = pf->heap[i];
+  unsigned long key = pf->key[i];
+
+  while (1) {
+    int child = 2 * i + 1;
+
+    if (child >= pf->heap_size) {
+      break;
+    }
+
+    if ((child + 1 < pf->heap_size) && (pf->key[child + 1] < pf->key[child])) {
+      child++;
+    }
+
+    if (pf->key[child] >= key) {
+      break;
+    }
+
+    place(pf, i, pf->heap[child], pf->key[child]);
+    i = child;
+  }
+
+  place(pf, i, cell, key);
+}
+
+/*
+ *  adds a node to the open list, or moves it up if it is there already with
+ *  a larger key
+ *
+ *  struct pathfinder *pf -- the pathfinder
+ *  int cell              -- the node's cell
+ *  unsigned long key     -- the node's key
+ *  void return
+ */
+static void push_node(struct pathfinder *pf, int cell, unsigned long key)
+{
+  int i = pf->node[cell].heap_index;
+
+  if (i < 0) {
+    i = pf->heap_size++;
+  }
+
+  place(pf, i, cell, key);
+  sift_up(pf, i);
+}
+
+/*
+ *  takes the node with the smallest key out of the open list
+ *
+ *  struct pathfinder *pf -- the pathfinder
+ *  int return            -- the node's cell
+ */
+static int pop_node(struct pathfinder *pf)
+{
+  int cell = pf->heap[0];
+
+  pf->node[cell].heap_index = -1;
+  pf->heap_size--;
+
+  if (pf->heap_size > 0) {
+    place(pf, 0, pf->heap[pf->heap_size], pf->key[pf->heap_size]);
+    sift_down(pf, 0);
+  }
+
+  return cell;
+}
+
+/*
+ *  works out which cells of a word of a window row a horizontal move would
+ *  stop at, but for the goal: those which are closed, and those with an open
+ *  neighbour above or below which the cell the move comes from does not have
+ *  (a forced neighbour: no path could have reached it as cheaply without
+ *  going through the cell)
+ *
+ *  struct pathfinder *pf -- the pathfinder
+ *  int y                 -- the row
+ *  int w                 -- the word
+ *  int dx                -- the direction of the move
+ *  unsigned long return  -- the cells the move stops at
+ */
+static unsigned long horizontal_stops(struct pathfinder *pf, int y, int w,
+  int dx)
+{
+  unsigned long stops = ~pf->open.row[y][w];
+  int j;
+
+  for (j = y - 1; j <= y + 1; j += 2) {
+    unsigned long side, behind;
+
+    if ((j < 0) || (j >= WINDOW_HEIGHT)) {
+      continue;
+    }
+
+    side = pf->open.row[j][w];
+    if (dx > 0) {
+      behind = side << 1;
+      if (w > 0) {
+        behind |= pf->open.row[j][w - 1] >> (MAP_WORD_BITS - 1);
+      }
+    } else {
+      behind = side >> 1;
+      if (w < MAP_ROW_WORDS - 1) {
+        behind |= pf->open.row[j][w + 1] << (MAP_WORD_BITS - 1);
+      }
+    }
+
+    stops |= side & ~behind;
+  }
+
+  return stops;
+}
+
+/*
+ *  works out, for every row of the window, where horizontal moves stop, and
+ *  where they find jump points, so that jumping is a matter of looking up the
+ *  next bit set; the goal is where a move stops as well
+ *
+ *  cells from which a move to the right finds a jump point are those whose
+ *  right neighbour is an open stop, spread leftwards along the cells which
+ *  are not stops, in doubling shifts; moves to the left are handled the same
+ *  way the other way around
+ *
+ *  struct pathfinder *pf -- the pathfinder, whose window is filled in
+ *  int gx, gy            -- the goal, within the window
+ *  void return
+ */
+static void prepare_window(struct pathfinder *pf, int gx, int gy)
+{
+  int y, w, shift;
+
+  for (y = 0; y < WINDOW_HEIGHT; y++) {
+    unsigned long *open  = pf->open.row[y],
+                  *right = pf->stop[0].row[y],
+                  *left  = pf->stop[1].row[y],
+                  *lead  = pf->lead.row[y];
+    unsigned long carry;
+
+    for (w = 0; w < MAP_ROW_WORDS; w++) {
+      right[w] = horizontal_stops(pf, y, w, 1);
+      left[w]  = horizontal_stops(pf, y, w, -1);
+    }
+
+    if (y == gy) {
+      right[gx / MAP_WORD_BITS] |= 1ul << (gx % MAP_WORD_BITS);
+      left[gx / MAP_WORD_BITS]  |= 1ul << (gx % MAP_WORD_BITS);
+    }
+
+    /*  moves to the right, from the last word to the first; cells past the
+     *  end of the window count as closed stops */
+    carry = 0;
+    for (w = MAP_ROW_WORDS - 1; w >= 0; w--) {
+      unsigned long next_stop = (w < MAP_ROW_WORDS - 1) ? right[w + 1] : ~0ul,
+                    next_open = (w < MAP_ROW_WORDS - 1) ? open[w + 1] : 0;
+      unsigned long p = ~((right[w] >> 1) | (next_stop << (MAP_WORD_BITS - 1))),
+                    g = ((right[w] & open[w]) >> 1) |
+                        ((next_stop & next_open & 1) << (MAP_WORD_BITS - 1)) |
+                        (carry & p);
+
+      for (shift = 1; shift < MAP_WORD_BITS; shift *= 2) {
+        g |= p & (g >> shift);
+        p &= p >> shift;
+      }
+
+      lead[w] = g;
+      carry   = (g & 1) << (MAP_WORD_BITS - 1);
+    }
+
+    /*  moves to the left, from the first word to the last */
+    carry = 0;
+    for (w = 0; w < MAP_ROW_WORDS; w++) {
+      unsigned long last_stop = (w > 0) ? left[w - 1] : ~0ul,
+                    last_open = (w > 0) ? open[w - 1] : 0;
+      unsigned long p = ~((left[w] << 1) | (last_stop >> (MAP_WORD_BITS - 1))),
+                    g = ((left[w] & open[w]) << 1) |
+                        ((last_stop & last_open) >> (MAP_WORD_BITS - 1)) |
+                        (carry & p);
+
+      for (shift = 1; shift < MAP_WORD_BITS; shift *= 2) {
+        g |= p & (g << shift);
+        p &= p << shift;
+      }
+
+      lead[w] |= g;
+      carry    = g >> (MAP_WORD_BITS - 1);
+    }
+  }
+}
+
+/*
+ *  moves from a cell horizontally until a jump point is found: the goal, or a
+ *  cell with a forced neighbour
+ *
+ *  struct pathfinder *pf -- the pathfinder
+ *  int x, y              -- the cell to move from
+ *  int dx                -- the direction to move in
+ *  int return            -- the jump point's cell, or -1 if the move runs
+ *                           into a closed cell first
+ */
+static int jump_horizontally(struct pathfinder *pf, int x, int y, int dx)
+{
+  unsigned long *stops = pf->stop[(dx > 0) ? 0 : 1].row[y];
+  int w = x / MAP_WORD_BITS,
+      i = x % MAP_WORD_BITS;
+  unsigned long word;
+
+  /*  only the cells past the one moved from count */
+  word = stops[w] & ((dx > 0) ? ~0ul << i << 1 : (1ul << i) - 1);
+
+  while (word == 0) {
+    w += dx;
+    if ((w < 0) || (w >= MAP_ROW_WORDS)) {
+      return -1;
+    }
+    word = stops[w];
+  }
+
+  i = w * MAP_WORD_BITS +
+      ((dx > 0) ? lowest_word_bit(word) : highest_word_bit(word));
+  return ((i < WINDOW_WIDTH) && (MAP_BIT_TEST(&pf->open, i, y))) ?
+         y * WINDOW_WIDTH + i : -1;
+}
+
+/*
+ *  moves from a cell in a straight line until a jump point is found: the
+ *  goal, or a cell with a forced neighbour; when moving vertically, a cell
+ *  from which a horizontal move finds a jump point is one as well, so that
+ *  horizontal moves need only be tried at jump points
+ *
+ *  struct pathfinder *pf -- the pathfinder
+ *  int x, y              -- the cell to move from
+ *  int dx, dy            -- the direction to move in
+ *  int gx, gy            -- the goal
+ *  int return            -- the jump point's cell, or -1 if the line runs
+ *                           into a closed cell first
+ */
+static int jump(struct pathfinder *pf, int x, int y, int dx, int dy, int gx,
+  int gy)
+{
+  if (dx != 0) {
+    return jump_horizontally(pf, x, y, dx);
+  }
+
+  while (1) {
+    y += dy;
+
+    if (!walkable(pf, x, y)) {
+      return -1;
+    }
+
+    if (((x == gx) && (y == gy)) || (MAP_BIT_TEST(&pf->lead, x, y)) ||
+        ((walkable(pf, x - 1, y)) && (!walkable(pf, x - 1, y - dy))) ||
+        ((walkable(pf, x + 1, y)) && (!walkable(pf, x + 1, y - dy)))) {
+      return y * WINDOW_WIDTH + x;
+    }
+  }
+}
+
+/*
+ *  returns the sign of a number
+ *
+ *  int n       -- the number
+ *  int return  -- -1, 0 or 1
+ */
+static int sign(int n)
+{
+  return (n > 0) - (n < 0);
+}
+
+/*
+ *  searches the window for the cheapest path between two of its cells, and
+ *  writes it out
+ *
+ *  struct pathfinder *pf -- the pathfinder, whose window is filled in
+ *  int sx, sy            -- the start, within the window
+ *  int gx, gy            -- the goal, within the window
+ *  struct path *path     -- the path, to be filled in with coordinates on
+ *                           the level
+ *  int return            -- non-zero if a path was found
+ */
+static int search_window(struct pathfinder *pf, int sx, int sy, int gx,
+  int gy, struct path *path)
+{
+  int start = sy * WINDOW_WIDTH + sx,
+      goal  = gy * WINDOW_WIDTH + gx;
+  int count, i;
+
+  /*  a new search leaves every node untouched, without clearing them */
+  if (++pf->search == 0) {
+    memset(pf->node, 0, sizeof(pf->node));
+    pf->search = 1;
+  }
+
+  pf->heap_size = 0;
+  pf->node[start].search     = pf->search;
+  pf->node[start].cost       = 0;
+  pf->node[start].parent     = -1;
+  pf->node[start].heap_index = -1;
+  pf->node[start].closed     = 0;
+  push_node(pf, start, 0);
+
+  while (pf->heap_size > 0) {
+    int cell = pop_node(pf);
+    struct path_node *n = &pf->node[cell];
+    int x = cell % WINDOW_WIDTH,
+        y = cell / WINDOW_WIDTH;
+    int dir[4][2], dirs = 0, d;
+
+    n->closed = 1;
+    pf->last_expanded++;
+
+    if (cell == goal) {
+      break;
+    }
+
+    /*  only the ways which a path coming from the parent may go on along
+     *  without having had a shorter alternative */
+    if (n->parent < 0) {
+      for (d = 0; d < 4; d++) {
+        dir[d][0] = (d == 0) ? -1 : (d == 1) ? 1 : 0;
+        dir[d][1] = (d == 2) ? -1 : (d == 3) ? 1 : 0;
+      }
+      dirs = 4;
+    } else {
+      int dx = sign(x - n->parent % WINDOW_WIDTH),
+          dy = sign(y - n->parent / WINDOW_WIDTH);
+
+      dir[0][0] = dx;
+      dir[0][1] = dy;
+      dir[1][0] = dy;
+      dir[1][1] = dx;
+      dir[2][0] = -dy;
+      dir[2][1] = -dx;
+      dirs = 3;
+    }
+
+    for (d = 0; d < dirs; d++) {
+      int next = jump(pf, x, y, dir[d][0], dir[d][1], gx, gy);
+      struct path_node *m;
+      unsigned int cost;
+      int nx, ny;
+
+      if (next < 0) {
+        continue;
+      }
+
+      nx   = next % WINDOW_WIDTH;
+      ny   = next / WINDOW_WIDTH;
+      m    = &pf->node[next];
+      cost = n->cost + abs(nx - x) + abs(ny - y);
+
+      if (m->search != pf->search) {
+        m->search     = pf->search;
+        m->heap_index = -1;
+        m->closed     = 0;
+      } else if ((m->closed) || (cost >= m->cost)) {
+        continue;
+      }
+
+      m->cost   = (unsigned short)cost;
+      m->parent = (short)cell;
+
+      /*  nodes are ordered by their estimated total cost, and, among
+       *  equals, those further along come first */
+      push_node(pf, next, (((unsigned long)cost + abs(gx - nx) +
+        abs(gy - ny)) << 16) | (0xffff - cost));
+    }
+  }
+
+  pf->nodes_expanded += pf->last_expanded;
+
+  if ((pf->node[goal].search != pf->search) || (!pf->node[goal].closed)) {
+    return 0;
+  }
+
+  /*  walk back from the goal, through the open list's memory, which is no
+   *  longer needed */
+  count = 0;
+  for (i = goal; i >= 0; i = pf->node[i].parent) {
+    pf->heap[count++] = (short)i;
+  }
+
+  /*  jump points in the middle of a straight run are left out, so that the
+   *  path only holds its turns */
+  path->length = pf->node[goal].cost;
+  path->points = 0;
+  for (i = count - 1; (i >= 0) && (path->points < PATH_MAX_POINTS); i--) {
+    int x = pf->x0 + pf->heap[i] % WINDOW_WIDTH,
+        y = pf->y0 + pf->heap[i] / WINDOW_WIDTH;
+    int n = path->points;
+
+    if ((n >= 2) &&
+        (((path->x[n - 2] == x) && (path->x[n - 1] == x)) ||
+         ((path->y[n - 2] == y) && (path->y[n - 1] == y)))) {
+      n--;
+    }
+
+    path->x[n] = (short)x;
+    path->y[n] = (short)y;
+    path->points = n + 1;
+  }
+
+  return 1;
+}
+
+/*
+ *  checks whether the cells of a path after a given one are still free of
+ *  actors, but for the goal
+ *
+ *  struct map *m     -- the map structure
+ *  struct path *path -- the path
+ *  int k             -- the point the checked part of the path starts from
+ *  int x, y          -- the cell the checked part starts after, which lies
+ *                       between point `k' and the next one
+ *  int return        -- non-zero if nobody stands in the way
+ */
+static int path_clear(struct map *m, struct path *path, int k, int x, int y)
+{
+  for (; k < path->points - 1; k++) {
+    int dx = sign(path->x[k + 1] - x),
+        dy = sign(path->y[k + 1] - y);
+
+    while ((x != path->x[k + 1]) || (y != path->y[k + 1])) {
+      x += dx;
+      y += dy;
+
+      if ((MAP_CELL_TEST(m, LAYER_OCCUPIED, x, y)) &&
+          ((k + 1 < path->points - 1) || (x != path->x[k + 1]) ||
+           (y != path->y[k + 1]))) {
+        return 0;
+      }
+    }
+  }
+
+  return 1;
+}
+
+/*
+ *  looks for a path in the cache: one found on the same map, as it is now,
+ *  which leads to the same goal, and which the start lies on; the part of it
+ *  from the start on is the path asked for
+ *
+ *  struct pathfinder *pf -- the pathfinder
+ *  struct map *m         -- the map structure
+ *  int sx, sy            -- the start
+ *  int gx, gy            -- the goal
+ *  struct path *path     -- the path, to be filled in
+ *  int return            -- non-zero if a path was found
+ */
+static int lookup_path(struct pathfinder *pf, struct map *m, int sx, int sy,
+  int gx, int gy, struct path *path)
+{
+  int i, k;
+
+  for (i = 0; i < pf->cached; i++) {
+    struct path_cache_entry *e = &pf->cache[i];
+    struct path_cache_entry hit;
+    int walked = 0;
+
+    if ((e->serial != m->serial) || (e->tile_version != m->tile_version) ||
+        (e->goal_x != gx) || (e->goal_y != gy)) {
+      continue;
+    }
+
+    /*  find the stretch of the path the start lies on */
+    for (k = 0; k < e->path.points - 1; k++) {
+      int ax = e->path.x[k], ay = e->path.y[k],
+          bx = e->path.x[k + 1], by = e->path.y[k + 1];
+
+      if ((sx >= ((ax < bx) ? ax : bx)) && (sx <= ((ax > bx) ? ax : bx)) &&
+          (sy >= ((ay < by) ? ay : by)) && (sy <= ((ay > by) ? ay : by)) &&
+          ((sx != bx) || (sy != by))) {
+        break;
+      }
+
+      walked += abs(bx - ax) + abs(by - ay);
+    }
+
+    if (k == e->path.points - 1) {
+      continue;
+    }
+
+    /*  actors may have stepped into the way since the path was found */
+    if (e->occupant_version != m->occupant_version) {
+      if (!path_clear(m, &e->path, k, sx, sy)) {
+        pf->cached--;
+        memmove(&pf->cache[i], &pf->cache[i + 1],
+          sizeof(struct path_cache_entry) * (pf->cached - i));
+        i--;
+        continue;
+      }
+
+      if (k == 0) {
+        e->occupant_version = m->occupant_version;
+      }
+    }
+
+    path->length = e->path.length - walked -
+                   abs(sx - e->path.x[k]) - abs(sy - e->path.y[k]);
+    path->x[0]   = (short)sx;
+    path->y[0]   = (short)sy;
+    path->points = e->path.points - k;
+    memcpy(&path->x[1], &e->path.x[k + 1], sizeof(short) * (path->points - 1));
+    memcpy(&path->y[1], &e->path.y[k + 1], sizeof(short) * (path->points - 1));
+
+    /*  move the path to the front of the cache */
+    hit = *e;
+    memmove(&pf->cache[1], &pf->cache[0], sizeof(struct path_cache_entry) * i);
+    pf->cache[0] = hit;
+
+    return 1;
+  }
+
+  return 0;
+}
+
+/*
+ *  finds a shortest path between two cells of a map, moving in the four
+ *  cardinal directions, around solid tiles and the actors standing on the
+ *  way (but for those at either end); paths found lately are looked up in
+ *  the cache first, so an actor following a path costs no search until the
+ *  map changes under it
+ *
+ *  the search runs on a window of the level holding both ends, so ends
+ *  further apart than a window are never joined, and neither are ends only
+ *  joined by way of cells outside of the window
+ *
+ *  struct pathfinder *pf -- the pathfinder
+ *  struct map *m         -- the map structure
+ *  int sx, sy            -- the start
+ *  int gx, gy            -- the goal
+ *  struct path *path     -- the path, to be filled in
+ *  int return            -- non-zero if a path was found
+ */
+int find_path(struct pathfinder *pf, struct map *m, int sx, int sy, int gx,
+  int gy, struct path *path)
+{
+  struct map_bitset occupied;
+  struct path_cache_entry *e;
+  int dx = abs(gx - sx),
+      dy = abs(gy - sy);
+  int y, w;
+
+  pf->queries++;
+  pf->last_expanded = 0;
+
+  if ((gx < 0) || (gx >= m->width) || (gy < 0) || (gy >= m->height) ||
+      (!MAP_CELL_TEST(m, LAYER_PASSABLE, gx, gy)) ||
+      (dx >= WINDOW_WIDTH) || (dy >= WINDOW_HEIGHT)) {
+    return 0;
+  }
+
+  if (lookup_path(pf, m, sx, sy, gx, gy, path)) {
+    pf->cache_hits++;
+    return 1;
+  }
+
+  /*  the window holds both ends, with as much room around them on either
+   *  side */
+  pf->x0 = ((sx < gx) ? sx : gx) - (WINDOW_WIDTH - 1 - dx) / 2;
+  pf->y0 = ((sy < gy) ? sy : gy) - (WINDOW_HEIGHT - 1 - dy) / 2;
+
+  load_window(m, LAYER_PASSABLE, pf->x0, pf->y0, &pf->open);
+  load_window(m, LAYER_OCCUPIED, pf->x0, pf->y0, &occupied);
+  for (y = 0; y < WINDOW_HEIGHT; y++) {
+    for (w = 0; w < MAP_ROW_WORDS; w++) {
+      pf->open.row[y][w] &= ~occupied.row[y][w];
+    }
+  }
+  MAP_BIT_SET(&pf->open, sx - pf->x0, sy - pf->y0);
+  MAP_BIT_SET(&pf->open, gx - pf->x0, gy - pf->y0);
+
+  prepare_window(pf, gx - pf->x0, gy - pf->y0);
+
+  if (!search_window(pf, sx - pf->x0, sy - pf->y0, gx - pf->x0, gy - pf->y0,
+      path)) {
+    return 0;
+  }
+
+  /*  the least recently used path makes room, if need be */
+  if (pf->cached < PATH_CACHE_SIZE) {
+    pf->cached++;
+  }
+  memmove(&pf->cache[1], &pf->cache[0],
+    sizeof(struct path_cache_entry) * (pf->cached - 1));
+
+  e = &pf->cache[0];
+  e->serial           = m->serial;
+  e->tile_version     = m->tile_version;
+  e->occupant_version = m->occupant_version;
+  e->goal_x           = gx;
+  e->goal_y           = gy;
+  e->path             = *path;
+
+  return 1;
+}
+
+/*
+ *  works out the first step of a path
+ *
+ *  struct path *path -- the path
+ *  int *dx, *dy      -- pointers to where to store the step
+ *  int return        -- 0 if the path has no steps, non-zero otherwise
+ */
+int next_path_step(struct path *path, int *dx, int *dy)
+{
+  if (path->points < 2) {
+    return 0;
+  }
+
+  *dx = sign(path->x[1] - path->x[0]);
+  *dy = sign(path->y[1] - path->y[0]);
+  return 1;
+}
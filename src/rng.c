@@ -0,0 +1,101 @@
+
+/*
+ *  rng.c
+ *  Part of Amuleta, a traditional roguelike - https://deveah.github.io/amuleta
+ *  (c) Vlad Dumitru, <dalv.urtimud@gmail.com>
+ *  Licensed under the terms and conditions of the MIT License. Please consult
+ *  the LICENSE file included with this project.
+ */
+
+#include "amuleta.h"
+
+/*
+ *  scrambles a 32-bit value (the finalizer of MurmurHash3), so that
+ *  neighbouring inputs give unrelated outputs
+ *
+ *  unsigned int h      -- the value to scramble
+ *  unsigned int return -- the scrambled value
+ */
+static unsigned int mix(unsigned int h)
+{
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+
+  return h;
+}
+
+/*
+ *  seeds a random number generator with one of the streams derived from a
+ *  seed; different streams of the same seed are independent of each other,
+ *  so every level and subsystem can draw numbers without disturbing the
+ *  others
+ *
+ *  struct rng *r       -- the random number generator
+ *  unsigned int seed   -- the seed (usually the game's random seed)
+ *  unsigned int stream -- the stream identifier (one of RNG_STREAM_*)
+ *  void return
+ */
+void rng_seed(struct rng *r, unsigned int seed, unsigned int stream)
+{
+  unsigned int h = mix(seed ^ mix(stream + 0x9e3779b9u));
+  int i;
+
+  /*  expand the seed into the whole state, splitmix-style */
+  for (i = 0; i < 4; i++) {
+    h += 0x9e3779b9u;
+    r->s[i] = mix(h);
+  }
+
+  /*  the all-zero state is the only one xoshiro cannot leave */
+  if ((r->s[0] | r->s[1] | r->s[2] | r->s[3]) == 0) {
+    r->s[0] = 1;
+  }
+}
+
+/*
+ *  draws the next 32-bit number (xoshiro128**)
+ *
+ *  struct rng *r       -- the random number generator
+ *  unsigned int return -- a number in range 0 .. 2^32-1, both inclusively
+ */
+unsigned int rng_next(struct rng *r)
+{
+  unsigned int result = r->s[1] * 5;
+  unsigned int t = r->s[1] << 9;
+
+  result = ((result << 7) | (result >> 25)) * 9;
+
+  r->s[2] ^= r->s[0];
+  r->s[3] ^= r->s[1];
+  r->s[1] ^= r->s[2];
+  r->s[0] ^= r->s[3];
+  r->s[2] ^= t;
+  r->s[3] = (r->s[3] << 11) | (r->s[3] >> 21);
+
+  return result;
+}
+
+/*
+ *  draws a number in a given range, without the bias of a plain modulo
+ *
+ *  struct rng *r       -- the random number generator
+ *  unsigned int bound  -- the (exclusive) upper bound; must not be 0
+ *  unsigned int return -- a number in range 0 .. bound-1, both inclusively
+ */
+unsigned int rng_range(struct rng *r, unsigned int bound)
+{
+  /*  reject the lowest (2^32 mod bound) values, so that every remainder is
+   *  equally likely; this almost never takes more than one draw */
+  unsigned int threshold = (0u - bound) % bound;
+  unsigned int n;
+
+  do {
+    n = rng_next(r);
+  } while (n < threshold);
+
+  return n % bound;
+}
+
@@ -0,0 +1,731 @@
+
+/*
+ *  save.c
+ *  Part of Amuleta, a traditional roguelike - https://deveah.github.io/amuleta
+ *  (c) Vlad Dumitru, <dalv.urtimud@gmail.com>
+ *  Licensed under the terms and conditions of the MIT License. Please consult
+ *  the LICENSE file included with this project.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <termbox.h>
+#include "amuleta.h"
+
+/*
+ *  the kinds of actors a save knows of; actors are told apart by their
+ *  appearance, and get their name and appearance back from here, as those
+ *  point to the program's own data
+ */
+static struct actor_kind {
+  char *name;
+  struct tb_cell *cell;
+} actor_kind[] = {
+  { "You", &player_cell },
+  { "Rat", &rat_cell }
+};
+
+#define ACTOR_KINDS ((int)(sizeof(actor_kind) / sizeof(actor_kind[0])))
+
+/*  the records of a level file start at multiples of this many bytes */
+#define SAVE_ALIGN 16
+#define SAVE_ROUND(n) (((n) + SAVE_ALIGN - 1) & ~(unsigned long)(SAVE_ALIGN - 1))
+
+/*
+ *  builds the path of one of the files of a save, other than the game file:
+ *  a level file, named after the level and the save which wrote it, or the
+ *  game file being written, if no level index is given
+ *
+ *  char *path            -- the save path
+ *  int z                 -- the level index, or -1 for the game file
+ *                           being written
+ *  unsigned long serial  -- the save which wrote the level
+ *  char *return          -- the path, to be freed by the caller
+ */
+static char *file_path(char *path, int z, unsigned long serial)
+{
+  char *s = (char*)malloc(strlen(path) + 32);
+  assert(s != NULL);
+
+  if (z >= 0) {
+    sprintf(s, "%s.%i.%lu", path, z, serial);
+  } else {
+    sprintf(s, "%s.tmp", path);
+  }
+
+  return s;
+}
+
+/*
+ *  fills in the header of a file of a save
+ *
+ *  struct save_header *h   -- the header
+ *  struct game *g          -- the game being saved
+ *  unsigned int kind       -- what the file holds (one of SAVE_KIND_*)
+ *  unsigned long serial    -- the save writing the file
+ *  unsigned long size      -- the size of the file
+ *  void return
+ */
+static void fill_header(struct save_header *h, struct game *g,
+  unsigned int kind, unsigned long serial, unsigned long size)
+{
+  memset(h, 0, sizeof(struct save_header));
+  memcpy(h->magic, SAVE_MAGIC, sizeof(SAVE_MAGIC));
+  h->version      = SAVE_VERSION;
+  h->kind         = kind;
+  h->byte_order   = SAVE_BYTE_ORDER;
+  h->random_seed  = g->random_seed;
+  h->serial       = serial;
+  h->size         = size;
+}
+
+/*
+ *  checks the header of a file of a save
+ *
+ *  struct save_header *h -- the header
+ *  unsigned int kind     -- what the file should hold (one of SAVE_KIND_*)
+ *  unsigned long size    -- the size of the file
+ *  int return            -- non-zero if the file can be read
+ */
+static int check_header(struct save_header *h, unsigned int kind,
+  unsigned long size)
+{
+  if ((memcmp(h->magic, SAVE_MAGIC, sizeof(SAVE_MAGIC)) != 0) ||
+      (h->byte_order != SAVE_BYTE_ORDER)) {
+    WARN("Not a saved game, or saved on another kind of machine\n");
+    return 0;
+  }
+
+  if (h->version != SAVE_VERSION) {
+    WARN("Saved game is of version %u, rather than %u\n", h->version,
+      SAVE_VERSION);
+    return 0;
+  }
+
+  if ((h->kind != kind) || (h->size != size)) {
+    WARN("Saved game file is damaged\n");
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+ *  opens the game file of a save, and reads its own record, leaving the
+ *  actor records to be read
+ *
+ *  char *path                -- the save path
+ *  struct save_game *record  -- where to store the record
+ *  int *found                -- set to non-zero if there is a game file at
+ *                               the path, whether or not it can be read
+ *  FILE *return              -- the game file, or NULL if there is none, or
+ *                               it cannot be read
+ */
+static FILE *open_game_file(char *path, struct save_game *record, int *found)
+{
+  FILE *f = fopen(path, "rb");
+  long size = 0;
+
+  *found = (f != NULL);
+  if (f == NULL) {
+    return NULL;
+  }
+
+  if ((fseek(f, 0, SEEK_END) != 0) || ((size = ftell(f)) < 0) ||
+      (fseek(f, 0, SEEK_SET) != 0) ||
+      (fread(record, sizeof(struct save_game), 1, f) != 1) ||
+      (!check_header(&record->header, SAVE_KIND_GAME, size)) ||
+      (record->used < 0) || (record->used > ACTOR_INDEX_MASK) ||
+      (record->header.size != sizeof(struct save_game) +
+         sizeof(struct save_actor) * (unsigned long)record->used)) {
+    WARN("Unable to read the saved game at '%s'\n", path);
+    fclose(f);
+    return NULL;
+  }
+
+  return f;
+}
+
+/*
+ *  writes a level of a game to its temporary file, with its tiles and layers
+ *  as they are in memory
+ *
+ *  struct game *g        -- the game structure
+ *  int z                 -- the level index
+ *  unsigned long serial  -- the save being written
+ *  int return            -- non-zero on success
+ */
+static int write_level(struct game *g, int z, unsigned long serial)
+{
+  static char padding[SAVE_ALIGN];
+  struct map *m = g->dungeon->map[z];
+  struct save_level s;
+  struct save_chunk record;
+  int chunks = m->chunks_wide * m->chunks_high;
+  int *index;
+  char *path;
+  FILE *f;
+  int i, ok;
+
+  /*  number the chunks which have been written to, in the order they come
+   *  in; the others read as solid rock, and take no room */
+  index = (int*)malloc(sizeof(int) * chunks);
+  assert(index != NULL);
+
+  memset(&s, 0, sizeof(s));
+  for (i = 0; i < chunks; i++) {
+    index[i] = chunk_written(m, i) ? s.chunk_count++ : -1;
+  }
+
+  s.z           = z;
+  s.width       = m->width;
+  s.height      = m->height;
+  s.entry_x     = m->entry_x;
+  s.entry_y     = m->entry_y;
+  s.free_count  = m->free_count;
+
+  s.index_offset = SAVE_ROUND(sizeof(struct save_level));
+  s.chunk_offset = SAVE_ROUND(s.index_offset + sizeof(int) * chunks);
+  s.free_offset  = s.chunk_offset +
+                   sizeof(struct save_chunk) * (unsigned long)s.chunk_count;
+  fill_header(&s.header, g, SAVE_KIND_LEVEL, serial,
+    s.free_offset + sizeof(int) * (unsigned long)s.free_count);
+
+  path = file_path(g->save_path, z, serial);
+  f = fopen(path, "wb");
+  if (f == NULL) {
+    WARN("Unable to write level %i of the save at '%s'\n", z, g->save_path);
+    free(path);
+    free(index);
+    return 0;
+  }
+
+  ok = (fwrite(&s, sizeof(s), 1, f) == 1) &&
+       (fwrite(padding, s.index_offset - sizeof(s), 1, f) <= 1) &&
+       (fwrite(index, sizeof(int), chunks, f) == (size_t)chunks) &&
+       (fwrite(padding, s.chunk_offset - s.index_offset - sizeof(int) * chunks,
+          1, f) <= 1);
+
+  /*  the cells somebody stands on are worked out again from the actors, and
+   *  the dirty ones mean nothing once the game is loaded */
+  for (i = 0; (ok) && (i < chunks); i++) {
+    if (index[i] < 0) {
+      continue;
+    }
+
+    memcpy(record.tile, m->chunk[i]->tile, sizeof(record.tile));
+    memcpy(record.bits, m->chunk[i]->bits, sizeof(record.bits));
+    memset(record.bits[LAYER_OCCUPIED], 0, sizeof(record.bits[0]));
+    memset(record.bits[LAYER_DIRTY], 0, sizeof(record.bits[0]));
+    ok = (fwrite(&record, sizeof(record), 1, f) == 1);
+  }
+
+  if ((ok) && (m->free_count > 0)) {
+    ok = (fwrite(m->free_cell, sizeof(int), m->free_count, f) ==
+          (size_t)m->free_count);
+  }
+
+  /*  the file must be on disk before the game file names it */
+  ok = (ok) && (fflush(f) == 0) && (fsync(fileno(f)) == 0);
+  ok = (fclose(f) == 0) && (ok);
+  if (!ok) {
+    WARN("Unable to write level %i of the save at '%s'\n", z, g->save_path);
+    remove(path);
+  }
+
+  free(path);
+  free(index);
+  return ok;
+}
+
+/*
+ *  writes the game file of a game to its temporary file: the game's own
+ *  state, and every slot of the actor pool
+ *
+ *  struct game *g                -- the game structure
+ *  unsigned long serial          -- the save being written
+ *  unsigned long *level_serial   -- the save which wrote each level, or 0
+ *  int return                    -- non-zero on success
+ */
+static int write_game(struct game *g, unsigned long serial,
+  unsigned long *level_serial)
+{
+  struct actor_pool *p = g->actors;
+  struct scheduler *s = g->scheduler;
+  struct save_game record;
+  struct save_actor actor;
+  char *path;
+  FILE *f;
+  int slot, i, ok;
+
+  memset(&record, 0, sizeof(record));
+  fill_header(&record.header, g, SAVE_KIND_GAME, serial,
+    sizeof(struct save_game) + sizeof(struct save_actor) * p->used);
+
+  record.rng        = g->rng;
+  record.turns      = g->turns;
+  record.kills      = g->kills;
+  record.max_depth  = g->max_depth;
+  record.player     = g->player;
+  record.now        = s->now;
+  record.order      = s->order;
+  record.used       = p->used;
+  record.count      = p->count;
+  record.free_slot  = p->free_slot;
+  memcpy(record.level_serial, level_serial, sizeof(record.level_serial));
+
+  path = file_path(g->save_path, -1, 0);
+  f = fopen(path, "wb");
+  if (f == NULL) {
+    WARN("Unable to write the game file of the save at '%s'\n", g->save_path);
+    free(path);
+    return 0;
+  }
+
+  ok = (fwrite(&record, sizeof(record), 1, f) == 1);
+
+  for (slot = 0; (ok) && (slot < p->used); slot++) {
+    memset(&actor, 0, sizeof(actor));
+    actor.x           = ACTOR_SLOT_FIELD(p, slot, x);
+    actor.y           = ACTOR_SLOT_FIELD(p, slot, y);
+    actor.z           = ACTOR_SLOT_FIELD(p, slot, z);
+    actor.hp          = ACTOR_SLOT_FIELD(p, slot, hp);
+    actor.flags       = ACTOR_SLOT_FIELD(p, slot, flags);
+    actor.max_hp      = ACTOR_SLOT_FIELD(p, slot, max_hp);
+    actor.speed       = ACTOR_SLOT_FIELD(p, slot, speed);
+    actor.generation  = ACTOR_SLOT_FIELD(p, slot, generation);
+    actor.next_free   = ACTOR_SLOT_FIELD(p, slot, next_free);
+
+    /*  the slots of dead actors only keep their bookkeeping */
+    actor.kind = -1;
+    if (ACTOR_SLOT_FIELD(p, slot, flags) & ACTOR_FLAG_ALIVE) {
+      for (i = 0; i < ACTOR_KINDS; i++) {
+        if (ACTOR_SLOT_FIELD(p, slot, cell) == actor_kind[i].cell) {
+          actor.kind = i;
+        }
+      }
+      assert(actor.kind >= 0);
+
+      if (ACTOR_SLOT_FIELD(p, slot, heap_index) >= 0) {
+        actor.scheduled = 1;
+        actor.time  = s->heap[ACTOR_SLOT_FIELD(p, slot, heap_index)].time;
+        actor.order = s->heap[ACTOR_SLOT_FIELD(p, slot, heap_index)].order;
+      }
+    }
+
+    ok = (fwrite(&actor, sizeof(actor), 1, f) == 1);
+  }
+
+  ok = (ok) && (fflush(f) == 0) && (fsync(fileno(f)) == 0);
+  ok = (fclose(f) == 0) && (ok);
+  if (!ok) {
+    WARN("Unable to write the game file of the save at '%s'\n", g->save_path);
+    remove(path);
+  }
+
+  free(path);
+  return ok;
+}
+
+/*
+ *  removes a level file of a save
+ *
+ *  char *path            -- the save path
+ *  int z                 -- the level index
+ *  unsigned long serial  -- the save which wrote the level
+ *  void return
+ */
+static void remove_level_file(char *path, int z, unsigned long serial)
+{
+  char *level_path = file_path(path, z, serial);
+
+  remove(level_path);
+  free(level_path);
+}
+
+/*
+ *  saves a game at its save path; only the levels which changed since the
+ *  last save are written again, each to a file of its own, named after the
+ *  save; the save only takes the place of the previous one once the new game
+ *  file, naming the level files to be read, is renamed over the previous
+ *  one, so that a save which fails, or is cut short, leaves the previous one
+ *  whole; the level files it replaces are removed afterwards
+ *
+ *  struct game *g  -- the game structure, whose save path is set
+ *  int return      -- non-zero on success
+ */
+int save_game(struct game *g)
+{
+  unsigned long serial = g->saves + 1;
+  unsigned long level_serial[DUNGEON_DEPTH];
+  int written[DUNGEON_DEPTH];
+  int levels = 0, ok = 1;
+  char *path;
+  int z;
+
+  assert(g->save_path != NULL);
+
+  for (z = 0; z < DUNGEON_DEPTH; z++) {
+    struct map *m = g->dungeon->map[z];
+
+    written[z] = 0;
+    level_serial[z] = (m != NULL) ? m->save_serial : 0;
+
+    if ((ok) && (m != NULL) && (m->unsaved)) {
+      ok = write_level(g, z, serial);
+      written[z] = ok;
+      level_serial[z] = serial;
+      levels++;
+    }
+  }
+
+  ok = (ok) && (write_game(g, serial, level_serial));
+
+  /*  this is where the save takes place */
+  if (ok) {
+    path = file_path(g->save_path, -1, 0);
+    ok = (rename(path, g->save_path) == 0);
+    if (!ok) {
+      remove(path);
+    }
+    free(path);
+  }
+
+  for (z = 0; z < DUNGEON_DEPTH; z++) {
+    struct map *m = g->dungeon->map[z];
+
+    if (!written[z]) {
+      continue;
+    }
+
+    if (!ok) {
+      remove_level_file(g->save_path, z, serial);
+      continue;
+    }
+
+    /*  a level mapped in memory keeps the file it was loaded from */
+    if (m->save_serial != 0) {
+      remove_level_file(g->save_path, z, m->save_serial);
+    }
+    m->unsaved     = 0;
+    m->save_serial = serial;
+  }
+
+  if (!ok) {
+    WARN("Unable to save the game at '%s'\n", g->save_path);
+    return 0;
+  }
+
+  g->saves = serial;
+  INFO("Saved the game at '%s' (save %lu, %i levels written)\n", g->save_path,
+    serial, levels);
+  return 1;
+}
+
+/*
+ *  loads a level of a saved game, by mapping its file in memory; the tiles
+ *  and the list of free cells are used where they lie, and the file stays
+ *  mapped for as long as the map lives, while the pages written to are
+ *  copied, and the file itself is never written to
+ *
+ *  char *path            -- the save path
+ *  int z                 -- the level index
+ *  struct save_header *h -- the game file's header
+ *  unsigned long serial  -- the save which wrote the level
+ *  struct map *return    -- the map, or NULL if the level cannot be read
+ */
+static struct map *map_level(char *path, int z, struct save_header *h,
+  unsigned long serial)
+{
+  struct save_level *s;
+  struct save_chunk *record;
+  struct stat st;
+  struct map *m;
+  char *level_path = file_path(path, z, serial);
+  void *data;
+  int *index;
+  int fd, chunks, i, j;
+
+  fd = open(level_path, O_RDONLY);
+  free(level_path);
+  if (fd < 0) {
+    WARN("Unable to read level %i of the save at '%s'\n", z, path);
+    return NULL;
+  }
+
+  if ((fstat(fd, &st) != 0) ||
+      ((unsigned long)st.st_size < sizeof(struct save_level)) ||
+      ((data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+          0)) == MAP_FAILED)) {
+    WARN("Unable to map level %i of the save at '%s'\n", z, path);
+    close(fd);
+    return NULL;
+  }
+
+  close(fd);
+  s = (struct save_level*)data;
+
+  /*  the level must be the one the game file names, and its records must lie
+   *  within the file */
+  if ((!check_header(&s->header, SAVE_KIND_LEVEL, st.st_size)) ||
+      (s->header.random_seed != h->random_seed) ||
+      (s->header.serial != serial) || (s->z != z) ||
+      (s->width <= 0) || (s->width > MAP_MAX_SIZE) ||
+      (s->height <= 0) || (s->height > MAP_MAX_SIZE)) {
+    WARN("Saved level %i does not belong to the saved game\n", z);
+    munmap(data, st.st_size);
+    return NULL;
+  }
+
+  chunks = ((s->width + CHUNK_MASK) >> CHUNK_BITS) *
+           ((s->height + CHUNK_MASK) >> CHUNK_BITS);
+  if ((s->chunk_count < 0) || (s->chunk_count > chunks) ||
+      (s->free_count < 0) || (s->free_count > s->width * s->height) ||
+      (s->index_offset % SAVE_ALIGN != 0) ||
+      (s->chunk_offset % SAVE_ALIGN != 0) ||
+      (s->index_offset < sizeof(struct save_level)) ||
+      (s->chunk_offset < s->index_offset + sizeof(int) * chunks) ||
+      (s->free_offset != s->chunk_offset +
+         sizeof(struct save_chunk) * (unsigned long)s->chunk_count) ||
+      (s->header.size != s->free_offset +
+         sizeof(int) * (unsigned long)s->free_count) ||
+      (s->entry_x < 0) || (s->entry_x >= s->width) ||
+      (s->entry_y < 0) || (s->entry_y >= s->height)) {
+    WARN("Saved level %i is damaged\n", z);
+    munmap(data, st.st_size);
+    return NULL;
+  }
+
+  /*  from now on, the mapping goes away with the map */
+  m = generate_map(s->width, s->height);
+  m->save_data = data;
+  m->save_size = st.st_size;
+  m->entry_x   = s->entry_x;
+  m->entry_y   = s->entry_y;
+
+  index  = (int*)((char*)data + s->index_offset);
+  record = (struct save_chunk*)((char*)data + s->chunk_offset);
+
+  for (i = 0; i < chunks; i++) {
+    if (index[i] < 0) {
+      continue;
+    }
+
+    if (index[i] >= s->chunk_count) {
+      WARN("Saved level %i is damaged\n", z);
+      free_map(m);
+      return NULL;
+    }
+
+    /*  an unknown tile would be looked up past the end of the palette */
+    for (j = 0; j < CHUNK_SIZE * CHUNK_SIZE; j++) {
+      if (record[index[i]].tile[j / CHUNK_SIZE][j % CHUNK_SIZE] >= TILE_COUNT) {
+        WARN("Saved level %i is damaged\n", z);
+        free_map(m);
+        return NULL;
+      }
+    }
+
+    restore_chunk(m, i, record[index[i]].tile, record[index[i]].bits);
+  }
+
+  if (!restore_free_cells(m, (int*)((char*)data + s->free_offset),
+        s->free_count)) {
+    WARN("Saved level %i is damaged\n", z);
+    free_map(m);
+    return NULL;
+  }
+
+  DEBUG("Mapped saved level %i @0x%p (%lu bytes, %i chunks)\n", z, data,
+    (unsigned long)st.st_size, s->chunk_count);
+  return m;
+}
+
+/*
+ *  loads a saved game; the levels reached are mapped in memory (see
+ *  map_level()), the others are generated from their seed once reached, as
+ *  they would have been; the game is saved at the same path from then on
+ *
+ *  char *path          -- the save path, which must outlive the game
+ *  int *found          -- set to non-zero if there is a saved game at the
+ *                         path, whether or not it can be read, so that a
+ *                         damaged save is told apart from none at all
+ *  struct game *return -- the game, or NULL if there is no saved game at the
+ *                         path, or it cannot be read
+ */
+struct game *load_game(char *path, int *found)
+{
+  struct save_game record;
+  struct save_actor *actor;
+  struct actor_pool *p;
+  struct game *g;
+  struct map *m = NULL;
+  FILE *f;
+  int slot, z, ok;
+
+  f = open_game_file(path, &record, found);
+  if (f == NULL) {
+    return NULL;
+  }
+
+  actor = (struct save_actor*)malloc(sizeof(struct save_actor) *
+    (record.used + 1));
+  assert(actor != NULL);
+
+  ok = (fread(actor, sizeof(struct save_actor), record.used, f) ==
+        (size_t)record.used);
+  fclose(f);
+
+  g = create_game(record.header.random_seed);
+  p = g->actors;
+
+  g->rng        = record.rng;
+  g->turns      = record.turns;
+  g->kills      = record.kills;
+  g->max_depth  = record.max_depth;
+  g->player     = record.player;
+  g->saves      = record.header.serial;
+
+  for (z = 0; (ok) && (z < DUNGEON_DEPTH); z++) {
+    if (record.level_serial[z] != 0) {
+      g->dungeon->map[z] = map_level(path, z, &record.header,
+        record.level_serial[z]);
+      ok = (g->dungeon->map[z] != NULL);
+    }
+  }
+
+  /*  fill the pool back in, slot by slot */
+  ok = (ok) && (record.free_slot >= -1) && (record.free_slot < record.used);
+  if (ok) {
+    restore_actor_slots(p, record.used);
+    p->count      = record.count;
+    p->free_slot  = record.free_slot;
+  }
+
+  for (slot = 0; (ok) && (slot < record.used); slot++) {
+    struct save_actor *a = &actor[slot];
+
+    ACTOR_SLOT_FIELD(p, slot, x)          = a->x;
+    ACTOR_SLOT_FIELD(p, slot, y)          = a->y;
+    ACTOR_SLOT_FIELD(p, slot, z)          = a->z;
+    ACTOR_SLOT_FIELD(p, slot, hp)         = a->hp;
+    ACTOR_SLOT_FIELD(p, slot, flags)      = a->flags;
+    ACTOR_SLOT_FIELD(p, slot, max_hp)     = a->max_hp;
+    ACTOR_SLOT_FIELD(p, slot, speed)      = a->speed;
+    ACTOR_SLOT_FIELD(p, slot, generation) = a->generation &
+                                            ACTOR_GENERATION_MASK;
+    ACTOR_SLOT_FIELD(p, slot, next_free)  = a->next_free;
+    ACTOR_SLOT_FIELD(p, slot, heap_index) = -1;
+    ACTOR_SLOT_FIELD(p, slot, name)       = NULL;
+    ACTOR_SLOT_FIELD(p, slot, cell)       = NULL;
+
+    if (!(a->flags & ACTOR_FLAG_ALIVE)) {
+      ok = (a->next_free >= -1) && (a->next_free < record.used);
+      continue;
+    }
+
+    /*  a live actor stands on a free cell of a level reached */
+    ok = (a->kind >= 0) && (a->kind < ACTOR_KINDS) &&
+         (a->z >= 0) && (a->z < DUNGEON_DEPTH) &&
+         ((m = g->dungeon->map[a->z]) != NULL) &&
+         (a->x >= 0) && (a->x < m->width) &&
+         (a->y >= 0) && (a->y < m->height) &&
+         (MAP_CELL_TEST(m, LAYER_PASSABLE, a->x, a->y)) &&
+         (!MAP_CELL_TEST(m, LAYER_OCCUPIED, a->x, a->y));
+    if (!ok) {
+      break;
+    }
+
+    ACTOR_SLOT_FIELD(p, slot, name) = actor_kind[a->kind].name;
+    ACTOR_SLOT_FIELD(p, slot, cell) = actor_kind[a->kind].cell;
+    set_occupant(m, a->x, a->y, actor_at_slot(p, slot));
+
+    if (a->scheduled) {
+      schedule_actor_at(g->scheduler, p, actor_at_slot(p, slot), a->time,
+        a->order);
+    }
+  }
+
+  ok = (ok) && (actor_alive(p, g->player)) &&
+       (ACTOR(p, g->player, flags) & ACTOR_FLAG_PLAYER);
+  free(actor);
+
+  if (!ok) {
+    WARN("The saved game at '%s' is damaged\n", path);
+    destroy_game(g);
+    return NULL;
+  }
+
+  g->scheduler->now   = record.now;
+  g->scheduler->order = record.order;
+
+  /*  putting the actors back changes nothing which needs saving */
+  for (z = 0; z < DUNGEON_DEPTH; z++) {
+    if (g->dungeon->map[z] != NULL) {
+      g->dungeon->map[z]->unsaved     = 0;
+      g->dungeon->map[z]->save_serial = record.level_serial[z];
+    }
+  }
+
+  g->save_path = path;
+  prefetch_level(g, ACTOR(p, g->player, z) + 1);
+
+  INFO("Loaded the game saved at '%s' (save %lu, turn %lu)\n", path,
+    g->saves, g->turns);
+  return g;
+}
+
+/*
+ *  removes a saved game, once it cannot be resumed: the level files its
+ *  game file names, and then the game file; levels mapped in memory keep
+ *  their files until they are freed
+ *
+ *  char *path -- the save path
+ *  void return
+ */
+void remove_save(char *path)
+{
+  struct save_game record;
+  FILE *f;
+  int found, z;
+
+  f = open_game_file(path, &record, &found);
+  if (f != NULL) {
+    fclose(f);
+
+    for (z = 0; z < DUNGEON_DEPTH; z++) {
+      if (record.level_serial[z] != 0) {
+        remove_level_file(path, z, record.level_serial[z]);
+      }
+    }
+  }
+
+  remove(path);
+  INFO("Removed the game saved at '%s'\n", path);
+}
+
+/*
+ *  unmaps the saved level a map was loaded from, if any, once the map is
+ *  freed
+ *
+ *  struct map *m -- the map structure
+ *  void return
+ */
+void unmap_level(struct map *m)
+{
+  if (m->save_data == NULL) {
+    return;
+  }
+
+  DEBUG("Unmapping saved level @0x%p\n", m->save_data);
+  munmap(m->save_data, m->save_size);
+  m->save_data = NULL;
+}
@@ -0,0 +1,243 @@
+
+/*
+ *  scheduler.c
+ *  Part of Amuleta, a traditional roguelike - https://deveah.github.io/amuleta
+ *  (c) Vlad Dumitru, <dalv.urtimud@gmail.com>
+ *  Licensed under the terms and conditions of the MIT License. Please consult
+ *  the LICENSE file included with this project.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <termbox.h>
+#include "amuleta.h"
+
+/*
+ *  allocates an empty scheduler
+ *
+ *  struct scheduler *return -- the scheduler
+ */
+struct scheduler *create_scheduler(void)
+{
+  struct scheduler *s = (struct scheduler*)malloc(sizeof(struct scheduler));
+  assert(s != NULL);
+  DEBUG("Allocated scheduler @0x%p\n", s);
+
+  s->heap     = NULL;
+  s->size     = 0;
+  s->capacity = 0;
+  s->now      = 0;
+  s->order    = 0;
+
+  return s;
+}
+
+/*
+ *  frees a scheduler
+ *
+ *  struct scheduler *s -- the scheduler
+ *  void return
+ */
+void destroy_scheduler(struct scheduler *s)
+{
+  DEBUG("Deallocating scheduler @0x%p\n", s);
+  free(s->heap);
+  free(s);
+}
+
+/*
+ *  checks whether a heap entry is due before another one
+ *
+ *  struct scheduler_entry *a, *b -- the entries
+ *  int return                    -- non-zero if `a' is due first
+ */
+static int due_before(struct scheduler_entry *a, struct scheduler_entry *b)
+{
+  if (a->time != b->time) {
+    return a->time < b->time;
+  }
+
+  return a->order < b->order;
+}
+
+/*
+ *  stores an entry at a given position in the heap, and lets its actor know
+ *
+ *  struct scheduler *s       -- the scheduler
+ *  struct actor_pool *p      -- the actor pool
+ *  int i                     -- the position
+ *  struct scheduler_entry *e -- the entry
+ *  void return
+ */
+static void place(struct scheduler *s, struct actor_pool *p, int i,
+  struct scheduler_entry *e)
+{
+  s->heap[i] = *e;
+  ACTOR(p, e->actor, heap_index) = i;
+}
+
+/*
+ *  moves an entry up the heap until its parent is due before it
+ *
+ *  struct scheduler *s   -- the scheduler
+ *  struct actor_pool *p  -- the actor pool
+ *  int i                 -- the position of the entry
+ *  void return
+ */
+static void sift_up(struct scheduler *s, struct actor_pool *p, int i)
+{
+  struct scheduler_entry e = s->heap[i];
+
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+
+    if (!due_before(&e, &s->heap[parent])) {
+      break;
+    }
+
+    place(s, p, i, &s->heap[parent]);
+    i = parent;
+  }
+
+  place(s, p, i, &e);
+}
+
+/*
+ *  moves an entry down the heap until it is due before both of its children
+ *
+ *  struct scheduler *s   -- the scheduler
+ *  struct actor_pool *p  -- the actor pool
+ *  int i                 -- the position of the entry
+ *  void return
+ */
+static void sift_down(struct scheduler *s, struct actor_pool *p, int i)
+{
+  struct scheduler_entry e = s->heap[i];
+
+  while (1) {
+    int child = 2 * i + 1;
+
+    if (child >= s->size) {
+      break;
+    }
+
+    if ((child + 1 < s->size) &&
+        (due_before(&s->heap[child + 1], &s->heap[child]))) {
+      child++;
+    }
+
+    if (!due_before(&s->heap[child], &e)) {
+      break;
+    }
+
+    place(s, p, i, &s->heap[child]);
+    i = child;
+  }
+
+  place(s, p, i, &e);
+}
+
+/*
+ *  schedules an actor to act after a given delay; the actor must not be
+ *  scheduled already
+ *
+ *  struct scheduler *s   -- the scheduler
+ *  struct actor_pool *p  -- the actor pool
+ *  actor_handle a        -- the actor
+ *  unsigned long delay   -- number of ticks from now on
+ *  void return
+ */
+void schedule_actor(struct scheduler *s, struct actor_pool *p, actor_handle a,
+  unsigned long delay)
+{
+  schedule_actor_at(s, p, a, s->now + delay, s->order++);
+}
+
+/*
+ *  schedules an actor to act at a given time, with a given place among the
+ *  actors due at the same time, as a saved game does when it is loaded; the
+ *  actor must not be scheduled already
+ *
+ *  struct scheduler *s   -- the scheduler
+ *  struct actor_pool *p  -- the actor pool
+ *  actor_handle a        -- the actor
+ *  unsigned long time    -- when the actor acts
+ *  unsigned long order   -- the order in which the actor was scheduled
+ *  void return
+ */
+void schedule_actor_at(struct scheduler *s, struct actor_pool *p,
+  actor_handle a, unsigned long time, unsigned long order)
+{
+  assert(ACTOR(p, a, heap_index) < 0);
+
+  if (s->size == s->capacity) {
+    s->capacity = (s->capacity == 0) ? 64 : s->capacity * 2;
+    s->heap = (struct scheduler_entry*)realloc(s->heap,
+      sizeof(struct scheduler_entry) * s->capacity);
+    assert(s->heap != NULL);
+  }
+
+  s->heap[s->size].time  = time;
+  s->heap[s->size].order = order;
+  s->heap[s->size].actor = a;
+  s->size++;
+
+  sift_up(s, p, s->size - 1);
+}
+
+/*
+ *  removes an actor from the scheduler, if it is scheduled
+ *
+ *  struct scheduler *s   -- the scheduler
+ *  struct actor_pool *p  -- the actor pool
+ *  actor_handle a        -- the actor
+ *  void return
+ */
+void unschedule_actor(struct scheduler *s, struct actor_pool *p,
+  actor_handle a)
+{
+  int i = ACTOR(p, a, heap_index);
+
+  if (i < 0) {
+    return;
+  }
+
+  ACTOR(p, a, heap_index) = -1;
+  s->size--;
+
+  /*  fill the hole with the last entry, which may belong either above or
+   *  below it */
+  if (i < s->size) {
+    place(s, p, i, &s->heap[s->size]);
+
+    if ((i > 0) && (due_before(&s->heap[i], &s->heap[(i - 1) / 2]))) {
+      sift_up(s, p, i);
+    } else {
+      sift_down(s, p, i);
+    }
+  }
+}
+
+/*
+ *  takes the actor due to act next out of the scheduler, and advances the
+ *  time to when it acts
+ *
+ *  struct scheduler *s   -- the scheduler
+ *  struct actor_pool *p  -- the actor pool
+ *  actor_handle return   -- the actor, or ACTOR_NONE if nobody is scheduled
+ */
+actor_handle next_actor(struct scheduler *s, struct actor_pool *p)
+{
+  actor_handle a;
+
+  if (s->size == 0) {
+    return ACTOR_NONE;
+  }
+
+  a = s->heap[0].actor;
+  s->now = s->heap[0].time;
+
+  unschedule_actor(s, p, a);
+  return a;
+}
+
@@ -43,3 +43,22 @@ struct tile wall_tile = {
   .flags = TILE_FLAG_SOLID | TILE_FLAG_OPAQUE
 };
 
+struct tb_cell stairs_down_tile_cell = {
+  .ch = '>',
+  .fg = TB_WHITE,
+  .bg = TB_DEFAULT
+};
+
+struct tile stairs_down_tile = {
+  .cell  = &stairs_down_tile_cell,
+  .flags = 0
+};
+
+/*  maps a tile identifier (as stored in `struct map') to its tile */
+struct tile *tile_palette[TILE_COUNT] = {
+  &void_tile,
+  &floor_tile,
+  &wall_tile,
+  &stairs_down_tile
+};
+
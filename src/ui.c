@@ -13,12 +13,375 @@
 #include <termbox.h>
 #include "amuleta.h"
 
-struct tb_cell
-  *default_character_map,
-  *highlighted_character_map;
+/*
+ *  creates the user interface state needed to play a game in the terminal
+ *
+ *  struct ui *return -- the user interface structure
+ */
+struct ui *create_ui(void)
+{
+  struct ui *ui = (struct ui*)malloc(sizeof(struct ui));
+  assert(ui != NULL);
+  DEBUG("Allocated user interface @0x%p\n", ui);
+
+  /*  generate the character maps used to display strings */
+  ui->default_character_map     = generate_character_map(TB_WHITE, TB_DEFAULT);
+  ui->highlighted_character_map = generate_character_map(TB_WHITE | TB_BOLD, TB_DEFAULT);
+
+  /*  nothing is on screen yet */
+  ui->drawn_z = -1;
+
+  /*  termbox's back buffer is looked up anew every frame */
+  ui->offscreen     = 0;
+  ui->screen        = NULL;
+  ui->screen_width  = 0;
+  ui->screen_height = 0;
+
+  ui->camera_x    = 0;
+  ui->camera_y    = 0;
+  ui->view_width  = 0;
+  ui->view_height = 0;
+
+  return ui;
+}
+
+/*
+ *  creates a user interface which draws into a buffer of its own rather than
+ *  into the terminal, so that drawing can be exercised without termbox
+ *
+ *  int width, height -- the dimensions of the screen buffer
+ *  struct ui *return -- the user interface structure
+ */
+struct ui *create_offscreen_ui(int width, int height)
+{
+  struct ui *ui = create_ui();
+
+  ui->offscreen     = 1;
+  ui->screen_width  = width;
+  ui->screen_height = height;
+  ui->screen = (struct tb_cell*)calloc(width * height, sizeof(struct tb_cell));
+  assert(ui->screen != NULL);
+  DEBUG("Allocated off-screen buffer @0x%p (%ix%i)\n", ui->screen, width,
+    height);
+
+  return ui;
+}
+
+/*
+ *  frees the user interface state
+ *
+ *  struct ui *ui -- the user interface structure
+ *  void return
+ */
+void destroy_ui(struct ui *ui)
+{
+  DEBUG("Deallocating user interface @0x%p\n", ui);
+  free_character_map(ui->default_character_map);
+  free_character_map(ui->highlighted_character_map);
+
+  if (ui->offscreen) {
+    free(ui->screen);
+  }
+
+  free(ui);
+}
+
+/*
+ *  draws a single cell onto the screen, unless it falls outside of it
+ *
+ *  struct ui *ui         -- the user interface structure
+ *  int x, y              -- the coordinates of the cell
+ *  struct tb_cell *cell  -- the cell
+ *  void return
+ */
+static void put_cell(struct ui *ui, int x, int y, struct tb_cell *cell)
+{
+  if ((x < 0) || (x >= ui->screen_width) ||
+      (y < 0) || (y >= ui->screen_height)) {
+    return;
+  }
+
+  ui->screen[y * ui->screen_width + x] = *cell;
+}
+
+/*
+ *  works out how a cell of a map appears: the actor standing there, or the
+ *  terrain, if the player sees it; the terrain in a dim colour if the player
+ *  only remembers it; and nothing otherwise
+ *
+ *  struct game *g        -- the game structure
+ *  struct map *m         -- the map
+ *  int x, y              -- the coordinates of the cell
+ *  struct tb_cell *cell  -- the appearance, to be filled in
+ *  void return
+ */
+static void look_at(struct game *g, struct map *m, int x, int y,
+  struct tb_cell *cell)
+{
+  if (view_contains(&m->view, x, y)) {
+    actor_handle a = get_occupant(m, x, y);
+
+    if (a != ACTOR_NONE) {
+      *cell = *ACTOR(g->actors, a, cell);
+    } else {
+      *cell = MAP_CELL(m, terrain, x, y);
+    }
+  } else if (MAP_CELL_TEST(m, LAYER_REMEMBERED, x, y)) {
+    *cell    = MAP_CELL(m, terrain, x, y);
+    cell->fg = TB_BLUE;
+  } else {
+    cell->ch = ' ';
+    cell->fg = TB_DEFAULT;
+    cell->bg = TB_DEFAULT;
+  }
+}
+
+/*
+ *  draws a single cell of a map, as the player sees it (see look_at()),
+ *  unless the camera does not show it
+ *
+ *  struct game *g  -- the game structure
+ *  struct map *m   -- the map
+ *  int x, y        -- the coordinates of the cell on the level
+ *  void return
+ */
+static void draw_cell(struct game *g, struct map *m, int x, int y)
+{
+  struct ui *ui = g->ui;
+  struct tb_cell cell;
+
+  x -= ui->camera_x;
+  y -= ui->camera_y;
+  if ((x < 0) || (x >= ui->view_width) || (y < 0) || (y >= ui->view_height)) {
+    return;
+  }
+
+  look_at(g, m, ui->camera_x + x, ui->camera_y + y, &cell);
+  put_cell(ui, x, y, &cell);
+}
 
 /*
- *  draw a map on the screen
+ *  draws the part of a map the camera shows, as the player sees it (see
+ *  look_at()), straight into the screen buffer; the composed terrain is
+ *  copied one chunk's worth of a row at a time, then the cells with an actor
+ *  in view, and those out of view, are patched
+ *
+ *  struct game *g  -- the game structure
+ *  struct map *m   -- the map
+ *  void return
+ */
+static void draw_whole_map(struct game *g, struct map *m)
+{
+  struct ui *ui = g->ui;
+  struct tb_cell blank;
+  int i, j, k, n;
+
+  blank.ch = ' ';
+  blank.fg = TB_DEFAULT;
+  blank.bg = TB_DEFAULT;
+
+  for (j = 0; j < ui->view_height; j++) {
+    struct tb_cell *row = &ui->screen[j * ui->screen_width];
+    int y = ui->camera_y + j;
+
+    for (i = 0; i < ui->view_width; i += n) {
+      int x = ui->camera_x + i;
+      struct map_chunk *c = MAP_CHUNK(m, x, y);
+      unsigned int run, seen, remembered, bits;
+
+      n = CHUNK_SIZE - (x & CHUNK_MASK);
+      if (n > ui->view_width - i) {
+        n = ui->view_width - i;
+      }
+      run = (n < CHUNK_SIZE) ? (1u << n) - 1 : ~0u;
+
+      seen       = view_run(&m->view, x, y, n);
+      remembered = (c->bits[LAYER_REMEMBERED][y & CHUNK_MASK] >>
+                    (x & CHUNK_MASK)) & run & ~seen;
+
+      /*  a run the player knows nothing about is left blank */
+      if ((seen | remembered) == 0) {
+        for (k = 0; k < n; k++) {
+          row[i + k] = blank;
+        }
+        continue;
+      }
+
+      memcpy(&row[i], &c->terrain[y & CHUNK_MASK][x & CHUNK_MASK],
+        n * sizeof(struct tb_cell));
+
+      /*  actors are only shown where the player sees them */
+      bits = (c->bits[LAYER_OCCUPIED][y & CHUNK_MASK] >> (x & CHUNK_MASK)) &
+             seen;
+      while (bits) {
+        k = lowest_word_bit(bits);
+        row[i + k] = *ACTOR(g->actors, get_occupant(m, x + k, y), cell);
+        bits &= bits - 1;
+      }
+
+      /*  remembered terrain is dimmed, and the rest left blank */
+      bits = run & ~seen;
+      while (bits) {
+        k = lowest_word_bit(bits);
+        if (remembered & (1u << k)) {
+          row[i + k].fg = TB_BLUE;
+        } else {
+          row[i + k] = blank;
+        }
+        bits &= bits - 1;
+      }
+    }
+  }
+}
+
+/*
+ *  moves one axis of the camera so that a given position stays on screen,
+ *  away from its edges: the camera only moves once the position comes
+ *  within a quarter of the view of an edge, and never shows more than the
+ *  level
+ *
+ *  int camera  -- the camera's first cell on the axis
+ *  int view    -- the dimension of the view on the axis
+ *  int size    -- the dimension of the level on the axis
+ *  int p       -- the position on the axis
+ *  int return  -- the camera's new first cell
+ */
+static int follow(int camera, int view, int size, int p)
+{
+  int margin = view / 4;
+
+  if (p < camera + margin) {
+    camera = p - margin;
+  } else if (p >= camera + view - margin) {
+    camera = p - view + margin + 1;
+  }
+
+  if (camera > size - view) {
+    camera = size - view;
+  }
+  if (camera < 0) {
+    camera = 0;
+  }
+
+  return camera;
+}
+
+/*
+ *  fits the view of a map on the screen, and points the camera at the
+ *  player; the whole view is to be drawn again if either changed
+ *
+ *  struct game *g  -- the game structure
+ *  struct map *m   -- the map
+ *  int z           -- the depth of the map
+ *  void return
+ */
+static void move_camera(struct game *g, struct map *m, int z)
+{
+  struct ui *ui = g->ui;
+  int width  = ui->screen_width,
+      height = ui->screen_height - UI_STATUS_LINES;
+  int x = ui->camera_x,
+      y = ui->camera_y;
+
+  width  = (width < m->width) ? width : m->width;
+  height = (height < m->height) ? height : m->height;
+  if (height < 0) {
+    height = 0;
+  }
+
+  if ((actor_alive(g->actors, g->player)) &&
+      (ACTOR(g->actors, g->player, z) == z)) {
+    int px = ACTOR(g->actors, g->player, x),
+        py = ACTOR(g->actors, g->player, y);
+
+    /*  a level just arrived at is shown centred on the player */
+    if (ui->drawn_z != z) {
+      x = px - width / 2;
+      y = py - height / 2;
+    }
+
+    x = follow(x, width, m->width, px);
+    y = follow(y, height, m->height, py);
+  } else {
+    /*  only keep the camera within the level */
+    x = follow(x, width, m->width, x + width / 2);
+    y = follow(y, height, m->height, y + height / 2);
+  }
+
+  if ((x != ui->camera_x) || (y != ui->camera_y) ||
+      (width != ui->view_width) || (height != ui->view_height)) {
+    m->redraw = 1;
+  }
+
+  ui->camera_x    = x;
+  ui->camera_y    = y;
+  ui->view_width  = width;
+  ui->view_height = height;
+}
+
+/*
+ *  draws a status line, unless the same text is already on screen
+ *
+ *  struct ui *ui           -- the user interface structure
+ *  int line                -- the status line index
+ *  struct tb_cell *charmap -- the character map
+ *  char *s                 -- the text
+ *  void return
+ */
+static void draw_status(struct ui *ui, int line, struct tb_cell *charmap,
+  char *s)
+{
+  int old_length = strlen(ui->status[line]);
+  int length = strlen(s);
+  int i;
+
+  if (strcmp(ui->status[line], s) == 0) {
+    return;
+  }
+
+  for (i = 0; i < length; i++) {
+    put_cell(ui, i, ui->view_height + line, &charmap[(unsigned char)s[i]]);
+  }
+
+  /*  erase whatever is left of the previous text */
+  while (old_length > length) {
+    old_length--;
+    put_cell(ui, old_length, ui->view_height + line, &charmap[' ']);
+  }
+
+  strncpy(ui->status[line], s, MINIMUM_TERMINAL_WIDTH);
+  ui->status[line][MINIMUM_TERMINAL_WIDTH] = '\0';
+}
+
+/*
+ *  clears the whole screen
+ *
+ *  struct ui *ui -- the user interface structure
+ *  void return
+ */
+static void clear_screen(struct ui *ui)
+{
+  struct tb_cell blank;
+  int i;
+
+  if (!ui->offscreen) {
+    tb_clear();
+    return;
+  }
+
+  blank.ch = ' ';
+  blank.fg = TB_DEFAULT;
+  blank.bg = TB_DEFAULT;
+  for (i = 0; i < ui->screen_width * ui->screen_height; i++) {
+    ui->screen[i] = blank;
+  }
+}
+
+/*
+ *  draw a map on the screen, as the player sees it, through a camera which
+ *  follows the player (see move_camera()); only the cells which changed since
+ *  the last call are drawn, unless another level was on screen, or the camera
+ *  moved; either way, only the chunks on screen are looked at
  *
  *  struct game *g -- the game structure which contains the map
  *  int z          -- the depth of the map to draw
@@ -27,36 +390,59 @@ struct tb_cell
 void draw_map(struct game *g, int z)
 {
   struct map *m = g->dungeon->map[z];
-  int i, j;
+  struct ui *ui = g->ui;
+  int i;
 
   DEBUG("Drawing the screen\n");
 
-  /*  clear the screen before drawing */
-  tb_clear();
+  /*  termbox's back buffer moves when the terminal is resized */
+  if (!ui->offscreen) {
+    ui->screen        = tb_cell_buffer();
+    ui->screen_width  = tb_width();
+    ui->screen_height = tb_height();
+  }
 
-  /*  draw the tiles contained by the map */
-  for (i = 0; i < MAP_WIDTH; i++) {
-    for (j = 0; j < MAP_HEIGHT; j++) {
-      tb_put_cell(i, j, m->tile[i][j]->cell);
-    }
+  move_camera(g, m, z);
+  if ((ui->view_width > 0) && (ui->view_height > 0)) {
+    compose_terrain(m, ui->camera_x, ui->camera_y, ui->view_width,
+      ui->view_height);
   }
 
-  /*  draw the actors on this map */
-  struct actor *current = g->actors;
-  while (current) {
-    if (current->z == z) {
-      DEBUG("Drawing actor @0x%p (%s) at %i, %i\n", current,
-        current->name, current->x, current->y);
-      tb_put_cell(current->x, current->y, current->cell);
+  /*  the map shows what the player sees from where they stand; cells which
+   *  came into view or left it are marked dirty */
+  if ((actor_alive(g->actors, g->player)) &&
+      (ACTOR(g->actors, g->player, z) == z)) {
+    update_fov(m, ACTOR(g->actors, g->player, x),
+      ACTOR(g->actors, g->player, y), MAP_SIGHT_RADIUS);
+  }
+
+  if ((m->redraw) || (ui->drawn_z != z)) {
+    /*  draw everything from scratch */
+    clear_screen(ui);
+    draw_whole_map(g, m);
+
+    for (i = 0; i < UI_STATUS_LINES; i++) {
+      ui->status[i][0] = '\0';
+    }
+
+    ui->drawn_z = z;
+  } else {
+    /*  draw only the cells which changed */
+    for (i = 0; i < m->dirty_count; i++) {
+      draw_cell(g, m, m->dirty_cell[i] % m->width,
+        m->dirty_cell[i] / m->width);
     }
-    current = current->next;
   }
 
-  tb_puts(0, MAP_HEIGHT,   highlighted_character_map, "Welcome to Amuleta!");
-  tb_puts(0, MAP_HEIGHT+1, default_character_map,     "Please don't die often.");
+  clear_dirty(m);
+
+  draw_status(ui, 0, ui->highlighted_character_map, "Welcome to Amuleta!");
+  draw_status(ui, 1, ui->default_character_map,     "Please don't die often.");
 
   /*  present the screen buffer */
-  tb_present();
+  if (!ui->offscreen) {
+    tb_present();
+  }
 
   DEBUG("Finised drawing the screen\n");
 }